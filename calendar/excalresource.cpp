@@ -23,6 +23,7 @@
 #include "excalresource.h"
 
 #include <QtDBus/QDBusConnection>
+#include <QTextDocumentFragment>
 
 #include <KLocalizedString>
 #include <KWindowSystem>
@@ -38,6 +39,7 @@
 
 #include <libmapi/mapi_nameid.h>
 #include "mapiconnector2.h"
+#include "mapistatistics.h"
 #include "profiledialog.h"
 
 /**
@@ -237,6 +239,38 @@ const QString ExCalResource::profile()
     return Settings::self()->profileName();
 }
 
+MapiMessage::BodyFormat ExCalResource::bodyFormat()
+{
+    switch (Settings::self()->bodyFormat()) {
+    case Settings::TextBody:
+        return MapiMessage::BodyText;
+    case Settings::TextAndHtmlBody:
+        return MapiMessage::BodyTextAndHtml;
+    default:
+        return MapiMessage::BodyNative;
+    }
+}
+
+void ExCalResource::syncWindow(const Akonadi::Collection &collection, MapiFolder &folder)
+{
+    unsigned pastDays = Settings::self()->syncWindowPastDays();
+    unsigned futureDays = Settings::self()->syncWindowFutureDays();
+    QDateTime now = QDateTime::currentDateTime();
+    QDateTime from;
+    QDateTime to;
+
+    if (Settings::self()->syncWindowFullCollections().contains((int)collection.id())) {
+        return;
+    }
+    if (pastDays) {
+        from = now.addDays(-(int)pastDays);
+    }
+    if (futureDays) {
+        to = now.addDays(futureDays);
+    }
+    folder.setWindow(PidLidAppointmentStartWhole, PidLidAppointmentEndWhole, from, to, PidLidRecurring);
+}
+
 void ExCalResource::retrieveCollections()
 {
     Collection::List collections;
@@ -262,14 +296,18 @@ void ExCalResource::retrieveItems(const Akonadi::Collection &collection)
     Item::List items;
     Item::List deletedItems;
 
-    fetchItems(collection, items, deletedItems);
-    kError() << "new/changed items:" << items.size() << "deleted items:" << deletedItems.size();
+    if (!fetchItems(collection, items, deletedItems)) {
+        return;
+    }
+    MAPI_LOG(Sync, kDebug()) << "new/changed items:" << items.size() << "deleted items:" << deletedItems.size();
     itemsRetrievedIncremental(items, deletedItems);
+    itemsRetrievalDone();
 }
 
 bool ExCalResource::retrieveItem(const Akonadi::Item &itemOrig, const QSet<QByteArray> &parts)
 {
     Q_UNUSED(parts);
+    MapiLatency latency(m_statistics, MapiStatistics::RetrieveItem, itemOrig.parentCollection());
 
     // Eeeek. This is a bit racy, but hopefully good enough until we find out
     // what the rules really are.
@@ -278,7 +316,7 @@ bool ExCalResource::retrieveItem(const Akonadi::Item &itemOrig, const QSet<QByte
         return true;
     }
 
-    MapiAppointment *message = fetchItem<MapiAppointment>(itemOrig);
+    MapiAppointment *message = fetchItem<MapiAppointment>(itemOrig, itemOrig.parentCollection());
     if (!message) {
         return false;
     }
@@ -340,7 +378,7 @@ void ExCalResource::createExceptionItem(KJob *job)
     m_exceptionItems.removeFirst();
 
     // Save the new item in Akonadi.
-    kError() << __FUNCTION__ << "create" << item.remoteId() << "in" << item.parentCollection();
+    MAPI_LOG(Sync, kDebug()) << __FUNCTION__ << "create" << item.remoteId() << "in" << item.parentCollection();
     Akonadi::ItemCreateJob *createJob = new Akonadi::ItemCreateJob(item, item.parentCollection());
     connect(createJob, SIGNAL(result(KJob *)), SLOT(createExceptionItemDone(KJob *)));
 }
@@ -389,7 +427,9 @@ void ExCalResource::configure(WId windowId)
 void ExCalResource::itemAdded( const Akonadi::Item &item, const Akonadi::Collection &collection )
 {
     Q_UNUSED( item );
-    Q_UNUSED( collection );
+
+    // Akonadi now has an item which the sync index does not know about.
+    syncIndexInvalidate(collection);
 
     // TODO: this method is called when somebody else, e.g. a client application,
     // has created an item in a collection managed by your resource.
@@ -408,7 +448,7 @@ void ExCalResource::itemChanged(const Akonadi::Item &item, const QSet<QByteArray
     return;
 
     // Get the payload for the item.
-    kWarning() << "fetch cached item: {" <<
+    MAPI_LOG(Sync, kDebug()) << "fetch cached item: {" <<
         item.parentCollection().name() << "," << item.id() << "} = {" <<
         item.parentCollection().remoteId() << "," << item.remoteId() << "}";
     Akonadi::ItemFetchJob *job = new Akonadi::ItemFetchJob(item);
@@ -428,7 +468,7 @@ void ExCalResource::itemChangedContinue(KJob* job)
     Akonadi::ItemFetchJob *fetchJob = qobject_cast<Akonadi::ItemFetchJob*>(job);
     const Akonadi::Item item = fetchJob->items().first();
 
-    MapiAppointment *message = fetchItem<MapiAppointment>(item);
+    MapiAppointment *message = fetchItem<MapiAppointment>(item, item.parentCollection());
     if (!message) {
         return;
     }
@@ -482,7 +522,7 @@ void ExCalResource::itemChangedContinue(KJob* job)
     message->ex2kcalRecurrency(event->recurrence());
 
     // Update exchange with the new message->
-    kWarning() << "updating item: {" <<
+    MAPI_LOG(Sync, kDebug()) << "updating item: {" <<
         currentCollection().name() << "," << item.id() << "} = {" <<
         currentCollection().remoteId() << "," << item.remoteId() << "}";
     emit status(Running, i18n("Updating item: { %1, %2 }", currentCollection().name(), item.id()));
@@ -496,7 +536,8 @@ void ExCalResource::itemChangedContinue(KJob* job)
 
 void ExCalResource::itemRemoved( const Akonadi::Item &item )
 {
-  Q_UNUSED( item );
+  // Akonadi no longer has an item which the sync index knows about.
+  syncIndexInvalidate(item.parentCollection());
 
   // TODO: this method is called when somebody else, e.g. a client application,
   // has deleted an item managed by your resource.
@@ -628,7 +669,7 @@ void MapiAppointment::ex2kcalRecurrency(AppointmentRecurrencePattern *pattern, K
                     ex->EndType);
         break;
     }
-    debug() << description;
+    MAPI_LOG(Payloads, debug()) << description;
 
     // We have dealt with the basic recurrence, now see what exceptions we have.
     for (int i = 0; i < pattern->ExceptionCount; i++) {
@@ -702,11 +743,9 @@ bool MapiAppointment::preparePayload()
         case PidLidResponseStatus:
             responseStatus = (ResponseStatus)property.value().toUInt();
             break;
-        case PidTagBody:
-            bodyText = property.value().toString();
-            break;
-        case PidTagHtml:
-            bodyHtml = property.value().toString();
+        case PidTagNativeBody:
+        case PidTagRtfInSync:
+            // Handled by bodyPull().
             break;
         case PidLidTimeZoneStruct:
             timezone = get_TimeZoneStruct(ctx(), &m_properties[i].value.bin);
@@ -751,34 +790,20 @@ bool MapiAppointment::preparePayload()
             header = property.value().toString();
             break;
         default:
-            // Handle oversize objects.
-            if (MAPI_E_NOT_ENOUGH_MEMORY == property.value().toInt()) {
-                switch (property.tag()) {
-                case PidTagBody_Error:
-                    if (!streamRead(&m_object, PidTagBody, CODEPAGE_UTF16, bodyText)) {
-                        return false;
-                    }
-                    break;
-                case PidTagHtml_Error:
-                    if (!streamRead(&m_object, PidTagHtml, CODEPAGE_UTF16, bodyHtml)) {
-                        return false;
-                    }
-                    break;
-                default:
-                    error() << "missing oversize support:" << tagName(property.tag());
-                    break;
-                }
-
-                // Carry on with next property...
-                break;
-            }
-#if (DEBUG_APPOINTMENT_PROPERTIES)
-            debug() << "ignoring appointment property:" << tagName(property.tag()) << property.value();
-#endif
+            MAPI_LOG(Payloads, debug()) << "ignoring appointment property:" << tagName(property.tag()) << property.value();
             break;
         }
     }
 
+    // Fetch whichever body formats we need. We always need the plain text
+    // for the description, so derive it locally if we only got HTML.
+    if (!bodyPull(CODEPAGE_UTF16, bodyText, bodyHtml)) {
+        return false;
+    }
+    if (bodyText.isEmpty() && !bodyHtml.isEmpty()) {
+        bodyText = QTextDocumentFragment::fromHtml(bodyHtml).toPlainText();
+    }
+
     if (embeddedInBody) {
         // Exchange puts half the information in the headers:
         //
@@ -1002,9 +1027,9 @@ bool MapiAppointment::propertiesPull(QVector<int> &tags, const bool tagsAppended
         //PidTagResponseRequested,
         // 2.2.1.37
         //PidTagReplyRequested,
-        // 2.2.1.38 Best Body Properties
-        PidTagBody,
-        PidTagHtml,
+        // 2.2.1.38 Best Body Properties (fetched by bodyPull())
+        PidTagNativeBody,
+        PidTagRtfInSync,
         // 2.2.1.39
         PidLidTimeZoneStruct,
         // 2.2.1.40
@@ -1133,7 +1158,7 @@ bool MapiAppointment::propertiesPush()
             data.recurrency.setData(pattern);
         } else {
             // TODO This should not happen. PidLidRecurrenceType says this is a recurring event, so why is there no PidLidAppointmentRecur???
-            debug() << "missing pattern in message"<<messageID<<"in folder"<<folderID;
+            MAPI_LOG(Payloads, debug()) << "missing pattern in message"<<messageID<<"in folder"<<folderID;
             }
     }
 
@@ -1143,26 +1168,26 @@ bool MapiAppointment::propertiesPush()
         return false;
     }
 #if 0
-    debug() << "************  OpenFolder";
+    MAPI_LOG(Messages, debug()) << "************  OpenFolder";
     if (!OpenFolder(&m_store, folder.id(), folder.d())) {
         error() << "cannot open folder" << folderID
             << ", error:" << mapiError();
         return false;
         }
-    debug() << "************  SaveChangesMessage";
+    MAPI_LOG(Messages, debug()) << "************  SaveChangesMessage";
     if (!SaveChangesMessage(folder.d(), message.d(), KeepOpenReadWrite)) {
         error() << "cannot save message" << messageID << "in folder" << folderID
             << ", error:" << mapiError();
         return false;
     }
 #endif
-    debug() << "************  SubmitMessage";
+    MAPI_LOG(Messages, debug()) << "************  SubmitMessage";
     if (MAPI_E_SUCCESS != SubmitMessage(&m_object)) {
         error() << "cannot submit message, error:" << mapiError();
         return false;
     }
     struct mapi_SPropValue_array replyProperties;
-    debug() << "************  TransportSend";
+    MAPI_LOG(Messages, debug()) << "************  TransportSend";
     if (MAPI_E_SUCCESS != TransportSend(&m_object, &replyProperties)) {
         error() << "cannot send message, error:" << mapiError();
         return false;
@@ -1250,7 +1275,7 @@ bool MapiAppointmentException::preparePayload()
     }
     description += i18n("\n    ChangeHighlight %1, state %2, reminderDelta %3, reminderSet %4, busyStatus %5, attachment %6, allDay %7",
                 changeHighlight, state, reminderDelta, reminderSet, busyStatus, attachment, allDay);
-    debug() << description;
+    MAPI_LOG(Payloads, debug()) << description;
 
     // Now set all the properties onto the item. Any items not specified by the
     // exception are just copied from the parent.
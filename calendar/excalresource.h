@@ -35,6 +35,10 @@ public:
 
     virtual const QString profile();
 
+    virtual MapiMessage::BodyFormat bodyFormat();
+
+    virtual void syncWindow(const Akonadi::Collection &collection, MapiFolder &folder);
+
 public Q_SLOTS:
     virtual void configure(WId windowId);
 
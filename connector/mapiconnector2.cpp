@@ -19,10 +19,13 @@
  */
 
 #include "mapiconnector2.h"
+#include "mapitracer.h"
 
 #include <QAbstractSocket>
 #include <QStringList>
+#include <QDataStream>
 #include <QDir>
+#include <QFile>
 #include <QMessageBox>
 #include <QRegExp>
 #include <QVariant>
@@ -32,10 +35,6 @@
 #include <KLocale>
 #include <kpimutils/email.h>
 
-#ifndef ENABLE_MAPI_DEBUG
-#define ENABLE_MAPI_DEBUG 1
-#endif
-
 #ifndef ENABLE_NOTIFICATIONS
 #define ENABLE_NOTIFICATIONS 0
 #endif
@@ -44,6 +43,25 @@
 #define ENABLE_PUBLIC_FOLDERS 0
 #endif
 
+/**
+ * How many resolved names to cache.
+ */
+#ifndef RESOLVE_CACHE_SIZE
+#define RESOLVE_CACHE_SIZE 2000
+#endif
+
+/**
+ * How long (in seconds) a resolved name is trusted.
+ */
+#ifndef RESOLVE_CACHE_TTL
+#define RESOLVE_CACHE_TTL (24 * 60 * 60)
+#endif
+
+/**
+ * Bump this if the format of the saved cache changes.
+ */
+#define RESOLVE_CACHE_VERSION 1
+
 #define STR(def) \
 case def: return QString::fromLatin1(#def)
 
@@ -141,57 +159,31 @@ static int profileSelectCallback(struct SRowSet *rowset, const void* /*private_v
     return rowset->cRows;
 }
 
-/**
- * An object which exists to enable MAPI debugging. This is intended to be
- * instantiated on the stack, as its destruction automatically resets the
- * debug settings.
- */
-class MapiDebug
-{
-public:
-    MapiDebug(MapiProfiles *context, bool enable) :
-        m_context(context->m_context),
-        m_enabled(enable)
-    {
-        if (m_enabled) {
-            if (MAPI_E_SUCCESS != SetMAPIDebugLevel(m_context, 9)) {
-                kError() << "cannot set debug level" << mapiError();
-            }
-            if (MAPI_E_SUCCESS != SetMAPIDumpData(m_context, true)) {
-                kError() << "cannot set dump data" << mapiError();
-            }
-        }
-    }
-
-    ~MapiDebug()
-    {
-        if (m_enabled) {
-            if (MAPI_E_SUCCESS != SetMAPIDebugLevel(m_context, 0)) {
-                kError() << "cannot reset debug level" << mapiError();
-            }
-            if (MAPI_E_SUCCESS != SetMAPIDumpData(m_context, false)) {
-                kError() << "cannot reset dump data" << mapiError();
-            }
-        }
-    }
-private:
-    mapi_context *m_context;
-    bool m_enabled;
-};
-
 MapiConnector2::MapiConnector2() :
     MapiProfiles(),
     m_session(0),
-    m_notifier(0)
+    m_notifier(0),
+    m_resolvedNames(RESOLVE_CACHE_SIZE),
+    m_resolvedNameHits(0),
+    m_resolvedNameMisses(0),
+    m_resolvedNameSaves(0)
 {
     m_store = allocate<mapi_object_t>();
     m_nspiStore = allocate<mapi_object_t>();
     mapi_object_init(m_store);
     mapi_object_init(m_nspiStore);
+    for (unsigned i = 0; i < RecipientStages; i++) {
+        m_recipientStages[i] = 0;
+    }
 }
 
 MapiConnector2::~MapiConnector2()
 {
+    MAPI_LOG(Recipients, debug()) << "resolved name cache hits:" << m_resolvedNameHits << "misses:" << m_resolvedNameMisses <<
+        "round trips saved:" << m_resolvedNameSaves;
+    MAPI_LOG(Recipients, debug()) << "recipients complete after table:" << m_recipientStages[RecipientTable] <<
+        "display:" << m_recipientStages[RecipientDisplay] << "local:" << m_recipientStages[RecipientLocal] <<
+        "server:" << m_recipientStages[RecipientServer];
     delete m_notifier;
     // TODO The calls to tidy up m_nspiStore seem to break things.
     if (m_session) {
@@ -219,7 +211,8 @@ bool MapiConnector2::defaultFolder(MapiDefaultFolder folderType, MapiId *id)
 #endif
     // NSPI-based assets.
     if ((PublicRoot <= folderType) && (folderType <= PublicNNTPArticle)) {
-        if (MAPI_E_SUCCESS != GetDefaultPublicFolder(m_nspiStore, &id->second, folderType)) {
+        MapiTrace trace(MapiTracer::GetDefaultPublicFolder);
+        if (MAPI_E_SUCCESS != trace(GetDefaultPublicFolder(m_nspiStore, &id->second, folderType))) {
             error() << "cannot get default public folder: %1" << folderType << mapiError();
             return false;
         }
@@ -229,7 +222,8 @@ bool MapiConnector2::defaultFolder(MapiDefaultFolder folderType, MapiId *id)
     }
 
     // EMSDB-based assets.
-    if (MAPI_E_SUCCESS != GetDefaultFolder(m_store, &id->second, folderType)) {
+    MapiTrace trace(MapiTracer::GetDefaultFolder);
+    if (MAPI_E_SUCCESS != trace(GetDefaultFolder(m_store, &id->second, folderType))) {
         error() << "cannot get default folder: %1" << folderType << mapiError();
         return false;
     }
@@ -246,7 +240,8 @@ QDebug MapiConnector2::error() const
 
 bool MapiConnector2::GALCount(unsigned *totalCount)
 {
-    if (MAPI_E_SUCCESS != GetGALTableCount(m_session, totalCount)) {
+    MapiTrace trace(MapiTracer::GetGALTableCount);
+    if (MAPI_E_SUCCESS != trace(GetGALTableCount(m_session, totalCount))) {
         error() << "cannot get GAL count" << mapiError();
         return false;
     }
@@ -255,7 +250,8 @@ bool MapiConnector2::GALCount(unsigned *totalCount)
 
 bool MapiConnector2::GALRead(unsigned requestedCount, SPropTagArray *tags, SRowSet **results, unsigned *percentagePosition)
 {
-    if (MAPI_E_SUCCESS != GetGALTable(m_session, tags, results, requestedCount, TABLE_CUR)) {
+    MapiTrace trace(MapiTracer::GetGALTable);
+    if (MAPI_E_SUCCESS != trace(GetGALTable(m_session, tags, results, requestedCount, TABLE_CUR))) {
         error() << "cannot read GAL entries" << mapiError();
         return false;
     }
@@ -289,7 +285,8 @@ bool MapiConnector2::GALSeek(const QString &displayName, unsigned *percentagePos
     key.ulPropTag = (MAPITAGS)PR_DISPLAY_NAME_UNICODE;
     key.dwAlignPad = 0;
     key.value.lpszW = string(displayName);
-    if (MAPI_E_SUCCESS != nspi_SeekEntries(nspi, ctx(), SortTypeDisplayName, &key, tags, NULL, results ? results : &dummy)) {
+    MapiTrace trace(MapiTracer::SeekEntries);
+    if (MAPI_E_SUCCESS != trace(nspi_SeekEntries(nspi, ctx(), SortTypeDisplayName, &key, tags, NULL, results ? results : &dummy))) {
         error() << "cannot seek to GAL entry" << displayName << mapiError();
         return false;
     }
@@ -321,23 +318,26 @@ bool MapiConnector2::login(QString profile)
         }
     }
 
+    m_galIndex.setFileName(MapiGalIndex::fileName(profile));
+
     // Log on
-    if (MAPI_E_SUCCESS != MapiLogonEx(m_context, &m_session, profile.toUtf8(), NULL)) {
+    MapiTrace trace(MapiTracer::MapiLogonEx);
+    if (MAPI_E_SUCCESS != trace(MapiLogonEx(m_context, &m_session, profile.toUtf8(), NULL))) {
         error() << "cannot logon using profile" << profile << mapiError();
         return false;
     }
-    if (MAPI_E_SUCCESS != OpenMsgStore(m_session, m_store)) {
+    trace.restart(MapiTracer::OpenMsgStore);
+    if (MAPI_E_SUCCESS != trace(OpenMsgStore(m_session, m_store))) {
         error() << "cannot open message store" << mapiError();
         return false;
     }
 #if (ENABLE_PUBLIC_FOLDERS)
-    if (MAPI_E_SUCCESS != OpenPublicFolder(m_session, m_nspiStore)) {
+    trace.restart(MapiTracer::OpenPublicFolder);
+    if (MAPI_E_SUCCESS != trace(OpenPublicFolder(m_session, m_nspiStore))) {
         error() << "cannot open public folder" << mapiError();
         return false;
     }
 #endif
-    MapiDebug debug(this, (0 != ENABLE_MAPI_DEBUG));
-
     // Get rid of any existing notifier and create a new one.
     // TODO Wait for a version of libmapi that has asingle parameter here.
 #if (ENABLE_NOTIFICATIONS)
@@ -387,13 +387,131 @@ void MapiConnector2::notified(int fd)
 bool MapiConnector2::resolveNames(const char *names[], SPropTagArray *tags,
                   SRowSet **results, PropertyTagArray_r **statuses)
 {
-    if (MAPI_E_SUCCESS != ResolveNames(m_session, names, tags, results, statuses, MAPI_UNICODE)) {
+    MapiTrace trace(MapiTracer::ResolveNames);
+    if (MAPI_E_SUCCESS != trace(ResolveNames(m_session, names, tags, results, statuses, MAPI_UNICODE))) {
         error() << "cannot resolve names" << mapiError();
         return false;
     }
     return true;
 }
 
+/**
+ * Names are matched ignoring case and whitespace.
+ */
+QString MapiConnector2::resolvedNameKey(const QString &name)
+{
+    return name.simplified().toCaseFolded();
+}
+
+bool MapiConnector2::resolvedNameFind(const QString &name, MapiResolvedName &resolved)
+{
+    QString key = resolvedNameKey(name);
+    if (key.isEmpty()) {
+        return false;
+    }
+
+    MapiResolvedName *entry = m_resolvedNames.object(key);
+    if (entry && (entry->resolved.secsTo(QDateTime::currentDateTime()) > RESOLVE_CACHE_TTL)) {
+        m_resolvedNames.remove(key);
+        entry = 0;
+    }
+    if (!entry) {
+        m_resolvedNameMisses++;
+        return false;
+    }
+    m_resolvedNameHits++;
+    resolved = *entry;
+    return true;
+}
+
+void MapiConnector2::resolvedNameInsert(const QString &name, const MapiResolvedName &resolved)
+{
+    QString key = resolvedNameKey(name);
+    if (key.isEmpty()) {
+        return;
+    }
+
+    MapiResolvedName *entry = new MapiResolvedName(resolved);
+    if (!entry->resolved.isValid()) {
+        entry->resolved = QDateTime::currentDateTime();
+    }
+    m_resolvedNames.insert(key, entry);
+}
+
+void MapiConnector2::resolvedNameSaved(unsigned count)
+{
+    unsigned before = m_resolvedNameSaves / 100;
+
+    m_resolvedNameSaves += count;
+    if ((m_resolvedNameSaves / 100) != before) {
+        MAPI_LOG(Recipients, debug()) << "resolved name cache hits:" << m_resolvedNameHits << "misses:" << m_resolvedNameMisses <<
+            "round trips saved:" << m_resolvedNameSaves;
+    }
+}
+
+void MapiConnector2::recipientStageExit(RecipientStage stage)
+{
+    unsigned total = 0;
+
+    m_recipientStages[stage]++;
+    for (unsigned i = 0; i < RecipientStages; i++) {
+        total += m_recipientStages[i];
+    }
+    if ((total % 1000) == 0) {
+        MAPI_LOG(Recipients, debug()) << "recipients complete after table:" << m_recipientStages[RecipientTable] <<
+            "display:" << m_recipientStages[RecipientDisplay] << "local:" << m_recipientStages[RecipientLocal] <<
+            "server:" << m_recipientStages[RecipientServer];
+    }
+}
+
+bool MapiConnector2::resolvedNamesLoad(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        // Nothing saved yet.
+        return false;
+    }
+
+    QDataStream stream(&file);
+    qint32 version;
+    stream >> version;
+    if (version != RESOLVE_CACHE_VERSION) {
+        error() << "ignoring resolved name cache version" << version;
+        return false;
+    }
+    while (!stream.atEnd()) {
+        QString key;
+        MapiResolvedName entry;
+
+        stream >> key >> entry.name >> entry.email >> entry.displayType >> entry.objectType >> entry.resolved;
+        if (stream.status() != QDataStream::Ok) {
+            error() << "cannot read resolved name cache" << fileName;
+            return false;
+        }
+        resolvedNameInsert(key, entry);
+    }
+    MAPI_LOG(Recipients, debug()) << "loaded resolved names:" << m_resolvedNames.size();
+    return true;
+}
+
+bool MapiConnector2::resolvedNamesSave(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        error() << "cannot save resolved name cache" << fileName;
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream << (qint32)RESOLVE_CACHE_VERSION;
+    foreach (const QString &key, m_resolvedNames.keys()) {
+        MapiResolvedName *entry = m_resolvedNames.object(key);
+
+        stream << key << entry->name << entry->email << entry->displayType << entry->objectType << entry->resolved;
+    }
+    return stream.status() == QDataStream::Ok;
+}
+
 /**
  * We store all objects in Akonadi using the densest string representation to hand:
  *
@@ -658,6 +776,22 @@ bool MapiProfiles::init()
     return true;
 }
 
+bool MapiProfiles::dumpSet(bool enable)
+{
+    if (!init()) {
+        return false;
+    }
+    if (MAPI_E_SUCCESS != SetMAPIDebugLevel(m_context, enable ? 9 : 0)) {
+        error() << "cannot set debug level" << mapiError();
+        return false;
+    }
+    if (MAPI_E_SUCCESS != SetMAPIDumpData(m_context, enable)) {
+        error() << "cannot set dump data" << mapiError();
+        return false;
+    }
+    return true;
+}
+
 QStringList MapiProfiles::list()
 {
     if (!init()) {
@@ -679,7 +813,7 @@ QStringList MapiProfiles::list()
 
         profiles.append(QString::fromLocal8Bit(name));
         if (dflt) {
-            debug() << "default profile:" << name;
+            MAPI_LOG(Connection, debug()) << "default profile:" << name;
         }
     }
     return profiles;
@@ -819,15 +953,13 @@ TALLOC_CTX *TallocContext::ctx()
 QDebug TallocContext::debug(const QString &caller) const
 {
     static QString prefix = QString::fromAscii("%1.%2");
-    QString talloc = QString::fromAscii(talloc_get_name(m_ctx));
-    return qDebug() << prefix.arg(talloc).arg(caller);
+    return qDebug() << prefix.arg(QString::fromAscii(talloc_get_name(m_ctx)), caller);
 }
 
 QDebug TallocContext::error(const QString &caller) const
 {
     static QString prefix = QString::fromAscii("%1.%2");
-    QString talloc = QString::fromAscii(talloc_get_name(m_ctx));
-    return qCritical() << prefix.arg(talloc).arg(caller);
+    return qCritical() << prefix.arg(QString::fromAscii(talloc_get_name(m_ctx)), caller);
 }
 
 char *TallocContext::string(const QString &original)
@@ -22,12 +22,16 @@
 #define MAPICONNECTOR2_H
 
 #include <QBitArray>
+#include <QCache>
 #include <QDateTime>
 #include <QDebug>
 #include <QList>
 #include <QMap>
 #include <QString>
 
+#include "mapigalindex.h"
+#include "mapilogging.h"
+
 extern "C" {
 // libmapi is a C library and must therefore be included that way
 // otherwise we'll get linker errors due to C++ name mangling
@@ -153,7 +157,9 @@ protected:
 
     /**
      * Debug and error reporting. Each subclass should reimplement with 
-     * logic that emits a prefix identifying the object involved. 
+     * logic that emits a prefix identifying the object involved. Since
+     * formatting the prefix is not free, debug() is best used through
+     * MAPI_LOG.
      */
     virtual QDebug debug() const = 0;
     virtual QDebug error() const = 0;
@@ -222,9 +228,13 @@ public:
      */
     bool remove(QString profile);
 
+    /**
+     * Switch libmapi's wire dumps on or off. See @ref MapiDumper.
+     */
+    bool dumpSet(bool enable);
+
 protected:
     mapi_context *m_context;
-    friend class MapiDebug;
 
     /**
      * Must be called first!
@@ -243,6 +253,30 @@ private:
     virtual QDebug error() const;
 };
 
+/**
+ * The result of resolving a name, as cached by @ref MapiConnector2. An
+ * empty email means the server could not resolve the name.
+ */
+class MapiResolvedName
+{
+public:
+    MapiResolvedName() :
+        displayType(0),
+        objectType(0)
+    {
+    }
+
+    QString name;
+    QString email;
+    unsigned displayType;
+    unsigned objectType;
+
+    /**
+     * When the name was resolved.
+     */
+    QDateTime resolved;
+};
+
 /**
  * The main class represents a connection to the MAPI server.
  */
@@ -304,6 +338,61 @@ public:
     bool resolveNames(const char *names[], SPropTagArray *tags,
               SRowSet **results, PropertyTagArray_r **statuses);
 
+    /**
+     * Look up a previously resolved name in the session-wide cache. Entries
+     * are evicted least-recently-used first, and expire after a while.
+     *
+     * @param name      The display name to look up.
+     * @param resolved  The cached resolution, if any.
+     * @return True on a hit.
+     */
+    bool resolvedNameFind(const QString &name, MapiResolvedName &resolved);
+
+    /**
+     * Add the result of resolving a name to the cache.
+     */
+    void resolvedNameInsert(const QString &name, const MapiResolvedName &resolved);
+
+    /**
+     * Note that server round trips to resolve names were avoided.
+     */
+    void resolvedNameSaved(unsigned count = 1);
+
+    /**
+     * The form of a name used as the key for the cache.
+     */
+    static QString resolvedNameKey(const QString &name);
+
+    /**
+     * The stages of recipient resolution, see @ref MapiMessage.
+     */
+    typedef enum {
+        RecipientTable = 0,     // The recipient table was complete.
+        RecipientDisplay,       // The display strings filled the gaps.
+        RecipientLocal,         // The cache or local GAL filled the gaps.
+        RecipientServer,        // We had to ask the server.
+        RecipientStages
+    } RecipientStage;
+
+    /**
+     * Note the stage at which a message's recipients were complete.
+     */
+    void recipientStageExit(RecipientStage stage);
+
+    /**
+     * The local copy of the GAL for the profile we are logged in with.
+     */
+    MapiGalIndex &galIndex()
+    {
+        return m_galIndex;
+    }
+
+    /**
+     * Load and save the cache so it survives restarts.
+     */
+    bool resolvedNamesLoad(const QString &fileName);
+    bool resolvedNamesSave(const QString &fileName);
+
 private:
     mapi_object_t openFolder(mapi_id_t folderID);
 
@@ -312,6 +401,16 @@ private:
     mapi_object_t *m_nspiStore;
     class QSocketNotifier *m_notifier;
 
+    /**
+     * Cache of resolved names, keyed by normalised display name.
+     */
+    QCache<QString, MapiResolvedName> m_resolvedNames;
+    unsigned m_resolvedNameHits;
+    unsigned m_resolvedNameMisses;
+    unsigned m_resolvedNameSaves;
+    MapiGalIndex m_galIndex;
+    unsigned m_recipientStages[RecipientStages];
+
     virtual QDebug debug() const;
     virtual QDebug error() const;
 
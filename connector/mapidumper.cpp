@@ -0,0 +1,184 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapidumper.h"
+
+#include <QCoreApplication>
+#include <KDebug>
+#include <KSaveFile>
+#include <KStandardDirs>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "mapiconnector2.h"
+#include "mapitracer.h"
+
+bool MapiDumper::s_enabled = false;
+int MapiDumper::s_scratch = -1;
+int MapiDumper::s_stdout = -1;
+QStringList MapiDumper::s_filter;
+QList<QByteArray> MapiDumper::s_dumps;
+int MapiDumper::s_size = 0;
+quint64 MapiDumper::s_dropped = 0;
+
+MapiDumper::MapiDumper(MapiProfiles *connection, QObject *parent) :
+    QObject(parent),
+    m_connection(connection)
+{
+    m_drainTimer.setInterval(DUMP_DRAIN_INTERVAL);
+    connect(&m_drainTimer, SIGNAL(timeout()), SLOT(drain()));
+    if (ENABLE_MAPI_DEBUG) {
+        setEnabled(true);
+    }
+}
+
+MapiDumper::~MapiDumper()
+{
+    setEnabled(false);
+}
+
+void MapiDumper::capture(const char *operation)
+{
+    fflush(stdout);
+    off_t size = lseek(s_scratch, 0, SEEK_CUR);
+    if (size <= 0) {
+        return;
+    }
+
+    // Read what was written, and rewind for the next call.
+    bool wanted = s_filter.isEmpty() || s_filter.contains(QString::fromAscii(operation));
+    if (wanted) {
+        QByteArray dump = QByteArray("=== ") + operation + '\n';
+        int header = dump.size();
+        int length = (int)qMin(size, (off_t)DUMP_CALL_SIZE);
+
+        dump.resize(header + length);
+        length = pread(s_scratch, dump.data() + header, length, 0);
+        dump.resize(header + qMax(length, 0));
+        if (size > DUMP_CALL_SIZE) {
+            dump += QString::fromAscii("\n[%1 bytes dropped]\n").arg((qint64)(size - DUMP_CALL_SIZE)).toLatin1();
+        }
+        s_dumps.append(dump);
+        s_size += dump.size();
+        while (s_size > DUMP_BUFFER_SIZE) {
+            s_size -= s_dumps.takeFirst().size();
+            s_dropped++;
+        }
+    }
+    if (ftruncate(s_scratch, 0) || (lseek(s_scratch, 0, SEEK_SET) < 0)) {
+        kError() << "cannot rewind dump scratch file";
+    }
+}
+
+bool MapiDumper::setEnabled(bool enabled)
+{
+    if (enabled == s_enabled) {
+        return true;
+    }
+    if (enabled) {
+        FILE *scratch = tmpfile();
+        if (!scratch) {
+            kError() << "cannot create dump scratch file";
+            return false;
+        }
+        s_scratch = dup(fileno(scratch));
+        fclose(scratch);
+        fflush(stdout);
+        s_stdout = dup(STDOUT_FILENO);
+        dup2(s_scratch, STDOUT_FILENO);
+        s_enabled = true;
+        MapiTracer::setWatched(MapiTracer::Dumping, true);
+        m_drainTimer.start();
+        if (!m_connection->dumpSet(true)) {
+            setEnabled(false);
+            return false;
+        }
+    } else {
+        m_connection->dumpSet(false);
+        m_drainTimer.stop();
+        capture("untraced");
+        s_enabled = false;
+        MapiTracer::setWatched(MapiTracer::Dumping, false);
+        fflush(stdout);
+        dup2(s_stdout, STDOUT_FILENO);
+        close(s_stdout);
+        close(s_scratch);
+        s_scratch = -1;
+    }
+    kDebug() << "dumping:" << enabled;
+    return true;
+}
+
+void MapiDumper::drain()
+{
+    capture("untraced");
+}
+
+bool MapiDumper::enabled() const
+{
+    return s_enabled;
+}
+
+void MapiDumper::setFilter(const QStringList &operations)
+{
+    s_filter = operations;
+}
+
+QStringList MapiDumper::filter() const
+{
+    return s_filter;
+}
+
+void MapiDumper::clear()
+{
+    s_dumps.clear();
+    s_size = 0;
+    s_dropped = 0;
+}
+
+QString MapiDumper::flush(const QString &fileName)
+{
+    QString name = fileName;
+
+    if (name.isEmpty()) {
+        name = KStandardDirs::locateLocal("data", QString::fromAscii("akonadi_exchange/dump-%1.txt").
+                                          arg(QCoreApplication::applicationPid()));
+    }
+    KSaveFile file(name);
+    if (!file.open()) {
+        kError() << "cannot write dump:" << name << file.errorString();
+        return QString();
+    }
+    if (s_dropped) {
+        file.write(QString::fromAscii("=== [%1 earlier calls dropped]\n").arg(s_dropped).toLatin1());
+    }
+    foreach (const QByteArray &dump, s_dumps) {
+        file.write(dump);
+    }
+    if (!file.finalize()) {
+        kError() << "cannot write dump:" << name << file.errorString();
+        return QString();
+    }
+    kDebug() << "wrote dump:" << name << "calls:" << s_dumps.size();
+    clear();
+    return name;
+}
+
+#include "mapidumper.moc"
@@ -0,0 +1,142 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPIDUMPER_H
+#define MAPIDUMPER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QObject>
+#include <QStringList>
+#include <QTimer>
+
+class MapiProfiles;
+
+/**
+ * Set to 1 to dump from startup, rather than waiting to be asked over D-Bus.
+ */
+#ifndef ENABLE_MAPI_DEBUG
+#define ENABLE_MAPI_DEBUG 0
+#endif
+
+/**
+ * How many bytes of dump output are kept. The oldest calls are dropped
+ * first.
+ */
+#ifndef DUMP_BUFFER_SIZE
+#define DUMP_BUFFER_SIZE (4 * 1024 * 1024)
+#endif
+
+/**
+ * How many bytes of dump output are kept for any one call. Streams of large
+ * attachments would otherwise push everything else out.
+ */
+#ifndef DUMP_CALL_SIZE
+#define DUMP_CALL_SIZE (256 * 1024)
+#endif
+
+/**
+ * How often (in milliseconds) the scratch file is drained when no traced call
+ * has done so, so that it does not grow while idle.
+ */
+#ifndef DUMP_DRAIN_INTERVAL
+#define DUMP_DRAIN_INTERVAL 5000
+#endif
+
+/**
+ * A capture of libmapi's wire dumps. libmapi only writes its NDR dumps to
+ * the process' standard output, which is far too expensive to leave on.
+ * When enabled, standard output is redirected to a scratch file, which is
+ * drained after each call traced by @ref MapiTrace into a bounded ring
+ * buffer, labelled with the call. Anything written between traced calls is
+ * drained every DUMP_DRAIN_INTERVAL, labelled "untraced". Standard error,
+ * where our own kDebug() and kError() go, is left alone.
+ *
+ * The dumper is controlled over D-Bus, and the buffer written to a file on
+ * demand.
+ */
+class MapiDumper : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.Akonadi.Exchange.Dump")
+
+public:
+    MapiDumper(MapiProfiles *connection, QObject *parent = 0);
+    virtual ~MapiDumper();
+
+    static bool isEnabled()
+    {
+        return s_enabled;
+    }
+
+    /**
+     * Collect whatever libmapi has dumped since the last call.
+     *
+     * @param operation The call responsible.
+     */
+    static void capture(const char *operation);
+
+public Q_SLOTS:
+    /**
+     * @return false if the dump could not be switched.
+     */
+    Q_SCRIPTABLE bool setEnabled(bool enabled);
+    Q_SCRIPTABLE bool enabled() const;
+
+    /**
+     * Only keep dumps from the given calls, such as "GetProps", or from all
+     * calls if the list is empty.
+     */
+    Q_SCRIPTABLE void setFilter(const QStringList &operations);
+    Q_SCRIPTABLE QStringList filter() const;
+
+    /**
+     * Write the dumps captured so far, and forget them.
+     *
+     * @param fileName  Where to write the dumps, or empty for a file in the
+     *                  local data directory.
+     * @return The name of the file written, or empty on error.
+     */
+    Q_SCRIPTABLE QString flush(const QString &fileName);
+
+    /**
+     * Forget the dumps captured so far.
+     */
+    Q_SCRIPTABLE void clear();
+
+private Q_SLOTS:
+    /**
+     * Collect whatever was dumped outside a traced call.
+     */
+    void drain();
+
+private:
+    MapiProfiles *m_connection;
+    QTimer m_drainTimer;
+
+    static bool s_enabled;
+    static int s_scratch;
+    static int s_stdout;
+    static QStringList s_filter;
+    static QList<QByteArray> s_dumps;
+    static int s_size;
+    static quint64 s_dropped;
+};
+
+#endif // MAPIDUMPER_H
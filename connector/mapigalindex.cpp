@@ -0,0 +1,297 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapigalindex.h"
+
+#include <QFileInfo>
+#include <QVector>
+#include <QtAlgorithms>
+#include <KDebug>
+#include <KSaveFile>
+#include <KStandardDirs>
+
+/**
+ * How often (in seconds) to check if the index has been rewritten.
+ */
+#ifndef GAL_INDEX_CHECK_INTERVAL
+#define GAL_INDEX_CHECK_INTERVAL 60
+#endif
+
+#define GAL_INDEX_MAGIC 0x4d474931 // "MGI1"
+
+struct MapiGalIndexHeader
+{
+    quint32 magic;
+    quint32 count;
+    quint32 pool;
+};
+
+struct MapiGalIndexRecord
+{
+    quint32 hash;
+    quint32 key;
+    quint32 smtp;
+
+    bool operator<(const MapiGalIndexRecord &other) const
+    {
+        return hash < other.hash;
+    }
+};
+
+MapiGalIndex::MapiGalIndex() :
+    m_data(0),
+    m_size(0)
+{
+}
+
+MapiGalIndex::~MapiGalIndex()
+{
+    unmap();
+}
+
+QString MapiGalIndex::fileName(const QString &profile)
+{
+    return KStandardDirs::locateLocal("data", QString::fromAscii("akonadi_exchange/%1.gal").arg(profile));
+}
+
+void MapiGalIndex::setFileName(const QString &fileName)
+{
+    if (fileName == m_file.fileName()) {
+        return;
+    }
+    unmap();
+    m_file.setFileName(fileName);
+}
+
+QString MapiGalIndex::fileName() const
+{
+    return m_file.fileName();
+}
+
+QByteArray MapiGalIndex::key(const QString &name)
+{
+    return name.simplified().toCaseFolded().toUtf8();
+}
+
+/**
+ * FNV-1a, which unlike qHash() is guaranteed not to change under us.
+ */
+quint32 MapiGalIndex::hash(const QByteArray &key)
+{
+    quint32 result = 2166136261u;
+
+    for (int i = 0; i < key.size(); i++) {
+        result ^= (uchar)key.at(i);
+        result *= 16777619u;
+    }
+    return result;
+}
+
+void MapiGalIndex::unmap()
+{
+    if (m_data) {
+        m_file.unmap(m_data);
+        m_data = 0;
+        m_size = 0;
+    }
+    m_file.close();
+}
+
+bool MapiGalIndex::map()
+{
+    if (m_file.fileName().isEmpty()) {
+        return false;
+    }
+    if (m_checked.isValid() && (m_checked.elapsed() < GAL_INDEX_CHECK_INTERVAL * 1000)) {
+        return m_data != 0;
+    }
+    m_checked.start();
+
+    QFileInfo info(m_file.fileName());
+    if (!info.exists()) {
+        unmap();
+        return false;
+    }
+    if (m_data && (info.lastModified() == m_modified)) {
+        return true;
+    }
+
+    // Map the new file, and sanity check it.
+    unmap();
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    m_modified = info.lastModified();
+    m_size = m_file.size();
+    m_data = m_file.map(0, m_size);
+    if (!m_data) {
+        kError() << "cannot map GAL index:" << m_file.fileName();
+        unmap();
+        return false;
+    }
+    const MapiGalIndexHeader *header = (const MapiGalIndexHeader *)m_data;
+    if ((m_size < (qint64)sizeof(*header)) ||
+        (header->magic != GAL_INDEX_MAGIC) ||
+        (header->pool != sizeof(*header) + header->count * sizeof(MapiGalIndexRecord)) ||
+        (header->pool > m_size) ||
+        (header->count && m_data[m_size - 1])) {
+        kError() << "ignoring bad GAL index:" << m_file.fileName();
+        unmap();
+        return false;
+    }
+    kDebug() << "mapped GAL index:" << m_file.fileName() << "entries:" << header->count;
+    return true;
+}
+
+bool MapiGalIndex::find(const QString &name, QString &smtp)
+{
+    if (!map()) {
+        return false;
+    }
+
+    const MapiGalIndexHeader *header = (const MapiGalIndexHeader *)m_data;
+    const MapiGalIndexRecord *begin = (const MapiGalIndexRecord *)(m_data + sizeof(*header));
+    const MapiGalIndexRecord *end = begin + header->count;
+    const char *pool = (const char *)m_data + header->pool;
+    qint64 poolSize = m_size - header->pool;
+    MapiGalIndexRecord wanted;
+    QByteArray wantedKey = key(name);
+
+    if (wantedKey.isEmpty()) {
+        return false;
+    }
+    wanted.hash = hash(wantedKey);
+    for (const MapiGalIndexRecord *i = qLowerBound(begin, end, wanted); (i != end) && (i->hash == wanted.hash); i++) {
+        if ((i->key >= poolSize) || (i->smtp >= poolSize)) {
+            break;
+        }
+        if (wantedKey == pool + i->key) {
+            // An ambiguous name has no address.
+            if (!pool[i->smtp]) {
+                return false;
+            }
+            smtp = QString::fromUtf8(pool + i->smtp);
+            return true;
+        }
+    }
+    return false;
+}
+
+MapiGalIndexWriter::MapiGalIndexWriter(const QString &fileName) :
+    m_fileName(fileName)
+{
+}
+
+void MapiGalIndexWriter::insert(const QString &name, const QString &smtp)
+{
+    QByteArray key = MapiGalIndex::key(name);
+
+    if (key.isEmpty() || smtp.isEmpty()) {
+        return;
+    }
+
+    // A name shared by different people is marked as ambiguous, with an
+    // empty address, so that it is left to the server to report.
+    QByteArray address = smtp.toUtf8();
+    QHash<QByteArray, QByteArray>::iterator i = m_entries.find(key);
+    if (i == m_entries.end()) {
+        m_entries.insert(key, address);
+    } else if (i.value() != address) {
+        i.value().clear();
+    }
+}
+
+void MapiGalIndexWriter::clear()
+{
+    m_entries.clear();
+}
+
+bool MapiGalIndexWriter::load()
+{
+    QFile file(m_fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        // Nothing saved yet.
+        return false;
+    }
+
+    QByteArray data = file.readAll();
+    const MapiGalIndexHeader *header = (const MapiGalIndexHeader *)data.constData();
+    if ((data.size() < (int)sizeof(*header)) ||
+        (header->magic != GAL_INDEX_MAGIC) ||
+        (header->pool != sizeof(*header) + header->count * sizeof(MapiGalIndexRecord)) ||
+        (header->pool > (quint32)data.size()) ||
+        (header->count && data.at(data.size() - 1))) {
+        kError() << "ignoring bad GAL index:" << m_fileName;
+        return false;
+    }
+    const MapiGalIndexRecord *records = (const MapiGalIndexRecord *)(data.constData() + sizeof(*header));
+    const char *pool = data.constData() + header->pool;
+    quint32 poolSize = data.size() - header->pool;
+    for (quint32 i = 0; i < header->count; i++) {
+        if ((records[i].key < poolSize) && (records[i].smtp < poolSize)) {
+            m_entries.insert(QByteArray(pool + records[i].key), QByteArray(pool + records[i].smtp));
+        }
+    }
+    return true;
+}
+
+bool MapiGalIndexWriter::save()
+{
+    MapiGalIndexHeader header;
+    QVector<MapiGalIndexRecord> records;
+    QByteArray pool;
+
+    // Addresses are shared by several keys, so only store each once.
+    QHash<QByteArray, quint32> addresses;
+    records.reserve(m_entries.size());
+    for (QHash<QByteArray, QByteArray>::const_iterator i = m_entries.constBegin(); i != m_entries.constEnd(); ++i) {
+        MapiGalIndexRecord record;
+
+        record.hash = MapiGalIndex::hash(i.key());
+        record.key = pool.size();
+        pool.append(i.key()).append('\0');
+        if (!addresses.contains(i.value())) {
+            addresses.insert(i.value(), pool.size());
+            pool.append(i.value()).append('\0');
+        }
+        record.smtp = addresses.value(i.value());
+        records.append(record);
+    }
+    qSort(records);
+    header.magic = GAL_INDEX_MAGIC;
+    header.count = records.size();
+    header.pool = sizeof(header) + records.size() * sizeof(MapiGalIndexRecord);
+
+    // Write a new file and then rename it, so that readers never see a
+    // partial index.
+    KSaveFile file(m_fileName);
+    if (!file.open()) {
+        kError() << "cannot write GAL index:" << m_fileName << file.errorString();
+        return false;
+    }
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)records.constData(), records.size() * sizeof(MapiGalIndexRecord));
+    file.write(pool);
+    if (!file.finalize()) {
+        kError() << "cannot write GAL index:" << m_fileName << file.errorString();
+        return false;
+    }
+    kDebug() << "wrote GAL index:" << m_fileName << "entries:" << header.count;
+    return true;
+}
@@ -0,0 +1,123 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPIGALINDEX_H
+#define MAPIGALINDEX_H
+
+#include <QDateTime>
+#include <QFile>
+#include <QHash>
+#include <QString>
+#include <QTime>
+
+/**
+ * A read-only lookup of the GAL, mapping display names, X500 DNs and aliases
+ * to SMTP addresses. The index is a file written by the contacts resource
+ * as it mirrors the GAL, and memory-mapped by any resource which needs to
+ * resolve recipients, so they can avoid a round trip to the server.
+ *
+ * The file holds a header, an array of records sorted by the hash of their
+ * key, and a pool of 0-terminated UTF-8 strings. It is written in the native
+ * byte order, since it never leaves the machine.
+ */
+class MapiGalIndex
+{
+public:
+    MapiGalIndex();
+    ~MapiGalIndex();
+
+    /**
+     * The index file for a given profile.
+     */
+    static QString fileName(const QString &profile);
+
+    /**
+     * Select the index file to use. It is mapped on first use, and remapped
+     * when it is rewritten.
+     */
+    void setFileName(const QString &fileName);
+    QString fileName() const;
+
+    /**
+     * Look up a display name, X500 DN or alias.
+     *
+     * @param name  The name to look up.
+     * @param smtp  Set to the SMTP address, if found.
+     * @return True on a hit. A name shared by different people is a miss,
+     *         so that the server can report it as ambiguous.
+     */
+    bool find(const QString &name, QString &smtp);
+
+    /**
+     * The normalised form of a name, and its hash, as used in the index.
+     */
+    static QByteArray key(const QString &name);
+    static quint32 hash(const QByteArray &key);
+
+private:
+    QFile m_file;
+    uchar *m_data;
+    qint64 m_size;
+    QDateTime m_modified;
+    QTime m_checked;
+
+    /**
+     * (Re)map the file if it has changed.
+     */
+    bool map();
+    void unmap();
+};
+
+/**
+ * Used to write a @ref MapiGalIndex.
+ */
+class MapiGalIndexWriter
+{
+public:
+    MapiGalIndexWriter(const QString &fileName);
+
+    /**
+     * Add an entry. Entries with an empty name or address are ignored. A
+     * name added again with a different address is ambiguous, and is not
+     * found by @ref MapiGalIndex::find().
+     */
+    void insert(const QString &name, const QString &smtp);
+
+    /**
+     * Forget all entries, e.g. when the GAL is being fetched afresh.
+     */
+    void clear();
+
+    /**
+     * Replace the index file with the current entries. Readers which have
+     * the old file mapped are unaffected until they next check.
+     */
+    bool save();
+
+    /**
+     * Reload the entries from the index file.
+     */
+    bool load();
+
+private:
+    QString m_fileName;
+    QHash<QByteArray, QByteArray> m_entries;
+};
+
+#endif // MAPIGALINDEX_H
@@ -0,0 +1,91 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapilogging.h"
+
+#include <KDebug>
+
+volatile unsigned MapiLogging::s_categories = MAPI_LOGGING_DEFAULT;
+
+MapiLogging::MapiLogging(QObject *parent) :
+    QObject(parent)
+{
+}
+
+const char *MapiLogging::name(Category category)
+{
+    switch (category) {
+    case Connection:
+        return "connection";
+    case Folders:
+        return "folders";
+    case Messages:
+        return "messages";
+    case Recipients:
+        return "recipients";
+    case Payloads:
+        return "payloads";
+    case Sync:
+        return "sync";
+    case CategoryCount:
+        break;
+    }
+    return "";
+}
+
+QStringList MapiLogging::categories() const
+{
+    QStringList result;
+
+    for (int i = 0; i < CategoryCount; i++) {
+        Category category = (Category)i;
+
+        result << QString::fromAscii("%1 %2").arg(QString::fromAscii(name(category))).
+            arg(QString::fromAscii(isEnabled(category) ? "on" : "off"));
+    }
+    return result;
+}
+
+bool MapiLogging::setEnabled(const QString &category, bool enabled)
+{
+    unsigned mask = 0;
+
+    if (category == QLatin1String("all")) {
+        mask = (1u << CategoryCount) - 1;
+    } else {
+        for (int i = 0; i < CategoryCount; i++) {
+            if (category == QLatin1String(name((Category)i))) {
+                mask = 1u << i;
+            }
+        }
+    }
+    if (!mask) {
+        kError() << "no such logging category:" << category;
+        return false;
+    }
+    if (enabled) {
+        s_categories |= mask;
+    } else {
+        s_categories &= ~mask;
+    }
+    kDebug() << "logging:" << category << enabled;
+    return true;
+}
+
+#include "mapilogging.moc"
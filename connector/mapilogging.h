@@ -0,0 +1,104 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPILOGGING_H
+#define MAPILOGGING_H
+
+#include <QObject>
+#include <QStringList>
+
+/**
+ * Set to 0 to compile out all categorised logging.
+ */
+#ifndef ENABLE_MAPI_LOGGING
+#define ENABLE_MAPI_LOGGING 1
+#endif
+
+/**
+ * The categories enabled at startup, as a mask of MapiLogging::Category bits.
+ */
+#ifndef MAPI_LOGGING_DEFAULT
+#define MAPI_LOGGING_DEFAULT 0
+#endif
+
+/**
+ * Log to a stream only if the category is enabled:
+ *
+ *      MAPI_LOG(Folders, debug()) << "restricted content table";
+ *      MAPI_LOG(Sync, kDebug()) << "fetched:" << total;
+ *
+ * A disabled category costs a test of a bit: neither the stream, nor any
+ * prefix it formats, nor the values logged are evaluated.
+ */
+#if (ENABLE_MAPI_LOGGING)
+#define MAPI_LOG(category, stream) \
+    if (!MapiLogging::isEnabled(MapiLogging::category)) {} else stream
+#else
+#define MAPI_LOG(category, stream) \
+    if (true) {} else stream
+#endif
+
+/**
+ * Categories of logging, which can be switched on and off over D-Bus. Errors
+ * are always logged, and do not belong to a category.
+ */
+class MapiLogging : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.Akonadi.Exchange.Logging")
+
+public:
+    enum Category
+    {
+        Connection,
+        Folders,
+        Messages,
+        Recipients,
+        Payloads,
+        Sync,
+        CategoryCount
+    };
+
+    MapiLogging(QObject *parent = 0);
+
+    static bool isEnabled(Category category)
+    {
+        return s_categories & (1u << category);
+    }
+
+public Q_SLOTS:
+    /**
+     * The categories, each followed by "on" or "off".
+     */
+    Q_SCRIPTABLE QStringList categories() const;
+
+    /**
+     * Switch a category, or "all" of them, on or off.
+     *
+     * @return false if there is no such category.
+     */
+    Q_SCRIPTABLE bool setEnabled(const QString &category, bool enabled);
+
+private:
+    static volatile unsigned s_categories;
+
+    static const char *name(Category category);
+};
+
+#endif // MAPILOGGING_H
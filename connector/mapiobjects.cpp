@@ -19,17 +19,23 @@
  */
 
 #include <QAbstractSocket>
+#include <QDataStream>
+#include <string.h>
 #include <QDebug>
+#include <QHash>
 #include <QStringList>
 #include <QDir>
 #include <QMessageBox>
-#include <QRegExp>
+#include <QSet>
 #include <QVariant>
+#include <QtAlgorithms>
 #include <QSocketNotifier>
 #include <QTextCodec>
+#include <QTime>
 #include <KLocale>
 #include <kpimutils/email.h>
 #include "mapiobjects.h"
+#include "mapitracer.h"
 
 #define CASE_PREFER_A_OVER_B(a, b, lvalue, rvalue) \
 case b: \
@@ -58,6 +64,103 @@ case a: \
 #define DEBUG_NOTIFICATIONS 0
 #endif
 
+/**
+ * The most names to ask the server to resolve in one go.
+ */
+#ifndef RESOLVE_BATCH_SIZE
+#define RESOLVE_BATCH_SIZE 256
+#endif
+
+/**
+ * Is this a bare address, with one @ in the middle, and nothing that would
+ * need the full parser?
+ */
+static bool isPlainAddress(const QChar *begin, const QChar *end)
+{
+    const QChar *at = 0;
+
+    for (const QChar *c = begin; c < end; c++) {
+        ushort u = c->unicode();
+
+        if (u == '@') {
+            if (at) {
+                return false;
+            }
+            at = c;
+        } else if ((u <= ' ') || (u == '<') || (u == '>') || (u == '(') || (u == ')') || (u == '"') ||
+                   (u == ',') || (u == ';') || (u == ':') || (u == '\\') || (u == '[') || (u == ']')) {
+            return false;
+        }
+    }
+    return at && (at > begin) && (at < end - 1);
+}
+
+/**
+ * A fast scanner for the common SMTP forms:
+ *
+ *      foo@bar
+ *      Foo Bar <foo@bar>
+ *
+ * @return A view of the address, or a null view if the full parser is
+ * needed.
+ */
+static QStringRef scanSmtp(const QString &source)
+{
+    const QChar *begin = source.constData();
+    const QChar *end = begin + source.length();
+    const QChar *open = 0;
+
+    if (isPlainAddress(begin, end)) {
+        return QStringRef(&source);
+    }
+
+    // Look for "name <address>", with a name that has no specials.
+    while ((end > begin) && end[-1].isSpace()) {
+        end--;
+    }
+    if ((end == begin) || (end[-1] != QLatin1Char('>'))) {
+        return QStringRef();
+    }
+    for (const QChar *c = begin; c < end - 1; c++) {
+        ushort u = c->unicode();
+
+        if (u == '<') {
+            if (open) {
+                return QStringRef();
+            }
+            open = c;
+        } else if (!open && ((u == '>') || (u == '(') || (u == ')') || (u == '"') || (u == '@') ||
+                             (u == ',') || (u == ';') || (u == '\\'))) {
+            return QStringRef();
+        }
+    }
+    if (!open || !isPlainAddress(open + 1, end - 1)) {
+        return QStringRef();
+    }
+    return QStringRef(&source, open + 1 - begin, end - open - 2);
+}
+
+/**
+ * Find whatever follows the last "/CN=", ignoring case.
+ *
+ * @return A view of the alias, or a null view if there is none.
+ */
+static QStringRef scanEx(const QString &source)
+{
+    const QChar *begin = source.constData();
+
+    for (int i = source.length() - 4; i >= 0; i--) {
+        const QChar *c = begin + i;
+
+        if ((c[0] == QLatin1Char('/')) && (c[3] == QLatin1Char('=')) &&
+            ((c[1] == QLatin1Char('C')) || (c[1] == QLatin1Char('c'))) &&
+            ((c[2] == QLatin1Char('N')) || (c[2] == QLatin1Char('n')))) {
+            return QStringRef(&source, i + 4, source.length() - i - 4);
+        }
+    }
+    return QStringRef();
+}
+
 /**
  * Try to extract an email address from a string.
  */
@@ -65,12 +168,18 @@ extern QString mapiExtractEmail(const QString &source, const QByteArray &type, b
 {
     QString email;
     
-    if (!emptyDefault) {
-        email = source;
-    }
     if (type == "SMTP") {
+        QStringRef fast = scanSmtp(source);
+        if (!fast.isNull()) {
+            return fast.toString();
+        }
+
         QString name;
 
+        if (!emptyDefault) {
+            email = source;
+        }
+
         // First, we give the library routines a chance.
         if (!KPIMUtils::extractEmailAddressAndName(source, email, name)) {
             // Now for some custom action. Look for the last possible
@@ -79,11 +188,20 @@ extern QString mapiExtractEmail(const QString &source, const QByteArray &type, b
             //       "blah (blah) <blah> <result>"
             //
             // should return "result".
-            static QRegExp firstRE(QString::fromAscii("[(<]"));
-            static QRegExp lastRE(QString::fromAscii("[)>]"));
-
-            int first = source.lastIndexOf(firstRE);
-            int last = source.indexOf(lastRE, first);
+            int first = -1;
+            for (int i = source.length() - 1; i >= 0; i--) {
+                if ((source.at(i) == QLatin1Char('(')) || (source.at(i) == QLatin1Char('<'))) {
+                    first = i;
+                    break;
+                }
+            }
+            int last = -1;
+            for (int i = qMax(first, 0); i < source.length(); i++) {
+                if ((source.at(i) == QLatin1Char(')')) || (source.at(i) == QLatin1Char('>'))) {
+                    last = i;
+                    break;
+                }
+            }
 
             if ((first > -1) && (last > first + 1)) {
                 email = source.mid(first + 1, last - first - 1);
@@ -92,11 +210,15 @@ extern QString mapiExtractEmail(const QString &source, const QByteArray &type, b
     } else if (type == "EX") {
         // Convert an "EX"change address to an account name, which 
         // should be the email alias.
-        int lastCn = source.lastIndexOf(QString::fromAscii("/CN="), -1, Qt::CaseInsensitive);
+        QStringRef alias = scanEx(source);
 
-        if (lastCn > -1) {
-            email = source.mid(lastCn + 4);
+        if (!alias.isNull()) {
+            email = alias.toString();
+        } else if (!emptyDefault) {
+            email = source;
         }
+    } else if (!emptyDefault) {
+        email = source;
     }
     return email;
 }
@@ -118,6 +240,15 @@ static QDateTime convertSysTime(const FILETIME& filetime)
   return kdeTime;
 }
 
+static void convertSysTime(const QDateTime &dateTime, FILETIME &filetime)
+{
+    // As per http://support.citrix.com/article/CTX109645.
+    time_t unixTime = dateTime.toTime_t();
+    NTTIME ntTime = (unixTime + 11644473600L) * 10000000;
+    filetime.dwHighDateTime = ntTime >> 32;
+    filetime.dwLowDateTime = ntTime;
+}
+
 static QChar x500Prefix(QChar::fromAscii('/'));
 static QChar domainSeparator(QChar::fromAscii('@'));
 
@@ -148,7 +279,12 @@ unsigned isGoodEmailAddress(QString &email)
 }
 
 MapiFolder::MapiFolder(MapiConnector2 *connection, const char *tallocName, const MapiId &id) :
-    MapiObject(connection, tallocName, id)
+    MapiObject(connection, tallocName, id),
+    m_windowStartTag(0),
+    m_windowEndTag(0),
+    m_windowExemptTag(0),
+    m_contentsEnvelope(false),
+    m_contentsNamed(false)
 {
     mapi_object_init(&m_contents);
     // A temporary name.
@@ -175,7 +311,8 @@ QDebug MapiFolder::error() const
 bool MapiFolder::childrenPull(QList<MapiFolder *> &children, const QString &filter)
 {
     // Retrieve folder's folder table
-    if (MAPI_E_SUCCESS != GetHierarchyTable(&m_object, &m_contents, 0, NULL)) {
+    MapiTrace trace(MapiTracer::GetHierarchyTable, m_id.second);
+    if (MAPI_E_SUCCESS != trace(GetHierarchyTable(&m_object, &m_contents, 0, NULL))) {
         error() << "cannot get hierarchy table" << mapiError();
         return false;
     }
@@ -186,7 +323,8 @@ bool MapiFolder::childrenPull(QList<MapiFolder *> &children, const QString &filt
         error() << "cannot set hierarchy table tags" << mapiError();
         return false;
     }
-    if (MAPI_E_SUCCESS != SetColumns(&m_contents, tags)) {
+    trace.restart(MapiTracer::SetColumns);
+    if (MAPI_E_SUCCESS != trace(SetColumns(&m_contents, tags))) {
         error() << "cannot set hierarchy table columns" << mapiError();
         MAPIFreeBuffer(tags);
         return false;
@@ -195,14 +333,19 @@ bool MapiFolder::childrenPull(QList<MapiFolder *> &children, const QString &filt
 
     // Get current cursor position.
     uint32_t cursor;
-    if (MAPI_E_SUCCESS != QueryPosition(&m_contents, NULL, &cursor)) {
+    trace.restart(MapiTracer::QueryPosition);
+    if (MAPI_E_SUCCESS != trace(QueryPosition(&m_contents, NULL, &cursor))) {
         error() << "cannot query position" << mapiError();
         return false;
     }
 
     // Iterate through sets of rows.
     SRowSet rowset;
-    while ((QueryRows(&m_contents, cursor, TBL_ADVANCE, &rowset) == MAPI_E_SUCCESS) && rowset.cRows) {
+    while (true) {
+        trace.restart(MapiTracer::QueryRows);
+        if ((trace(QueryRows(&m_contents, cursor, TBL_ADVANCE, &rowset)) != MAPI_E_SUCCESS) || !rowset.cRows) {
+            break;
+        }
         for (unsigned i = 0; i < rowset.cRows; i++) {
             SRow &row = rowset.aRow[i];
             mapi_id_t fid = 0;
@@ -230,7 +373,7 @@ bool MapiFolder::childrenPull(QList<MapiFolder *> &children, const QString &filt
                 }
             }
             if (!filter.isEmpty() && !folderClass.isEmpty() && !folderClass.startsWith(filter)) {
-                debug() << "folder" << name << ", class" << folderClass << "does not match filter" << filter;
+                MAPI_LOG(Folders, debug()) << "folder" << name << ", class" << folderClass << "does not match filter" << filter;
                 continue;
             }
 
@@ -244,22 +387,36 @@ bool MapiFolder::childrenPull(QList<MapiFolder *> &children, const QString &filt
     return true;
 }
 
-bool MapiFolder::childrenPull(QList<MapiItem *> &children)
+/**
+ * A row from a deep hierarchy table.
+ */
+class MapiFolderRow
 {
-    // Retrieve folder's content table
-    if (MAPI_E_SUCCESS != GetContentsTable(&m_object, &m_contents, TableFlags_UseUnicode, NULL)) {
-        error() << "cannot get content table" << mapiError();
+public:
+    mapi_id_t parent;
+    QString name;
+    QString folderClass;
+};
+
+bool MapiFolder::descendantsPull(QList<MapiFolder *> &descendants, const QString &filter)
+{
+    // Retrieve the whole tree below the folder in one table.
+    MapiTrace trace(MapiTracer::GetHierarchyTable, m_id.second);
+    if (MAPI_E_SUCCESS != trace(GetHierarchyTable(&m_object, &m_contents, TableFlags_Depth, NULL))) {
+        error() << "cannot get deep hierarchy table" << mapiError();
         return false;
     }
 
     // Create the MAPI table view
-    SPropTagArray* tags = set_SPropTagArray(ctx(), 0x3, PidTagMid, PidTagConversationTopic, PidTagLastModificationTime);
+    SPropTagArray* tags = set_SPropTagArray(ctx(), 0x4, PidTagFolderId, PidTagParentFolderId, PidTagDisplayName, 
+                                            PidTagContainerClass);
     if (!tags) {
-        error() << "cannot set content table tags" << mapiError();
+        error() << "cannot set hierarchy table tags" << mapiError();
         return false;
     }
-    if (MAPI_E_SUCCESS != SetColumns(&m_contents, tags)) {
-        error() << "cannot set content table columns" << mapiError();
+    trace.restart(MapiTracer::SetColumns);
+    if (MAPI_E_SUCCESS != trace(SetColumns(&m_contents, tags))) {
+        error() << "cannot set hierarchy table columns" << mapiError();
         MAPIFreeBuffer(tags);
         return false;
     }
@@ -267,92 +424,888 @@ bool MapiFolder::childrenPull(QList<MapiItem *> &children)
 
     // Get current cursor position.
     uint32_t cursor;
-    if (MAPI_E_SUCCESS != QueryPosition(&m_contents, NULL, &cursor)) {
+    trace.restart(MapiTracer::QueryPosition);
+    if (MAPI_E_SUCCESS != trace(QueryPosition(&m_contents, NULL, &cursor))) {
         error() << "cannot query position" << mapiError();
         return false;
     }
 
-    // Iterate through sets of rows.
+    // Iterate through sets of rows, noting the children of each folder.
+    QHash<mapi_id_t, MapiFolderRow> rows;
+    QMultiHash<mapi_id_t, mapi_id_t> children;
+    QList<mapi_id_t> order;
     SRowSet rowset;
-    while ((QueryRows(&m_contents, cursor, TBL_ADVANCE, &rowset) == MAPI_E_SUCCESS) && rowset.cRows) {
+    while (true) {
+        trace.restart(MapiTracer::QueryRows);
+        if ((trace(QueryRows(&m_contents, cursor, TBL_ADVANCE, &rowset)) != MAPI_E_SUCCESS) || !rowset.cRows) {
+            break;
+        }
         for (unsigned i = 0; i < rowset.cRows; i++) {
             SRow &row = rowset.aRow[i];
-            mapi_id_t id = 0;
-            QString name;
-            QDateTime modified;
+            mapi_id_t fid = 0;
+            MapiFolderRow data;
 
+            data.parent = 0;
             for (unsigned j = 0; j < row.cValues; j++) {
                 MapiProperty property(row.lpProps[j]); 
 
                 // Note that the set of properties fetched here must be aligned
                 // with those set above.
                 switch (property.tag()) {
-                case PidTagMid:
-                    id = property.value().toULongLong(); 
+                case PidTagFolderId:
+                    fid = property.value().toULongLong(); 
                     break;
-                case PidTagConversationTopic:
-                    name = property.value().toString(); 
+                case PidTagParentFolderId:
+                    data.parent = property.value().toULongLong(); 
                     break;
-                case PidTagLastModificationTime:
-                    modified = property.value().toDateTime(); 
+                case PidTagDisplayName:
+                    data.name = property.value().toString(); 
+                    break;
+                case PidTagContainerClass:
+                    data.folderClass = property.value().toString(); 
                     break;
                 default:
-                    //debug() << "ignoring item property:" << tagName(property.tag()) << property.value();
                     break;
                 }
             }
+            rows.insert(fid, data);
+            order.append(fid);
+        }
+    }
+
+    // Walk the children of each folder in table order, so that the result
+    // is the same as a recursive walk would give.
+    for (int i = order.size() - 1; i >= 0; i--) {
+        children.insert(rows[order.at(i)].parent, order.at(i));
+    }
+    QList<mapi_id_t> pending;
+    pending << m_id.second;
+    while (!pending.isEmpty()) {
+        mapi_id_t parent = pending.takeFirst();
+        QList<mapi_id_t> next;
+
+        foreach (mapi_id_t fid, children.values(parent)) {
+            const MapiFolderRow &data = rows[fid];
+
+            // A folder which does not match hides its descendants too.
+            if (!filter.isEmpty() && !data.folderClass.isEmpty() && !data.folderClass.startsWith(filter)) {
+                MAPI_LOG(Folders, debug()) << "folder" << data.name << ", class" << data.folderClass << "does not match filter" << filter;
+                continue;
+            }
 
             // Add the entry to the output list!
-            MapiId itemId(m_id, id);
-            MapiItem *data = new MapiItem(itemId, name, modified);
-            children.append(data);
-            //TODO Just for debugging (in case the content list ist very long)
-            //if (i >= 10) break;
+            MapiId folderId(MapiId(m_id, parent), fid);
+            MapiFolder *folder = new MapiFolder(m_connection, "MapiFolder::descendantsPull", folderId);
+            folder->name = data.name;
+            descendants.append(folder);
+            next << fid;
+        }
+        pending = next + pending;
+    }
+    MAPI_LOG(Folders, debug()) << "descendants:" << descendants.size() << "from rows:" << order.size();
+    return true;
+}
+
+bool MapiFolder::hierarchyStatePull(QByteArray &state)
+{
+    int tagList[] = { PidTagHierarchyChangeNumber, 0 };
+    SPropTagArray tags = { 1, (MAPITAGS *)tagList };
+    SPropValue *values = 0;
+    uint32_t count = 0;
+
+    MapiTrace trace(MapiTracer::GetProps, m_id.second);
+    if (MAPI_E_SUCCESS != trace(GetProps(&m_object, MAPI_PROPS_SKIP_NAMEDID_CHECK, &tags, &values, &count))) {
+        error() << "cannot pull hierarchy state:" << mapiError();
+        return false;
+    }
+
+    QDataStream stream(&state, QIODevice::WriteOnly);
+    bool found = false;
+    for (unsigned i = 0; i < count; i++) {
+        MapiProperty property(values[i]);
+
+        if (property.tag() == PidTagHierarchyChangeNumber) {
+            stream << property.value().toUInt();
+            found = true;
+        }
+    }
+    MAPIFreeBuffer(values);
+    if (!found) {
+        MAPI_LOG(Folders, debug()) << "no hierarchy change number";
+    }
+    return found;
+}
+
+bool MapiFolder::statePull(QByteArray &state, unsigned *unread)
+{
+    int tagList[] = { PidTagContentCount, PidTagContentUnreadCount, PidTagLocalCommitTimeMax, PidTagDeletedCountTotal, 0 };
+    SPropTagArray tags = { 4, (MAPITAGS *)tagList };
+    SPropValue *values = 0;
+    uint32_t count = 0;
+
+    MapiTrace trace(MapiTracer::GetProps, m_id.second);
+    if (MAPI_E_SUCCESS != trace(GetProps(&m_object, MAPI_PROPS_SKIP_NAMEDID_CHECK, &tags, &values, &count))) {
+        error() << "cannot pull folder state:" << mapiError();
+        return false;
+    }
+
+    // Without a commit time, we cannot tell a modification from no change.
+    QDataStream stream(&state, QIODevice::WriteOnly);
+    bool found = false;
+    for (unsigned i = 0; i < count; i++) {
+        MapiProperty property(values[i]);
+
+        switch (property.tag()) {
+        case PidTagContentUnreadCount:
+            if (unread) {
+                *unread = property.value().toUInt();
+            }
+            // Fall through.
+        case PidTagContentCount:
+        case PidTagDeletedCountTotal:
+            stream << property.tag() << property.value().toUInt();
+            break;
+        case PidTagLocalCommitTimeMax:
+            stream << property.tag() << property.value().toDateTime();
+            found = true;
+            break;
+        default:
+            break;
+        }
+    }
+    MAPIFreeBuffer(values);
+    stream << m_windowFrom.date() << m_windowTo.date();
+    if (!found) {
+        MAPI_LOG(Folders, debug()) << "no folder commit time";
+    }
+    return found;
+}
+
+bool MapiFolder::childrenPull(QList<MapiItem *> &children, bool envelope)
+{
+    MapiContents contents;
+
+    if (!contentsPull(contents, envelope, true)) {
+        return false;
+    }
+    for (int i = 0; i < contents.size(); i++) {
+        children.append(contents.item(m_id, i));
+    }
+    return true;
+}
+
+bool MapiFolder::contentsPull(MapiContents &contents, bool envelope, bool named)
+{
+    bool sorted = false;
+    unsigned total;
+
+    contents.clear();
+    if (!contentsOpen(envelope, named, sorted, total)) {
+        return false;
+    }
+    while (contentsNext(contents, total)) {
+    }
+    return true;
+}
+
+bool MapiFolder::contentsOpen(bool envelope, bool named, bool &sorted, unsigned &total)
+{
+    m_contentsEnvelope = envelope;
+    m_contentsNamed = envelope || named;
+
+    // Retrieve folder's content table
+    MapiTrace trace(MapiTracer::GetContentsTable, m_id.second);
+    if (MAPI_E_SUCCESS != trace(GetContentsTable(&m_object, &m_contents, TableFlags_UseUnicode, NULL))) {
+        error() << "cannot get content table" << mapiError();
+        return false;
+    }
+
+    // Create the MAPI table view
+    SPropTagArray* tags;
+    if (envelope) {
+        tags = set_SPropTagArray(ctx(), 0xe, PidTagMid, PidTagConversationTopic, PidTagLastModificationTime,
+                                 PidTagSearchKey, PidTagChangeKey, PidTagSubject, PidTagSenderName, 
+                                 PidTagSenderEmailAddress, PidTagSenderAddressType, PidTagMessageDeliveryTime, 
+                                 PidTagMessageSize, PidTagMessageFlags, PidTagConversationIndex, 
+                                 PidTagInternetMessageId);
+    } else if (named) {
+        tags = set_SPropTagArray(ctx(), 0x5, PidTagMid, PidTagConversationTopic, PidTagLastModificationTime,
+                                 PidTagSearchKey, PidTagChangeKey);
+    } else {
+        tags = set_SPropTagArray(ctx(), 0x4, PidTagMid, PidTagLastModificationTime, PidTagSearchKey,
+                                 PidTagChangeKey);
+    }
+    if (!tags) {
+        error() << "cannot set content table tags" << mapiError();
+        return false;
+    }
+    trace.restart(MapiTracer::SetColumns);
+    if (MAPI_E_SUCCESS != trace(SetColumns(&m_contents, tags))) {
+        error() << "cannot set content table columns" << mapiError();
+        MAPIFreeBuffer(tags);
+        return false;
+    }
+    MAPIFreeBuffer(tags);
+    if (!windowApply()) {
+        return false;
+    }
+
+    // Ask for the rows in message id order, if the caller wants that. Not
+    // all servers will oblige.
+    if (sorted) {
+        SSortOrder order;
+        SSortOrderSet criteria;
+
+        order.ulPropTag = PidTagMid;
+        order.ulOrder = TABLE_SORT_ASCEND;
+        criteria.cSorts = 1;
+        criteria.cCategories = 0;
+        criteria.cExpanded = 0;
+        criteria.aSort = &order;
+        trace.restart(MapiTracer::SortTable);
+        if (MAPI_E_SUCCESS != trace(SortTable(&m_contents, &criteria))) {
+            MAPI_LOG(Folders, debug()) << "cannot sort content table" << mapiError();
+            sorted = false;
+        }
+    }
+
+    // Get the number of rows.
+    uint32_t cursor;
+    trace.restart(MapiTracer::QueryPosition);
+    if (MAPI_E_SUCCESS != trace(QueryPosition(&m_contents, NULL, &cursor))) {
+        error() << "cannot query position" << mapiError();
+        return false;
+    }
+    total = cursor;
+    return true;
+}
+
+bool MapiFolder::contentsNext(MapiContents &contents, unsigned count)
+{
+    SRowSet rowset;
+
+    contents.m_envelope = m_contentsEnvelope;
+    contents.m_named = m_contentsNamed;
+    MapiTrace trace(MapiTracer::QueryRows, m_id.second);
+    if ((trace(QueryRows(&m_contents, count, TBL_ADVANCE, &rowset)) != MAPI_E_SUCCESS) || !rowset.cRows) {
+        return false;
+    }
+    for (unsigned i = 0; i < rowset.cRows; i++) {
+        contents.append(rowset.aRow[i]);
+    }
+    return true;
+}
+
+void MapiFolder::setWindow(int startTag, int endTag, const QDateTime &from, const QDateTime &to, int exemptTag)
+{
+    m_windowStartTag = startTag;
+    m_windowEndTag = endTag;
+    m_windowFrom = from;
+    m_windowTo = to;
+    m_windowExemptTag = exemptTag;
+}
+
+/**
+ * Fill in one property comparison of a restriction. The various restriction
+ * structures share this layout.
+ */
+template <class Restriction>
+static void windowTerm(Restriction &term, int tag, uint8_t relop, const QDateTime &value)
+{
+    term.rt = RES_PROPERTY;
+    term.res.resProperty.relop = relop;
+    term.res.resProperty.ulPropTag = (MAPITAGS)tag;
+    term.res.resProperty.lpProp.ulPropTag = (MAPITAGS)tag;
+    convertSysTime(value, term.res.resProperty.lpProp.value.ft);
+}
+
+bool MapiFolder::windowApply()
+{
+    if (!m_windowFrom.isValid() && !m_windowTo.isValid()) {
+        return true;
+    }
+
+    // Map any named properties to their ids in this store.
+    SPropTagArray tags;
+    tags.cValues = m_windowExemptTag ? 3 : 2;
+    tags.aulPropTag = (MAPITAGS *)array<int>(tags.cValues + 1);
+    if (!tags.aulPropTag) {
+        error() << "cannot allocate window tags" << mapiError();
+        return false;
+    }
+    tags.aulPropTag[0] = (MAPITAGS)m_windowStartTag;
+    tags.aulPropTag[1] = (MAPITAGS)m_windowEndTag;
+    if (m_windowExemptTag) {
+        tags.aulPropTag[2] = (MAPITAGS)m_windowExemptTag;
+    }
+    tags.aulPropTag[tags.cValues] = (MAPITAGS)0;
+    bool usingNamedProperties = false;
+    for (unsigned i = 0; i < tags.cValues; i++) {
+        usingNamedProperties |= ((tags.aulPropTag[i] & 0x80000000) != 0);
+    }
+    if (usingNamedProperties) {
+        mapi_nameid *names = mapi_nameid_new(ctx());
+        SPropTagArray *namedTags = talloc_zero(ctx(), struct SPropTagArray);
+
+        if (!names || !namedTags) {
+            error() << "cannot create named window properties" << mapiError();
+            return false;
+        }
+        MAPISTATUS status = mapi_nameid_lookup_SPropTagArray(names, &tags);
+        if ((MAPI_E_NOT_FOUND != status) && (MAPI_E_SUCCESS != status)) {
+            error() << "cannot find named window properties" << mapiError();
+            return false;
+        }
+        MapiTrace trace(MapiTracer::GetIDsFromNames, m_id.second);
+        if (MAPI_E_SUCCESS != trace(mapi_nameid_GetIDsFromNames(names, &m_object, namedTags))) {
+            error() << "cannot find named window property ids" << mapiError();
+            return false;
+        }
+        if (MAPI_E_SUCCESS != mapi_nameid_map_SPropTagArray(names, &tags, namedTags)) {
+            error() << "cannot map named window properties" << mapiError();
+            return false;
+        }
+    }
+
+    // Build the window itself, as one or two comparisons.
+    unsigned count = 0;
+    mapi_SRestriction_and *terms = talloc_zero_array(ctx(), mapi_SRestriction_and, 2);
+    if (!terms) {
+        error() << "cannot allocate window" << mapiError();
+        return false;
+    }
+    if (m_windowFrom.isValid()) {
+        windowTerm(terms[count++], tags.aulPropTag[1], RELOP_GE, m_windowFrom);
+    }
+    if (m_windowTo.isValid()) {
+        windowTerm(terms[count++], tags.aulPropTag[0], RELOP_LE, m_windowTo);
+    }
+
+    // Add in any exemption.
+    mapi_SRestriction restriction;
+    if (m_windowExemptTag) {
+        mapi_SRestriction_or *alternatives = talloc_zero_array(ctx(), mapi_SRestriction_or, 2);
+        if (!alternatives) {
+            error() << "cannot allocate window exemption" << mapiError();
+            return false;
+        }
+        if (count == 1) {
+            alternatives[0].rt = terms[0].rt;
+            alternatives[0].res.resProperty = terms[0].res.resProperty;
+        } else {
+            alternatives[0].rt = RES_AND;
+            alternatives[0].res.resAnd.cRes = count;
+            alternatives[0].res.resAnd.res = terms;
+        }
+        alternatives[1].rt = RES_PROPERTY;
+        alternatives[1].res.resProperty.relop = RELOP_EQ;
+        alternatives[1].res.resProperty.ulPropTag = tags.aulPropTag[2];
+        alternatives[1].res.resProperty.lpProp.ulPropTag = tags.aulPropTag[2];
+        alternatives[1].res.resProperty.lpProp.value.b = 1;
+        restriction.rt = RES_OR;
+        restriction.res.resOr.cRes = 2;
+        restriction.res.resOr.res = alternatives;
+    } else if (count == 1) {
+        restriction.rt = terms[0].rt;
+        restriction.res.resProperty = terms[0].res.resProperty;
+    } else {
+        restriction.rt = RES_AND;
+        restriction.res.resAnd.cRes = count;
+        restriction.res.resAnd.res = terms;
+    }
+
+    uint8_t status;
+    MapiTrace trace(MapiTracer::Restrict, m_id.second);
+    if (MAPI_E_SUCCESS != trace(Restrict(&m_contents, &restriction, &status))) {
+        error() << "cannot restrict content table to window" << m_windowFrom << m_windowTo << mapiError();
+        return false;
+    }
+    MAPI_LOG(Folders, debug()) << "restricted content table to window" << m_windowFrom << m_windowTo;
+    return true;
+}
+
+bool MapiFolder::open()
+{
+    MapiTrace trace(MapiTracer::OpenFolder, m_id.second);
+    if (MAPI_E_SUCCESS != trace(OpenFolder(m_connection->store(m_id), m_id.second, &m_object))) {
+        error() << "cannot open folder" << m_id << mapiError();
+        return false;
+    }
+    return true;
+}
+
+MapiItem::MapiItem(const MapiId &id, QString &name, QDateTime &modified) :
+    m_id(id),
+    m_name(name),
+    m_modified(modified),
+    m_size(0),
+    m_flags(0)
+{
+}
+
+const MapiId &MapiItem::id() const
+{
+    return m_id;
+}
+
+QString MapiItem::name() const
+{
+    return m_name;
+}
+
+QDateTime MapiItem::modified() const
+{
+    return m_modified;
+}
+
+QByteArray MapiItem::searchKey() const
+{
+    return m_searchKey;
+}
+
+QString MapiItem::subject() const
+{
+    return m_subject;
+}
+
+QString MapiItem::sender() const
+{
+    return m_sender;
+}
+
+QString MapiItem::senderEmail() const
+{
+    return m_senderEmail;
+}
+
+QDateTime MapiItem::delivered() const
+{
+    return m_delivered;
+}
+
+unsigned MapiItem::size() const
+{
+    return m_size;
+}
+
+unsigned MapiItem::flags() const
+{
+    return m_flags;
+}
+
+QByteArray MapiItem::conversationIndex() const
+{
+    return m_conversationIndex;
+}
+
+QString MapiItem::messageId() const
+{
+    return m_messageId;
+}
+
+static quint64 convertFileTime(const FILETIME &filetime)
+{
+    return ((quint64)filetime.dwHighDateTime << 32) | filetime.dwLowDateTime;
+}
+
+static QDateTime convertFileTime(quint64 fileTime)
+{
+    FILETIME filetime;
+
+    if (!fileTime) {
+        return QDateTime();
+    }
+    filetime.dwHighDateTime = fileTime >> 32;
+    filetime.dwLowDateTime = fileTime;
+    return convertSysTime(filetime);
+}
+
+MapiContents::MapiContents() :
+    m_envelope(false),
+    m_named(false),
+    m_sorted(true)
+{
+    clear();
+}
+
+void MapiContents::clear()
+{
+    m_sorted = true;
+    m_mids.clear();
+    m_modified.clear();
+    m_changeKeys.clear();
+    m_searchKeys.clear();
+    m_names.clear();
+    m_subjects.clear();
+    m_senders.clear();
+    m_senderEmails.clear();
+    m_delivered.clear();
+    m_sizes.clear();
+    m_flags.clear();
+    m_conversationIndexes.clear();
+    m_messageIds.clear();
+    m_strings.clear();
+    m_stringIds.clear();
+
+    // All empty values share the first blob.
+    m_blobs.clear();
+    blobAppend(0, 0);
+}
+
+int MapiContents::size() const
+{
+    return m_mids.size();
+}
+
+bool MapiContents::isSorted() const
+{
+    return m_sorted;
+}
+
+bool MapiContents::hasEnvelope() const
+{
+    return m_envelope;
+}
+
+/**
+ * Order rows by their message id.
+ */
+class MapiContentsMidLessThan
+{
+public:
+    MapiContentsMidLessThan(const QVector<mapi_id_t> &mids) :
+        m_mids(mids)
+    {
+    }
+
+    bool operator()(int left, int right) const
+    {
+        return m_mids.at(left) < m_mids.at(right);
+    }
+
+private:
+    const QVector<mapi_id_t> &m_mids;
+};
+
+QVector<int> MapiContents::order() const
+{
+    QVector<int> result(m_mids.size());
+
+    for (int i = 0; i < result.size(); i++) {
+        result[i] = i;
+    }
+    if (!m_sorted) {
+        qSort(result.begin(), result.end(), MapiContentsMidLessThan(m_mids));
+    }
+    return result;
+}
+
+mapi_id_t MapiContents::mid(int row) const
+{
+    return m_mids.at(row);
+}
+
+QDateTime MapiContents::modified(int row) const
+{
+    return convertFileTime(m_modified.at(row));
+}
+
+QByteArray MapiContents::changeKey(int row) const
+{
+    return blobAt(m_changeKeys.at(row));
+}
+
+QByteArray MapiContents::searchKey(int row) const
+{
+    return blobAt(m_searchKeys.at(row));
+}
+
+QString MapiContents::messageId(int row) const
+{
+    if (!m_envelope) {
+        return QString();
+    }
+    return QString::fromUtf8(blobAt(m_messageIds.at(row)));
+}
+
+MapiItem *MapiContents::item(const MapiId &parent, int row) const
+{
+    MapiId id(parent, m_mids.at(row));
+    QString name = m_named ? m_strings.at(m_names.at(row)) : QString();
+    QDateTime modified = this->modified(row);
+    MapiItem *item = new MapiItem(id, name, modified);
+
+    item->m_searchKey = searchKey(row);
+    if (m_envelope) {
+        QDateTime delivered = convertFileTime(m_delivered.at(row));
+
+        item->m_subject = m_strings.at(m_subjects.at(row));
+        if (item->m_subject.isEmpty()) {
+            item->m_subject = name;
+        }
+        item->m_sender = m_strings.at(m_senders.at(row));
+        item->m_senderEmail = m_strings.at(m_senderEmails.at(row));
+        item->m_delivered = delivered.isValid() ? delivered : modified;
+        item->m_size = m_sizes.at(row);
+        item->m_flags = m_flags.at(row);
+        item->m_conversationIndex = blobAt(m_conversationIndexes.at(row));
+        item->m_messageId = messageId(row);
+    }
+    return item;
+}
+
+qint64 MapiContents::memoryUsage() const
+{
+    qint64 result = 0;
+
+    result += m_mids.capacity() * sizeof(mapi_id_t);
+    result += (m_modified.capacity() + m_delivered.capacity()) * sizeof(quint64);
+    result += (m_changeKeys.capacity() + m_searchKeys.capacity() + m_names.capacity() + 
+               m_subjects.capacity() + m_senders.capacity() + m_senderEmails.capacity() + 
+               m_sizes.capacity() + m_flags.capacity() + m_conversationIndexes.capacity() + 
+               m_messageIds.capacity()) * sizeof(quint32);
+    result += m_blobs.capacity();
+    foreach (const QString &string, m_strings) {
+        result += sizeof(QString) + string.size() * sizeof(QChar);
+    }
+    return result;
+}
+
+quint32 MapiContents::blobAppend(const void *data, unsigned length)
+{
+    if (!length && !m_blobs.isEmpty()) {
+        return 0;
+    }
+
+    quint32 offset = m_blobs.size();
+    m_blobs.append((const char *)&length, sizeof(length));
+    m_blobs.append((const char *)data, length);
+    return offset;
+}
+
+QByteArray MapiContents::blobAt(quint32 offset) const
+{
+    unsigned length;
+
+    memcpy(&length, m_blobs.constData() + offset, sizeof(length));
+    return QByteArray(m_blobs.constData() + offset + sizeof(length), length);
+}
+
+quint32 MapiContents::stringIntern(const QString &string)
+{
+    QHash<QString, quint32>::const_iterator i = m_stringIds.constFind(string);
+
+    if (i != m_stringIds.constEnd()) {
+        return i.value();
+    }
+    quint32 id = m_strings.size();
+    m_strings.append(string);
+    m_stringIds.insert(string, id);
+    return id;
+}
+
+void MapiContents::append(const SRow &row)
+{
+    mapi_id_t id = 0;
+    quint64 modified = 0;
+    const Binary_r *changeKey = 0;
+    const Binary_r *searchKey = 0;
+    QString name;
+    QString subject;
+    QString sender;
+    QString senderEmail;
+    QByteArray senderAddressType;
+    quint64 delivered = 0;
+    unsigned size = 0;
+    unsigned flags = 0;
+    const Binary_r *conversationIndex = 0;
+    QString messageId;
+
+    for (unsigned j = 0; j < row.cValues; j++) {
+        SPropValue &value = row.lpProps[j];
+
+        // Note that the set of properties fetched here must be aligned
+        // with those set by MapiFolder::contentsPull(). The common columns
+        // are taken straight from the row rather than via a QVariant.
+        switch (value.ulPropTag) {
+        case PidTagMid:
+            id = value.value.d;
+            break;
+        case PidTagLastModificationTime:
+            modified = convertFileTime(value.value.ft);
+            break;
+        case PidTagSearchKey:
+            searchKey = &value.value.bin;
+            break;
+        case PidTagChangeKey:
+            changeKey = &value.value.bin;
+            break;
+        case PidTagConversationTopic:
+            name = MapiProperty(value).value().toString();
+            break;
+        case PidTagSubject:
+            subject = MapiProperty(value).value().toString();
+            break;
+        case PidTagSenderName:
+            sender = MapiProperty(value).value().toString();
+            break;
+        case PidTagSenderEmailAddress:
+            senderEmail = MapiProperty(value).value().toString();
+            break;
+        case PidTagSenderAddressType:
+            senderAddressType = MapiProperty(value).value().toString().toAscii();
+            break;
+        case PidTagMessageDeliveryTime:
+            delivered = convertFileTime(value.value.ft);
+            break;
+        case PidTagMessageSize:
+            size = value.value.l;
+            break;
+        case PidTagMessageFlags:
+            flags = value.value.l;
+            break;
+        case PidTagConversationIndex:
+            conversationIndex = &value.value.bin;
+            break;
+        case PidTagInternetMessageId:
+            messageId = MapiProperty(value).value().toString();
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (!m_mids.isEmpty() && (m_mids.last() > id)) {
+        m_sorted = false;
+    }
+    m_mids.append(id);
+    m_modified.append(modified);
+    m_changeKeys.append(changeKey ? blobAppend(changeKey->lpb, changeKey->cb) : blobAppend(0, 0));
+    m_searchKeys.append(searchKey ? blobAppend(searchKey->lpb, searchKey->cb) : blobAppend(0, 0));
+    if (m_named) {
+        m_names.append(stringIntern(name));
+    }
+    if (m_envelope) {
+        QByteArray utf8 = messageId.toUtf8();
+
+        m_subjects.append(stringIntern(subject));
+        m_senders.append(stringIntern(sender));
+        m_senderEmails.append(stringIntern(mapiExtractEmail(senderEmail, senderAddressType)));
+        m_delivered.append(delivered);
+        m_sizes.append(size);
+        m_flags.append(flags);
+        m_conversationIndexes.append(conversationIndex ? blobAppend(conversationIndex->lpb, conversationIndex->cb) : blobAppend(0, 0));
+        m_messageIds.append(blobAppend(utf8.constData(), utf8.size()));
+    }
+}
+
+MapiMessage::MapiMessage(MapiConnector2 *connection, const char *tallocName, const MapiId &id) :
+    MapiObject(connection, tallocName, id),
+    m_bodyFormat(BodyNative),
+    m_recipientBatch(0)
+{
+}
+
+/**
+ * Values of PidTagNativeBody, from [MS-OXCMSG] 2.2.1.48.2.
+ */
+#define NATIVE_BODY_UNDEFINED   0x0
+#define NATIVE_BODY_PLAIN_TEXT  0x1
+#define NATIVE_BODY_RTF         0x2
+#define NATIVE_BODY_HTML        0x3
+#define NATIVE_BODY_SIGNED      0x4
+
+bool MapiMessage::bodyPull(unsigned codepage, QString &text, QString &html)
+{
+    unsigned nativeBody = NATIVE_BODY_UNDEFINED;
+    bool rtfInSync = false;
+    bool wantText = false;
+    bool wantHtml = false;
+    QVariant tmp;
+
+    tmp = property(PidTagNativeBody);
+    if (tmp.isValid()) {
+        nativeBody = tmp.toUInt();
+    }
+    tmp = property(PidTagRtfInSync);
+    if (tmp.isValid()) {
+        rtfInSync = tmp.toBool();
+    }
+    switch (m_bodyFormat) {
+    case BodyText:
+        wantText = true;
+        break;
+    case BodyTextAndHtml:
+        wantText = true;
+        wantHtml = true;
+        break;
+    case BodyNative:
+        switch (nativeBody) {
+        case NATIVE_BODY_HTML:
+            wantHtml = true;
+            break;
+        case NATIVE_BODY_RTF:
+            // We cannot decode RTF ourselves. If it is in sync with the
+            // text, then the text is a faithful rendition. Otherwise, the
+            // HTML (which Exchange derives from the RTF) keeps the content.
+            if (rtfInSync) {
+                wantText = true;
+            } else {
+                wantHtml = true;
+            }
+            break;
+        default:
+            wantText = true;
+            break;
         }
+        break;
     }
-    return true;
-}
+    MAPI_LOG(Messages, debug()) << "native body:" << nativeBody << "rtfInSync:" << rtfInSync << "text:" << wantText << "html:" << wantHtml;
 
-bool MapiFolder::open()
-{
-    if (MAPI_E_SUCCESS != OpenFolder(m_connection->store(m_id), m_id.second, &m_object)) {
-        error() << "cannot open folder" << m_id << mapiError();
+    // We get the PidTagBody as Unicode in any event.
+    if (wantText && !bodyPull(PidTagBody, CODEPAGE_UTF16, text)) {
+        return false;
+    }
+    if (wantHtml && !bodyPull(PidTagHtml, codepage, html)) {
         return false;
     }
     return true;
 }
 
-MapiItem::MapiItem(const MapiId &id, QString &name, QDateTime &modified) :
-    m_id(id),
-    m_name(name),
-    m_modified(modified)
-{
-}
-
-const MapiId &MapiItem::id() const
-{
-    return m_id;
-}
-
-QString MapiItem::name() const
+bool MapiMessage::bodyPull(int tag, unsigned codepage, QString &body)
 {
-    return m_name;
-}
+    int tagList[] = { tag, 0 };
+    SPropTagArray tags = { 1, (MAPITAGS *)tagList };
+    SPropValue *values = 0;
+    uint32_t count = 0;
+
+    MapiPhase phase(m_phases, "body");
+    MapiTrace trace(MapiTracer::GetProps, m_id.second);
+    if (MAPI_E_SUCCESS != trace(GetProps(&m_object, MAPI_UNICODE | MAPI_PROPS_SKIP_NAMEDID_CHECK, &tags, &values, &count))) {
+        error() << "cannot pull body:" << tagName(tag) << mapiError();
+        return false;
+    }
 
-QDateTime MapiItem::modified() const
-{
-    return m_modified;
-}
+    bool ok = true;
+    if (count) {
+        MapiProperty property(values[0]);
 
-MapiMessage::MapiMessage(MapiConnector2 *connection, const char *tallocName, const MapiId &id) :
-    MapiObject(connection, tallocName, id)
-{
+        if ((property.tag() & 0xFFFF) != PT_ERROR) {
+            body = property.value().toString();
+        } else if (MAPI_E_NOT_ENOUGH_MEMORY == property.value().toInt()) {
+            // Handle oversize objects.
+            ok = streamRead(&m_object, tag, codepage, body);
+        }
+    }
+    MAPIFreeBuffer(values);
+    phase.setSize(body.size());
+    return ok;
 }
 
 void MapiMessage::addUniqueRecipient(const char *source, MapiRecipient &candidate)
 {
 #if DEBUG_RECIPIENTS
-    debug() << "candidate address:" << source << candidate.toString();
+    MAPI_LOG(Recipients, debug()) << "candidate address:" << source << candidate.toString();
 #else
     Q_UNUSED(source)
 #endif
@@ -361,60 +1314,85 @@ void MapiMessage::addUniqueRecipient(const char *source, MapiRecipient &candidat
         return;
     }
 
-    for (int i = 0; i < m_recipients.size(); i++) {
-        MapiRecipient &entry = m_recipients[i];
-
-        // A ReplyTo item only matches other ReplyTo items.
-        if ((candidate.type() == MapiRecipient::ReplyTo) && (entry.type() != MapiRecipient::ReplyTo)) {
-            continue;
+    // Find the first entry which matches by name or email. The indexes may
+    // hold stale keys for entries whose name or email has since changed, so
+    // each hit is checked against the entry itself.
+    QString nameKey = candidate.name.toCaseFolded();
+    QString emailKey = candidate.email.toCaseFolded();
+    int match = -1;
+    bool nameMatch = false;
+    if (!nameKey.isEmpty()) {
+        foreach (int i, m_recipientNames.value(nameKey)) {
+            if (((match == -1) || (i < match)) && recipientMatches(candidate, i) &&
+                (0 == m_recipients[i].name.compare(candidate.name, Qt::CaseInsensitive))) {
+                match = i;
+                nameMatch = true;
+            }
+        }
+    }
+    if (!emailKey.isEmpty()) {
+        foreach (int i, m_recipientEmails.value(emailKey)) {
+            if (((match == -1) || (i < match)) && recipientMatches(candidate, i) &&
+                (0 == m_recipients[i].email.compare(candidate.email, Qt::CaseInsensitive))) {
+                match = i;
+                nameMatch = false;
+            }
         }
+    }
+
+    if (match != -1) {
+        MapiRecipient &entry = m_recipients[match];
 
         // If we find a name match, fill in a missing email if we can.
-        if (!candidate.name.isEmpty() && (0 == entry.name.compare(candidate.name, Qt::CaseInsensitive))) {
-            if (isGoodEmailAddress(entry.email) < isGoodEmailAddress(candidate.email)) {
+        // Otherwise, we found an email match, so fill in a missing name.
+        bool better;
+        if (nameMatch) {
+            better = isGoodEmailAddress(entry.email) < isGoodEmailAddress(candidate.email);
+            if (better) {
                 entry.email = candidate.email;
-                // Promote the type if needed to more specific
-                // (numerically lower) type.
-                if (entry.type() > candidate.type()) {
-                    entry.setType(candidate.type());
-                }
-                // Promote the object and display type to a non-default value.
-                if (entry.displayType() == MapiRecipient::DtMailuser) {
-                    entry.setDisplayType(candidate.displayType());
-                }
-                if (entry.objectType() == MapiRecipient::OtMailuser) {
-                    entry.setObjectType(candidate.objectType());
-                }
+                m_recipientEmails[emailKey].append(match);
             }
-            return;
-        }
-
-        // If we find an email match, fill in a missing name if we can.
-        if (!candidate.email.isEmpty() && (0 == entry.email.compare(candidate.email, Qt::CaseInsensitive))) {
-            if (entry.name.length() < candidate.name.length()) {
+        } else {
+            better = entry.name.length() < candidate.name.length();
+            if (better) {
                 entry.name = candidate.name;
-                // Promote the type if needed to more specific
-                // (numerically lower) type.
-                if (entry.type() > candidate.type()) {
-                    entry.setType(candidate.type());
-                }
-                // Promote the object and displkay type to a non-default value.
-                if (entry.displayType() == MapiRecipient::DtMailuser) {
-                    entry.setDisplayType(candidate.displayType());
-                }
-                if (entry.objectType() == MapiRecipient::OtMailuser) {
-                    entry.setObjectType(candidate.objectType());
-                }
+                m_recipientNames[nameKey].append(match);
+            }
+        }
+        if (better) {
+            // Promote the type if needed to more specific
+            // (numerically lower) type.
+            if (entry.type() > candidate.type()) {
+                entry.setType(candidate.type());
+            }
+            // Promote the object and display type to a non-default value.
+            if (entry.displayType() == MapiRecipient::DtMailuser) {
+                entry.setDisplayType(candidate.displayType());
+            }
+            if (entry.objectType() == MapiRecipient::OtMailuser) {
+                entry.setObjectType(candidate.objectType());
             }
-            return;
         }
+        return;
     }
 
     // Add the entry if it did not match.
 #if DEBUG_RECIPIENTS
-    debug() << "add new address:" << source << candidate.toString();
+    MAPI_LOG(Recipients, debug()) << "add new address:" << source << candidate.toString();
 #endif
     m_recipients.append(candidate);
+    if (!nameKey.isEmpty()) {
+        m_recipientNames[nameKey].append(m_recipients.size() - 1);
+    }
+    if (!emailKey.isEmpty()) {
+        m_recipientEmails[emailKey].append(m_recipients.size() - 1);
+    }
+}
+
+bool MapiMessage::recipientMatches(const MapiRecipient &candidate, int i) const
+{
+    // A ReplyTo item only matches other ReplyTo items.
+    return (candidate.type() != MapiRecipient::ReplyTo) || (m_recipients[i].type() == MapiRecipient::ReplyTo);
 }
 
 QDebug MapiMessage::debug() const
@@ -431,7 +1409,9 @@ QDebug MapiMessage::error() const
 
 bool MapiMessage::open()
 {
-    if (MAPI_E_SUCCESS != OpenMessage(m_connection->store(m_id), m_id.first, m_id.second, &m_object, 0x0)) {
+    MapiPhase phase(m_phases, "open");
+    MapiTrace trace(MapiTracer::OpenMessage, m_id.second);
+    if (MAPI_E_SUCCESS != trace(OpenMessage(m_connection->store(m_id), m_id.first, m_id.second, &m_object, 0x0))) {
         error() << "cannot open message, error:" << mapiError();
         return false;
     }
@@ -444,9 +1424,6 @@ bool MapiMessage::open()
 bool MapiMessage::propertiesPull(QVector<int> &tags, const bool tagsAppended, bool pullAll)
 {
     static unsigned ourTagList[] = {
-        PidTagDisplayTo,
-        PidTagDisplayCc,
-        PidTagDisplayBcc,
         PidTagSenderEmailAddress,
         PidTagSenderSmtpAddress,
         PidTagSenderName,
@@ -516,7 +1493,7 @@ void MapiMessage::recipientPopulate(const char *phase, SRow &recipient, MapiReci
             result.email = mapiExtractEmail(property, "SMTP");
             break;
         case UNDOCUMENTED_PR_EMAIL_UNICODE:
-            debug() << "UNDOCUMENTED_PR_EMAIL_UNICODE" << property.value().toString();
+            MAPI_LOG(Recipients, debug()) << "UNDOCUMENTED_PR_EMAIL_UNICODE" << property.value().toString();
             tmp = mapiExtractEmail(property, "SMTP");
             if (isGoodEmailAddress(result.email) < isGoodEmailAddress(tmp)) {
                 result.email = tmp;
@@ -553,11 +1530,7 @@ void MapiMessage::recipientPopulate(const char *phase, SRow &recipient, MapiReci
                 // Carry on with next property...
                 break;
             }
-#if (DEBUG_MESSAGE_PROPERTIES)
-            debug() << "ignoring " << phase << " property:" << tagName(property.tag()) << property.value();
-#else
-            Q_UNUSED(phase);
-#endif
+            MAPI_LOG(Messages, debug()) << "ignoring " << phase << " property:" << tagName(property.tag()) << property.value();
             break;
         }
     }
@@ -603,7 +1576,7 @@ bool MapiMessage::recipientsPull()
         error() << "cannot read recipient table" << mapiError();
         return false;
     }
-    debug() << "number of recipients:" << recCount;
+    MAPI_LOG(Recipients, debug()) << "number of recipients:" << recCount;
     for (int i = 0; i < recCount; i++) {
         struct RecipientRow &recipient = &recipientTable[i].RecipientRow;
         Recipient result;
@@ -641,34 +1614,50 @@ bool MapiMessage::recipientsPull()
      * The list of tags used to fetch a recipient.
      */
     SPropTagArray tableTags;
+    MapiPhase phase(m_phases, "recipients");
 
     // Start with a clean slate.
     m_recipients.clear();
+    m_recipientNames.clear();
+    m_recipientEmails.clear();
+    m_needingResolution.clear();
 
     // Step 1. Add all the recipients from the actual table.
     SRowSet rowset;
-    if (MAPI_E_SUCCESS != GetRecipientTable(&m_object, &rowset, &tableTags)) {
+    MapiTrace trace(MapiTracer::GetRecipientTable, m_id.second);
+    if (MAPI_E_SUCCESS != trace(GetRecipientTable(&m_object, &rowset, &tableTags))) {
         error() << "cannot get recipient table:" << mapiError();
         return false;
     }
 
+    static QString perfectForm = QString::fromAscii("foo@foo");
+    static unsigned perfect = isGoodEmailAddress(perfectForm);
+    bool tableComplete = (rowset.cRows > 0);
     for (unsigned i = 0; i < rowset.cRows; i++) {
         SRow &recipient = rowset.aRow[i];
         MapiRecipient result(MapiRecipient::To);
 
         recipientPopulate("recipient table", recipient, result);
+        if (result.name.isEmpty() || (isGoodEmailAddress(result.email) < perfect)) {
+            tableComplete = false;
+        }
         addUniqueRecipient("recipient table", result);
     }
 
-    // Walk through the properties and extract the values of interest. The
-    // properties here should be aligned with the list pulled above.
-    //
-    // Step 2. Add the DisplayTo, CC and BCC and potential sender items.
+    // Step 2. Add the DisplayTo, CC and BCC.
     //
     // Astonishingly, when we call recipientsPull() later,
     // the results can contain entries with missing name (!)
     // and email values. Reading this property is a pathetic
-    // workaround.
+    // workaround, so we only do it when the table has let us down.
+    if (!tableComplete && !displayRecipientsPull()) {
+        return false;
+    }
+
+    // Walk through the properties and extract the values of interest. The
+    // properties here should be aligned with the list pulled above.
+    //
+    // Potential sender items.
     MapiRecipient sender(MapiRecipient::Sender);
     MapiRecipient originalSender(MapiRecipient::Sender);
     MapiRecipient sentRepresenting(MapiRecipient::ReplyTo);
@@ -678,33 +1667,6 @@ bool MapiMessage::recipientsPull()
         MapiProperty property(m_properties[i]);
 
         switch (property.tag()) {
-        case PidTagDisplayTo:
-            foreach (QString name, property.value().toString().split(QChar::fromAscii(';'))) {
-                MapiRecipient result(MapiRecipient::To);
-
-                result.name = name.trimmed();
-                result.email = mapiExtractEmail(result.name, "SMTP", true);
-                addUniqueRecipient("displayTo", result);
-            }
-            break;
-        case PidTagDisplayCc:
-            foreach (QString name, property.value().toString().split(QChar::fromAscii(';'))) {
-                MapiRecipient result(MapiRecipient::CC);
-
-                result.name = name.trimmed();
-                result.email = mapiExtractEmail(result.name, "SMTP", true);
-                addUniqueRecipient("displayCC", result);
-            }
-            break;
-        case PidTagDisplayBcc:
-            foreach (QString name, property.value().toString().split(QChar::fromAscii(';'))) {
-                MapiRecipient result(MapiRecipient::BCC);
-
-                result.name = name.trimmed();
-                result.email = mapiExtractEmail(result.name, "SMTP", true);
-                addUniqueRecipient("displayBCC", result);
-            }
-            break;
         case PidTagSenderEmailAddress:
             sender.email = mapiExtractEmail(property, "EX");
             break;
@@ -761,8 +1723,6 @@ bool MapiMessage::recipientsPull()
     QList<int> needingResolution;
     for (int i = 0; i < m_recipients.size(); i++) {
         MapiRecipient &recipient = m_recipients[i];
-        static QString perfectForm = QString::fromAscii("foo@foo");
-        static unsigned perfect = isGoodEmailAddress(perfectForm);
 
         // If we find a missing/incomplete email, it needs resolution.
         if (isGoodEmailAddress(recipient.email) < perfect) {
@@ -770,89 +1730,86 @@ bool MapiMessage::recipientsPull()
         }
     }
 #if DEBUG_RECIPIENTS
-    debug() << "recipients needing primary resolution:" << needingResolution.size() << "from a total:" << m_recipients.size();
+    MAPI_LOG(Recipients, debug()) << "recipients needing primary resolution:" << needingResolution.size() << "from a total:" << m_recipients.size();
 #endif
 
     // Short-circuit exit.
     if (!needingResolution.size()) {
+        m_connection->recipientStageExit(tableComplete ? MapiConnector2::RecipientTable : MapiConnector2::RecipientDisplay);
         return true;
     }
 
-    // Primary resolution is to ask Exchange to resolve the names.
-    struct PropertyTagArray_r *statuses = NULL;
-    struct SRowSet *results = NULL;
-
-    // Fill an array with the names we need to resolve. We will do a Unicode
-    // lookup, so use UTF8.
-    const char *names[needingResolution.size() + 1];
-    unsigned j = 0;
-    foreach (int i, needingResolution) {
-        MapiRecipient &recipient = m_recipients[i];
-
-        names[j] = string(recipient.name);
-        j++;
+    // Primary resolution is to ask Exchange to resolve the names. When
+    // batching, that happens later, for many messages at once.
+    phase.finish();
+    m_needingResolution = needingResolution;
+    if (m_recipientBatch) {
+        m_recipientBatch->add(this);
+        return true;
     }
-    names[j] = 0;
+    MapiPhase resolvePhase(m_phases, "resolve");
+    MapiRecipientBatch batch(m_connection);
+    batch.add(this);
+    return batch.resolve();
+}
 
-    // Server round trip here!
-    static int recipientTagList[] = {
-        PidTag7BitDisplayName_string8,
-        PidTagDisplayName,
-        PidTagRecipientDisplayName, 
-        PidTagPrimarySmtpAddress,
-        UNDOCUMENTED_PR_EMAIL_UNICODE,
-        0x60010018,
-        PidTagRecipientTrackStatus,
-        PidTagRecipientFlags,
-        PidTagRecipientType,
-        PidTagRecipientOrder,
-        PidTagDisplayType,
-        PidTagObjectType,
-        0 };
-    static SPropTagArray recipientTags = {
-        (sizeof(recipientTagList) / sizeof(recipientTagList[0])) - 1,
-        (MAPITAGS *)recipientTagList };
-    if (!m_connection->resolveNames(names, &recipientTags, &results, &statuses)) {
+bool MapiMessage::displayRecipientsPull()
+{
+    int tagList[] = { PidTagDisplayTo, PidTagDisplayCc, PidTagDisplayBcc, 0 };
+    SPropTagArray tags = { 3, (MAPITAGS *)tagList };
+    SPropValue *values = 0;
+    uint32_t count = 0;
+
+    MapiTrace trace(MapiTracer::GetProps, m_id.second);
+    if (MAPI_E_SUCCESS != trace(GetProps(&m_object, MAPI_UNICODE | MAPI_PROPS_SKIP_NAMEDID_CHECK, &tags, &values, &count))) {
+        error() << "cannot pull display recipients:" << mapiError();
         return false;
     }
-    if (results) {
-        // Walk the returned results. Every request has a status, but
-        // only resolved items also have a row of results.
-        //
-        // As we do the walk, we trim the needingResolution array so
-        // that when we are done with this loop, it only contains
-        // entries which need more work.
-        for (unsigned i = 0, unresolveds = 0; i < statuses->cValues; i++) {
-            MapiRecipient &to = m_recipients[needingResolution.at(unresolveds)];
-
-            if (MAPI_RESOLVED == statuses->aulPropTag[i]) {
-                struct SRow &recipient = results->aRow[i - unresolveds];
-                MapiRecipient result(MapiRecipient::To);
-
-                recipientPopulate("resolution", recipient, result);
-                // A resolved value is better than an unresolved one.
-                if (!result.name.isEmpty()) {
-                    to.name = result.name;
-                }
-                if (isGoodEmailAddress(to.email) < isGoodEmailAddress(result.email)) {
-                    to.email = result.email;
-                }
-                needingResolution.removeAt(unresolveds);
-            } else {
-                unresolveds++;
-            }
+    for (unsigned i = 0; i < count; i++) {
+        MapiProperty property(values[i]);
+        MapiRecipient::Type type;
+        const char *source;
+
+        switch (property.tag()) {
+        case PidTagDisplayTo:
+            type = MapiRecipient::To;
+            source = "displayTo";
+            break;
+        case PidTagDisplayCc:
+            type = MapiRecipient::CC;
+            source = "displayCC";
+            break;
+        case PidTagDisplayBcc:
+            type = MapiRecipient::BCC;
+            source = "displayBCC";
+            break;
+        default:
+            continue;
+        }
+        foreach (QString name, property.value().toString().split(QChar::fromAscii(';'))) {
+            MapiRecipient result(type);
+
+            result.name = name.trimmed();
+            result.email = mapiExtractEmail(result.name, "SMTP", true);
+            addUniqueRecipient(source, result);
         }
     }
-    MAPIFreeBuffer(results);
-    MAPIFreeBuffer(statuses);
+    MAPIFreeBuffer(values);
+    return true;
+}
+
+void MapiMessage::recipientsFinish()
+{
+    QList<int> &needingResolution = m_needingResolution;
 #if DEBUG_RECIPIENTS
-    debug() << "recipients needing secondary resolution:" << needingResolution.size();
+    MAPI_LOG(Recipients, debug()) << "recipients needing secondary resolution:" << needingResolution.size();
 #endif
 
     // Secondary resolution is to remove entries which have the the same 
     // email. But we must take care since we'll still have unresolved 
     // entries with empty email values (which would collide).
     QMap<QString, MapiRecipient> uniqueResolvedRecipients;
+    QSet<QString> resolvedNames;
     for (int i = 0; i < m_recipients.size(); i++) {
         MapiRecipient &recipient = m_recipients[i];
 
@@ -873,20 +1830,21 @@ bool MapiMessage::recipientsPull()
                 }
             }
             uniqueResolvedRecipients.insert(recipient.email, recipient);
+            resolvedNames.insert(recipient.name);
+        }
+    }
 
-            // If the name we just inserted matches one with an empty
-            // email, we can kill the latter.
-            for (int j = 0; j < needingResolution.size(); j++)
-            {
-                if (recipient.name == m_recipients[needingResolution.at(j)].name) {
-                    needingResolution.removeAt(j);
-                    j--;
-                }
-            }
+    // If a name we inserted matches one with an empty email, we can kill 
+    // the latter.
+    QList<int> stillNeedingResolution;
+    foreach (int i, needingResolution) {
+        if (!resolvedNames.contains(m_recipients[i].name)) {
+            stillNeedingResolution << i;
         }
     }
+    needingResolution = stillNeedingResolution;
 #if DEBUG_RECIPIENTS
-    debug() << "recipients needing tertiary resolution:" << needingResolution.size();
+    MAPI_LOG(Recipients, debug()) << "recipients needing tertiary resolution:" << needingResolution.size();
 #endif
 
     // Tertiary resolution.
@@ -914,12 +1872,215 @@ bool MapiMessage::recipientsPull()
     foreach (MapiRecipient recipient, uniqueResolvedRecipients) {
         m_recipients.append(recipient);
 #if DEBUG_RECIPIENTS
-        debug() << "recipient name:" << recipient.toString();
+        MAPI_LOG(Recipients, debug()) << "recipient name:" << recipient.toString();
 #endif
     }
 #if DEBUG_RECIPIENTS
-    debug() << "recipients after resolution:" << m_recipients.size();
+    MAPI_LOG(Recipients, debug()) << "recipients after resolution:" << m_recipients.size();
 #endif
+    needingResolution.clear();
+    m_recipientNames.clear();
+    m_recipientEmails.clear();
+}
+
+void MapiMessage::recipientResolved(const MapiResolvedName &resolved, MapiRecipient &to)
+{
+    // A resolved value is better than an unresolved one.
+    if (!resolved.name.isEmpty()) {
+        to.name = resolved.name;
+    }
+    QString email = resolved.email;
+    if (isGoodEmailAddress(to.email) < isGoodEmailAddress(email)) {
+        to.email = email;
+        to.setDisplayType((MapiRecipient::DisplayType)resolved.displayType);
+        to.setObjectType((MapiRecipient::ObjectType)resolved.objectType);
+    }
+}
+
+MapiRecipientBatch::MapiRecipientBatch(MapiConnector2 *connection) :
+    TallocContext("MapiRecipientBatch::MapiRecipientBatch"),
+    m_connection(connection),
+    m_galHits(0)
+{
+}
+
+QDebug MapiRecipientBatch::debug() const
+{
+    static QString prefix = QString::fromAscii("MapiRecipientBatch:");
+    return TallocContext::debug(prefix);
+}
+
+QDebug MapiRecipientBatch::error() const
+{
+    static QString prefix = QString::fromAscii("MapiRecipientBatch:");
+    return TallocContext::error(prefix);
+}
+
+void MapiRecipientBatch::add(MapiMessage *message)
+{
+    m_messages.append(message);
+}
+
+/**
+ * A recipient waiting on the resolution of a name.
+ */
+typedef QPair<MapiMessage *, int> MapiWaitingRecipient;
+
+bool MapiRecipientBatch::resolve()
+{
+    // Skip any names the server has already told us about, and gather up 
+    // the rest so that each is only asked for once. Each message would 
+    // otherwise have cost a round trip.
+    QStringList keys;
+    QHash<QString, QList<MapiWaitingRecipient> > waiting;
+    QSet<MapiMessage *> waitingMessages;
+    unsigned messagesWaiting = 0;
+    foreach (MapiMessage *message, m_messages) {
+        if (message->m_needingResolution.size()) {
+            messagesWaiting++;
+        }
+
+        // Rebuild the list as we go, keeping only what is still unresolved.
+        QList<int> needingResolution;
+        foreach (int i, message->m_needingResolution) {
+            MapiRecipient &recipient = message->m_recipients[i];
+            MapiResolvedName cached;
+
+            if (m_connection->resolvedNameFind(recipient.name, cached)) {
+                if (!cached.email.isEmpty()) {
+                    MapiMessage::recipientResolved(cached, recipient);
+                } else {
+                    needingResolution << i;
+                }
+                continue;
+            }
+
+            // Next, try the local copy of the GAL, using the X500 DN or 
+            // alias which we may have been left with as an email, and then 
+            // the name.
+            if ((!recipient.email.isEmpty() && 
+                 m_connection->galIndex().find(recipient.email, cached.email)) ||
+                m_connection->galIndex().find(recipient.name, cached.email)) {
+                MapiMessage::recipientResolved(cached, recipient);
+                m_galHits++;
+                continue;
+            }
+
+            QString key = MapiConnector2::resolvedNameKey(recipient.name);
+            if (!waiting.contains(key)) {
+                keys << key;
+            }
+            waiting[key] << MapiWaitingRecipient(message, i);
+            waitingMessages.insert(message);
+            needingResolution << i;
+        }
+        message->m_needingResolution = needingResolution;
+    }
+
+    static int recipientTagList[] = {
+        PidTag7BitDisplayName_string8,
+        PidTagDisplayName,
+        PidTagRecipientDisplayName, 
+        PidTagPrimarySmtpAddress,
+        UNDOCUMENTED_PR_EMAIL_UNICODE,
+        0x60010018,
+        PidTagRecipientTrackStatus,
+        PidTagRecipientFlags,
+        PidTagRecipientType,
+        PidTagRecipientOrder,
+        PidTagDisplayType,
+        PidTagObjectType,
+        0 };
+    static SPropTagArray recipientTags = {
+        (sizeof(recipientTagList) / sizeof(recipientTagList[0])) - 1,
+        (MAPITAGS *)recipientTagList };
+    QSet<MapiWaitingRecipient> serverResolved;
+    unsigned batches = 0;
+    for (int start = 0; start < keys.size(); start += RESOLVE_BATCH_SIZE) {
+        QStringList batch = keys.mid(start, RESOLVE_BATCH_SIZE);
+        struct PropertyTagArray_r *statuses = NULL;
+        struct SRowSet *results = NULL;
+
+        // Fill an array with the names we need to resolve. We will do a 
+        // Unicode lookup, so use UTF8.
+        const char *names[batch.size() + 1];
+        unsigned j = 0;
+        foreach (const QString &key, batch) {
+            const MapiWaitingRecipient &first = waiting[key].first();
+
+            names[j] = string(first.first->m_recipients[first.second].name);
+            j++;
+        }
+        names[j] = 0;
+
+        // Server round trip here!
+        QTime elapsed;
+        elapsed.start();
+        if (!m_connection->resolveNames(names, &recipientTags, &results, &statuses)) {
+            m_messages.clear();
+            return false;
+        }
+        batches++;
+        MAPI_LOG(Recipients, debug()) << "resolved batch of names:" << batch.size() << "from messages:" << m_messages.size() <<
+            "in ms:" << elapsed.elapsed();
+        if (statuses) {
+            // Walk the returned results. Every request has a status, but
+            // only resolved items also have a row of results. Remember the
+            // outcome either way, so we don't ask again.
+            for (unsigned i = 0, unresolveds = 0; i < statuses->cValues; i++) {
+                const QString &key = batch.at(i);
+                MapiResolvedName resolved;
+
+                if (results && (MAPI_RESOLVED == statuses->aulPropTag[i])) {
+                    struct SRow &row = results->aRow[i - unresolveds];
+                    MapiMessage *message = waiting[key].first().first;
+                    MapiRecipient result(MapiRecipient::To);
+
+                    message->recipientPopulate("resolution", row, result);
+                    resolved.name = result.name;
+                    resolved.email = result.email;
+                    resolved.displayType = result.displayType();
+                    resolved.objectType = result.objectType();
+                    foreach (const MapiWaitingRecipient &to, waiting[key]) {
+                        MapiMessage::recipientResolved(resolved, to.first->m_recipients[to.second]);
+                        serverResolved.insert(to);
+                    }
+                } else {
+                    unresolveds++;
+                }
+                m_connection->resolvedNameInsert(key, resolved);
+            }
+        }
+        MAPIFreeBuffer(results);
+        MAPIFreeBuffer(statuses);
+    }
+
+    // Drop whatever the server resolved, again in one pass per message.
+    if (!serverResolved.isEmpty()) {
+        foreach (MapiMessage *message, waitingMessages) {
+            QList<int> needingResolution;
+
+            foreach (int i, message->m_needingResolution) {
+                if (!serverResolved.contains(MapiWaitingRecipient(message, i))) {
+                    needingResolution << i;
+                }
+            }
+            message->m_needingResolution = needingResolution;
+        }
+    }
+    if (messagesWaiting > batches) {
+        m_connection->resolvedNameSaved(messagesWaiting - batches);
+    }
+    if (m_galHits) {
+        MAPI_LOG(Recipients, debug()) << "resolved names from the local GAL:" << m_galHits;
+    }
+
+    foreach (MapiMessage *message, m_messages) {
+        m_connection->recipientStageExit(waitingMessages.contains(message) ? 
+                                         MapiConnector2::RecipientServer : MapiConnector2::RecipientLocal);
+        message->recipientsFinish();
+    }
+    m_messages.clear();
     return true;
 }
 
@@ -928,6 +2089,21 @@ const QList<MapiRecipient> &MapiMessage::recipients()
     return m_recipients;
 }
 
+void MapiMessage::setRecipientBatch(MapiRecipientBatch *batch)
+{
+    m_recipientBatch = batch;
+}
+
+bool MapiMessage::recipientsResolved()
+{
+    return true;
+}
+
+void MapiMessage::setBodyFormat(BodyFormat format)
+{
+    m_bodyFormat = format;
+}
+
 bool MapiMessage::streamRead(mapi_object_t *parent, int tag, QByteArray &bytes)
 {
     mapi_object_t stream;
@@ -936,26 +2112,34 @@ bool MapiMessage::streamRead(mapi_object_t *parent, int tag, QByteArray &bytes)
     uint16_t readSize;
 
     mapi_object_init(&stream);
-    if (MAPI_E_SUCCESS != OpenStream(parent, (MAPITAGS)tag, OpenStream_ReadOnly, &stream)) {
+    MapiTrace trace(MapiTracer::OpenStream, m_id.second);
+    if (MAPI_E_SUCCESS != trace(OpenStream(parent, (MAPITAGS)tag, OpenStream_ReadOnly, &stream))) {
         error() << "cannot open stream:" << tagName(tag) << mapiError();
         mapi_object_release(&stream);
         return false;
     }
-    if (MAPI_E_SUCCESS != GetStreamSize(&stream, &dataSize)) {
+    trace.restart(MapiTracer::GetStreamSize);
+    if (MAPI_E_SUCCESS != trace(GetStreamSize(&stream, &dataSize))) {
         error() << "cannot get stream size:" << tagName(tag) << mapiError();
         mapi_object_release(&stream);
         return false;
     }
     bytes.reserve(dataSize);
     offset = 0;
+
+    // Trace the stream as a whole, rather than each read.
+    trace.restart(MapiTracer::ReadStream);
     do {
-        if (MAPI_E_SUCCESS != ReadStream(&stream, (uchar *)bytes.data() + offset, 0x1000, &readSize)) {
+        MAPISTATUS status = ReadStream(&stream, (uchar *)bytes.data() + offset, 0x1000, &readSize);
+        if (MAPI_E_SUCCESS != status) {
+            trace(status, offset);
             error() << "cannot read stream:" << tagName(tag) << mapiError();
             mapi_object_release(&stream);
             return false;
         }
         offset += readSize;
     } while (readSize && (offset < dataSize));
+    trace(MAPI_E_SUCCESS, offset);
     bytes.resize(dataSize);
     mapi_object_release(&stream);
     return true;
@@ -1057,6 +2241,64 @@ bool MapiMessage::streamRead(mapi_object_t *parent, int tag, unsigned codepage,
     return true;
 }
 
+void MapiPhases::add(const char *name, qint64 elapsed, qint64 size, int number)
+{
+    Phase phase;
+
+    phase.name = name;
+    phase.number = number;
+    phase.elapsed = elapsed;
+    phase.size = size;
+    m_phases.append(phase);
+}
+
+QString MapiPhases::toString() const
+{
+    QStringList result;
+
+    foreach (const Phase &phase, m_phases) {
+        QString tmp = QString::fromAscii(phase.name);
+
+        if (phase.number >= 0) {
+            tmp += QString::fromAscii("#%1").arg(phase.number);
+        }
+        tmp += QString::fromAscii("=%1ms").arg(phase.elapsed / 1000.0, 0, 'f', 1);
+        if (phase.size >= 0) {
+            tmp += QString::fromAscii("(%1)").arg(phase.size);
+        }
+        result << tmp;
+    }
+    return result.join(QString::fromAscii(" "));
+}
+
+MapiPhase::MapiPhase(MapiPhases &phases, const char *name, int number) :
+    m_phases(phases),
+    m_name(name),
+    m_number(number),
+    m_size(-1),
+    m_finished(false)
+{
+    m_timer.start();
+}
+
+MapiPhase::~MapiPhase()
+{
+    finish();
+}
+
+void MapiPhase::setSize(qint64 size)
+{
+    m_size = size;
+}
+
+void MapiPhase::finish()
+{
+    if (!m_finished) {
+        m_phases.add(m_name, m_timer.nsecsElapsed() / 1000, m_size, m_number);
+        m_finished = true;
+    }
+}
+
 MapiObject::MapiObject(MapiConnector2 *connection, const char *tallocName, const MapiId &id) :
     TallocContext(tallocName),
     m_connection(connection),
@@ -1087,9 +2329,15 @@ const MapiId &MapiObject::id() const
     return m_id;
 }
 
+const MapiPhases &MapiObject::phases() const
+{
+    return m_phases;
+}
+
 bool MapiObject::propertiesPush()
 {
-    if (MAPI_E_SUCCESS != SetProps(&m_object, MAPI_PROPS_SKIP_NAMEDID_CHECK, m_properties, m_propertyCount)) {
+    MapiTrace trace(MapiTracer::SetProps, m_id.second);
+    if (MAPI_E_SUCCESS != trace(SetProps(&m_object, MAPI_PROPS_SKIP_NAMEDID_CHECK, m_properties, m_propertyCount))) {
         error() << "cannot push:" << m_propertyCount << "properties:" << mapiError();
         return false;
     }
@@ -1138,7 +2386,9 @@ bool MapiObject::propertiesPull(QVector<int> &tags, const bool tagsAppended, boo
                 error() << "Cannot find named properties" << mapiError();
                 return false;
             }
-            if (MAPI_E_SUCCESS != mapi_nameid_GetIDsFromNames(m_cachedNames, &m_object, m_cachedNamedTags)) {
+            MapiPhase phase(m_phases, "named");
+            MapiTrace trace(MapiTracer::GetIDsFromNames, m_id.second);
+            if (MAPI_E_SUCCESS != trace(mapi_nameid_GetIDsFromNames(m_cachedNames, &m_object, m_cachedNamedTags))) {
                 error() << "Cannot find named property ids" << mapiError();
                 return false;
             }
@@ -1154,13 +2404,15 @@ bool MapiObject::propertiesPull(QVector<int> &tags, const bool tagsAppended, boo
     }
 
     // Map the tags before the call, and unmap them afterwards.
+    MapiPhase phase(m_phases, "properties");
     if (usingNamedProperties) {
         if (MAPI_E_SUCCESS != mapi_nameid_map_SPropTagArray(m_cachedNames, &m_cachedTags, m_cachedNamedTags)) {
             error() << "Cannot map named properties" << mapiError();
             return false;
         }
     }
-    if (MAPI_E_SUCCESS != GetProps(&m_object, MAPI_UNICODE | MAPI_PROPS_SKIP_NAMEDID_CHECK, &m_cachedTags, &m_properties, &m_propertyCount)) {
+    MapiTrace trace(MapiTracer::GetProps, m_id.second);
+    if (MAPI_E_SUCCESS != trace(GetProps(&m_object, MAPI_UNICODE | MAPI_PROPS_SKIP_NAMEDID_CHECK, &m_cachedTags, &m_properties, &m_propertyCount))) {
         error() << "cannot pull properties:" << mapiError();
         if (usingNamedProperties) {
             if (MAPI_E_SUCCESS != mapi_nameid_unmap_SPropTagArray(m_cachedNames, &m_cachedTags)) {
@@ -1199,7 +2451,8 @@ bool MapiObject::propertiesPull()
 
     m_properties = 0;
     m_propertyCount = 0;
-    if (MAPI_E_SUCCESS != GetPropsAll(&m_object, MAPI_UNICODE, &mapiProperties)) {
+    MapiTrace trace(MapiTracer::GetPropsAll, m_id.second);
+    if (MAPI_E_SUCCESS != trace(GetPropsAll(&m_object, MAPI_UNICODE, &mapiProperties))) {
         error() << "cannot pull all properties:" << mapiError();
         return false;
     }
@@ -1304,17 +2557,14 @@ bool MapiObject::propertyWrite(int tag, QDateTime &data, bool idempotent)
         return false;
     }
 
-    // As per http://support.citrix.com/article/CTX109645.
-    time_t unixTime = data.toTime_t();
-    NTTIME ntTime = (unixTime + 11644473600L) * 10000000;
-    copy->dwHighDateTime = ntTime >> 32;
-    copy->dwLowDateTime = ntTime;
+    convertSysTime(data, *copy);
     return propertyWrite(tag, copy, idempotent);
 }
 
 bool MapiObject::subscribe()
 {
-    if (MAPI_E_SUCCESS != Subscribe(&m_object, &m_listenerId, -1, false, 0, this)) {
+    MapiTrace trace(MapiTracer::Subscribe, m_id.second);
+    if (MAPI_E_SUCCESS != trace(Subscribe(&m_object, &m_listenerId, -1, false, 0, this))) {
         error() << "cannot subscribe listener" << mapiError();
         return false;
     }
@@ -1355,7 +2605,8 @@ QString MapiObject::tagName(int tag) const
         /*
             * Try a lookup.
             */
-        if (MAPI_E_SUCCESS != GetNamesFromIDs(&m_object, (MAPITAGS)safeTag, &count, &names)) {
+        MapiTrace trace(MapiTracer::GetNamesFromIDs, m_id.second);
+        if (MAPI_E_SUCCESS != trace(GetNamesFromIDs(&m_object, (MAPITAGS)safeTag, &count, &names))) {
             return QString::fromLatin1("Pid0x%1").arg(tag, 0, 16);
         } else {
             QByteArray strs;
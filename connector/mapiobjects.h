@@ -24,9 +24,12 @@
 #include <QBitArray>
 #include <QDateTime>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QList>
 #include <QMap>
 #include <QString>
+#include <QVector>
 
 #include "mapiconnector2.h"
 
@@ -208,6 +211,65 @@ protected:
     ObjectType m_objectType;
 };
 
+/**
+ * How long each phase of fetching an object took, for diagnosing slow items.
+ */
+class MapiPhases
+{
+public:
+    /**
+     * Note a phase.
+     *
+     * @param elapsed   How long it took, in microseconds.
+     * @param size      How big the result was, or -1 if that is not known.
+     * @param number    Distinguishes repeated phases, or -1.
+     */
+    void add(const char *name, qint64 elapsed, qint64 size = -1, int number = -1);
+
+    /**
+     * The phases, in the order they ended, with their times in ms.
+     */
+    QString toString() const;
+
+private:
+    struct Phase
+    {
+        const char *name;
+        int number;
+        qint64 elapsed;
+        qint64 size;
+    };
+
+    QVector<Phase> m_phases;
+};
+
+/**
+ * Times a phase from construction until @ref finish() or destruction:
+ *
+ *      MapiPhase phase(m_phases, "open");
+ */
+class MapiPhase
+{
+public:
+    MapiPhase(MapiPhases &phases, const char *name, int number = -1);
+    ~MapiPhase();
+
+    void setSize(qint64 size);
+
+    /**
+     * End the phase early.
+     */
+    void finish();
+
+private:
+    MapiPhases &m_phases;
+    const char *m_name;
+    int m_number;
+    qint64 m_size;
+    QElapsedTimer m_timer;
+    bool m_finished;
+};
+
 /**
  * A class which wraps a MAPI object such that objects of this type 
  * automatically free the used memory on destruction.
@@ -292,12 +354,18 @@ public:
      */
     bool subscribe();
 
+    /**
+     * How long fetching the object took, phase by phase.
+     */
+    const MapiPhases &phases() const;
+
 protected:
     MapiConnector2 *m_connection;
     const MapiId m_id;
     struct SPropValue *m_properties;
     uint32_t m_propertyCount;
     mutable mapi_object_t m_object;
+    MapiPhases m_phases;
 
     /**
      * Fetch a set of properties.
@@ -360,10 +428,157 @@ public:
      */
     QDateTime modified() const;
 
+    /**
+     * A folder-independent key for the full item, which survives moves.
+     */
+    QByteArray searchKey() const;
+
+    /**
+     * The envelope of the full item. These are only filled in when asked
+     * for by @ref MapiFolder::childrenPull().
+     */
+    QString subject() const;
+    QString sender() const;
+    QString senderEmail() const;
+    QDateTime delivered() const;
+    unsigned size() const;
+    unsigned flags() const;
+    QByteArray conversationIndex() const;
+    QString messageId() const;
+
 private:
+    // The envelope is filled in from a contents snapshot.
+    friend class MapiContents;
+
     const MapiId m_id;
     const QString m_name;
     const QDateTime m_modified;
+    QByteArray m_searchKey;
+    QString m_subject;
+    QString m_sender;
+    QString m_senderEmail;
+    QDateTime m_delivered;
+    unsigned m_size;
+    unsigned m_flags;
+    QByteArray m_conversationIndex;
+    QString m_messageId;
+};
+
+/**
+ * A compact snapshot of the contents table of a folder. Rather than one 
+ * @ref MapiItem per row, the columns are held in contiguous arrays, with
+ * binary values packed into a single buffer and the strings of the envelope
+ * interned, since senders and conversation topics repeat a lot. A 
+ * @ref MapiItem can be made for any rows which need one.
+ *
+ * @ref MapiFolder::contentsPull
+ */
+class MapiContents
+{
+public:
+    MapiContents();
+
+    void clear();
+
+    /**
+     * How many rows are there?
+     */
+    int size() const;
+
+    /**
+     * Was the envelope fetched?
+     */
+    bool hasEnvelope() const;
+
+    /**
+     * Are the rows in ascending order of message id?
+     */
+    bool isSorted() const;
+
+    /**
+     * The rows in ascending order of message id. If the server returned 
+     * them that way, no sort is needed.
+     */
+    QVector<int> order() const;
+
+    /**
+     * The message id of a row.
+     */
+    mapi_id_t mid(int row) const;
+
+    /**
+     * The last-modified date time of a row.
+     */
+    QDateTime modified(int row) const;
+
+    /**
+     * The PidTagChangeKey of a row.
+     */
+    QByteArray changeKey(int row) const;
+
+    /**
+     * The folder-independent key of a row, which survives moves.
+     */
+    QByteArray searchKey(int row) const;
+
+    /**
+     * The PidTagInternetMessageId of a row, if the envelope was fetched.
+     */
+    QString messageId(int row) const;
+
+    /**
+     * Make a @ref MapiItem for a row, including its envelope if that was 
+     * fetched. The caller is responsible for freeing it.
+     *
+     * @param parent    The id of the folder.
+     */
+    MapiItem *item(const MapiId &parent, int row) const;
+
+    /**
+     * Roughly how much memory is in use, in bytes.
+     */
+    qint64 memoryUsage() const;
+
+    /**
+     * Append a row from a table with the columns set by 
+     * @ref MapiFolder::contentsPull.
+     */
+    void append(const SRow &row);
+
+private:
+    friend class MapiFolder;
+
+    quint32 blobAppend(const void *data, unsigned length);
+    QByteArray blobAt(quint32 offset) const;
+    quint32 stringIntern(const QString &string);
+
+    bool m_envelope;
+    bool m_named;
+    bool m_sorted;
+    QVector<mapi_id_t> m_mids;
+    QVector<quint64> m_modified;
+    QVector<quint32> m_changeKeys;
+    QVector<quint32> m_searchKeys;
+
+    /**
+     * The name and envelope.
+     */
+    QVector<quint32> m_names;
+    QVector<quint32> m_subjects;
+    QVector<quint32> m_senders;
+    QVector<quint32> m_senderEmails;
+    QVector<quint64> m_delivered;
+    QVector<quint32> m_sizes;
+    QVector<quint32> m_flags;
+    QVector<quint32> m_conversationIndexes;
+    QVector<quint32> m_messageIds;
+
+    /**
+     * Binary values, each preceded by its length, and interned strings.
+     */
+    QByteArray m_blobs;
+    QVector<QString> m_strings;
+    QHash<QString, quint32> m_stringIds;
 };
 
 /**
@@ -393,14 +608,100 @@ public:
      */
     bool childrenPull(QList<MapiFolder *> &children, const QString &filter = QString());
 
+    /**
+     * Fetch all the folders below this one, using a single deep hierarchy
+     * table rather than opening each folder in turn. The parent of each 
+     * descendant is given by the first half of its @ref id(), and parents
+     * come before their children.
+     * 
+     * @param descendants   The descendants will be added to this list. The 
+     *                      caller is responsible for freeing entries on 
+     *                      the list.
+     * @param filter        Only return folders whose PR_CONTAINER_CLASS, 
+     *                      and that of all their ancestors, starts with 
+     *                      this value, or the empty string to get all of 
+     *                      them.
+     */
+    bool descendantsPull(QList<MapiFolder *> &descendants, const QString &filter = QString());
+
+    /**
+     * Fetch the PidTagHierarchyChangeNumber of this folder, which changes
+     * whenever a folder is added to or removed from it. This is a single
+     * property read, but changes further down the tree do not show up in it.
+     *
+     * @param state     The marker, only to be compared for equality.
+     */
+    bool hierarchyStatePull(QByteArray &state);
+
+    /**
+     * Fetch a summary of the folder's contents, which changes whenever an
+     * item is added, modified or deleted. This is made from the
+     * PidTagContentCount, PidTagContentUnreadCount, PidTagLocalCommitTimeMax
+     * and PidTagDeletedCountTotal, together with the dates of any window
+     * set using @ref setWindow(), so that the summary also changes when 
+     * the window moves on.
+     *
+     * @param state     The summary, only to be compared for equality.
+     * @param unread    If given, set to the number of unread items.
+     */
+    bool statePull(QByteArray &state, unsigned *unread = 0);
+
     /**
      * Fetch children which are not folders.
      * 
      * @param children  The children will be added to this list. The 
      *                  caller is responsible for freeing entries on 
      *                  the list.
+     * @param envelope  If true, also fetch the envelope of each child.
+     */
+    bool childrenPull(QList<MapiItem *> &children, bool envelope = false);
+
+    /**
+     * Fetch a snapshot of the children which are not folders. This is much
+     * cheaper than the equivalent @ref childrenPull() for large folders.
+     * 
+     * @param contents  The snapshot to fill in. Any previous contents are
+     *                  discarded.
+     * @param envelope  If true, also fetch the envelope of each child.
+     * @param named     If true, also fetch the conversation topic of each
+     *                  child as its name. This is implied by @p envelope.
+     */
+    bool contentsPull(MapiContents &contents, bool envelope = false, bool named = false);
+
+    /**
+     * Start fetching a snapshot of the children which are not folders a
+     * batch at a time, using @ref contentsNext().
+     *
+     * @param envelope  If true, also fetch the envelope of each child.
+     * @param named     If true, also fetch the conversation topic of each
+     *                  child as its name. This is implied by @p envelope.
+     * @param sorted    If true on entry, ask the server to return the 
+     *                  children in ascending order of message id. On 
+     *                  return, true only if the server agreed.
+     * @param total     Set to the number of children.
+     */
+    bool contentsOpen(bool envelope, bool named, bool &sorted, unsigned &total);
+
+    /**
+     * Append the next batch of children to a snapshot.
+     *
+     * @param count     The most children to fetch.
+     * @return False when there are no more.
+     */
+    bool contentsNext(MapiContents &contents, unsigned count);
+
+    /**
+     * Restrict the children returned by @ref childrenPull() to a window of
+     * time. A child is in the window if its @p endTag is on or after 
+     * @p from, and its @p startTag is on or before @p to. Either bound may
+     * be invalid to leave that side of the window open. Named properties
+     * may be used.
+     *
+     * @param exemptTag If non-zero, a boolean property which, if true, puts
+     *                  the child in the window anyway. This is useful for
+     *                  recurring appointments.
      */
-    bool childrenPull(QList<MapiItem *> &children);
+    void setWindow(int startTag, int endTag, const QDateTime &from, const QDateTime &to, int exemptTag = 0);
 
 protected:
     mapi_object_t m_contents;
@@ -408,23 +709,68 @@ protected:
 private:
     virtual QDebug debug() const;
     virtual QDebug error() const;
+
+    /**
+     * Apply any window to the contents table.
+     */
+    bool windowApply();
+
+    int m_windowStartTag;
+    int m_windowEndTag;
+    int m_windowExemptTag;
+    QDateTime m_windowFrom;
+    QDateTime m_windowTo;
+    bool m_contentsEnvelope;
+    bool m_contentsNamed;
 };
 
+class MapiRecipientBatch;
+
 /**
  * A Message, with recipients.
  */
 class MapiMessage : public MapiObject
 {
 public:
+    /**
+     * Which body formats to fetch. Exchange keeps a message body in one
+     * native format (see PidTagNativeBody), and synthesises the others
+     * whenever they are asked for, which costs both server time and bytes
+     * on the wire.
+     */
+    typedef enum {
+        BodyNative = 0,         // Only the native format.
+        BodyText = 1,           // Only PidTagBody.
+        BodyTextAndHtml = 2     // Both PidTagBody and PidTagHtml.
+    } BodyFormat;
+
     MapiMessage(MapiConnector2 *connection, const char *tallocName, const MapiId &id);
 
     virtual bool open();
 
+    /**
+     * Select the body formats fetched by @ref bodyPull(). Must be called
+     * before the properties are pulled.
+     */
+    void setBodyFormat(BodyFormat format);
+
     /**
      * Fetch all properties.
      */
     virtual bool propertiesPull();
 
+    /**
+     * Defer the resolution of recipients to the given batch. Must be called
+     * before the properties are pulled. Subclasses must then hold off on
+     * using the recipients until @ref recipientsResolved() is called.
+     */
+    void setRecipientBatch(MapiRecipientBatch *batch);
+
+    /**
+     * Called once batched recipients are resolved. The default does nothing.
+     */
+    virtual bool recipientsResolved();
+
     /**
      * Lists of To, CC and BCC, as well as the sender (the last should have 
      * 0 or 1 items only, but in theory may have more).
@@ -444,6 +790,8 @@ public:
 
 protected:
     QList<MapiRecipient> m_recipients;
+    BodyFormat m_bodyFormat;
+    MapiRecipientBatch *m_recipientBatch;
 
     /**
      * Pull a given set of properties, plus any we need internally.
@@ -472,19 +820,100 @@ protected:
 
     static const unsigned CODEPAGE_UTF16;
 
+    /**
+     * Fetch the body in the formats selected by @ref setBodyFormat(). The
+     * PidTagNativeBody and PidTagRtfInSync properties must already have 
+     * been pulled. Oversize bodies are streamed.
+     *
+     * @param codepage  The codepage to use for PidTagHtml.
+     * @param text      Set to PidTagBody, if fetched.
+     * @param html      Set to PidTagHtml, if fetched.
+     */
+    bool bodyPull(unsigned codepage, QString &text, QString &html);
+
 private:
     virtual QDebug debug() const;
     virtual QDebug error() const;
 
+    /**
+     * Fetch a single body property, streaming it if needed.
+     */
+    bool bodyPull(int tag, unsigned codepage, QString &body);
+
     /**
      * Fetch all recipients.
      */
     bool recipientsPull();
 
+    /**
+     * Add recipients from the PidTagDisplayTo, Cc and Bcc strings.
+     */
+    bool displayRecipientsPull();
+
     /**
      * Flesh out a recipient.
      */
     void recipientPopulate(const char *phase, SRow &recipient, MapiRecipient &result);
+
+    /**
+     * Indexes into @ref m_recipients by case-folded name and email, used
+     * by @ref addUniqueRecipient(). Stale keys are left behind when an entry
+     * changes.
+     */
+    QHash<QString, QList<int> > m_recipientNames;
+    QHash<QString, QList<int> > m_recipientEmails;
+
+    /**
+     * Can the candidate be merged with the given entry?
+     */
+    bool recipientMatches(const MapiRecipient &candidate, int i) const;
+
+    /**
+     * Indices into @ref m_recipients of those with a poor email.
+     */
+    QList<int> m_needingResolution;
+
+    /**
+     * Tidy up the recipients once resolution is done.
+     */
+    void recipientsFinish();
+
+    /**
+     * Update a recipient with a better name and email.
+     */
+    static void recipientResolved(const MapiResolvedName &resolved, MapiRecipient &to);
+
+    friend class MapiRecipientBatch;
+};
+
+/**
+ * Resolves the recipients of a number of messages together. Names which
+ * recur are asked for once, and the rest go to the server in a few large
+ * ResolveNames calls rather than one per message. The connection's cache
+ * of resolved names is consulted first, then the local copy of the GAL.
+ */
+class MapiRecipientBatch : protected TallocContext
+{
+public:
+    MapiRecipientBatch(MapiConnector2 *connection);
+
+    /**
+     * Add a message whose recipients need resolution.
+     */
+    void add(MapiMessage *message);
+
+    /**
+     * Resolve the recipients of all the messages added so far.
+     */
+    bool resolve();
+
+private:
+    MapiConnector2 *m_connection;
+    QList<MapiMessage *> m_messages;
+    unsigned m_galHits;
+
+    virtual QDebug debug() const;
+    virtual QDebug error() const;
 };
 
 #endif // MAPIOBJECTS_H
@@ -19,6 +19,9 @@
 
 #include "mapiresource.h"
 
+#include <QDataStream>
+#include <QFile>
+#include <QtAlgorithms>
 #include <QtDBus/QDBusConnection>
 
 #include <KConfigGroup>
@@ -27,12 +30,229 @@
 #include <KStandardDirs>
 
 #include <Akonadi/AgentManager>
+#include <Akonadi/AttributeFactory>
+#include <Akonadi/CollectionModifyJob>
+#include <Akonadi/CollectionStatisticsJob>
+#include <Akonadi/CollectionStatistics>
+#include <Akonadi/ItemDeleteJob>
 #include <Akonadi/ItemFetchJob>
 #include <Akonadi/ItemFetchScope>
+#include <Akonadi/ItemModifyJob>
+#include <Akonadi/ItemMoveJob>
 #include <akonadi/kmime/messageparts.h>
 #include <kmime/kmime_message.h>
 
 #include "mapiconnector2.h"
+#include "mapidumper.h"
+#include "mapilogging.h"
+#include "mapischeduler.h"
+#include "mapistatistics.h"
+#include "mapisyncindex.h"
+#include "mapitracer.h"
+
+/**
+ * How long to wait (in ms) between prefetches.
+ */
+#ifndef PREFETCH_INTERVAL
+#define PREFETCH_INTERVAL 1000
+#endif
+
+/**
+ * How long (in seconds) the user must have been idle before we prefetch.
+ */
+#ifndef PREFETCH_IDLE
+#define PREFETCH_IDLE 30
+#endif
+
+/**
+ * The most items to prefetch in one go. Their recipients are resolved 
+ * together.
+ */
+#ifndef PREFETCH_BATCH
+#define PREFETCH_BATCH 25
+#endif
+
+/**
+ * The most items to keep queued for prefetching. Beyond this, the least
+ * important are dropped, and fetched on demand if ever needed.
+ */
+#ifndef PREFETCH_QUEUE_SIZE
+#define PREFETCH_QUEUE_SIZE 10000
+#endif
+
+/**
+ * The maximum number of bytes of prefetched items to hold.
+ */
+#ifndef PREFETCH_CACHE_SIZE
+#define PREFETCH_CACHE_SIZE (32 * 1024 * 1024)
+#endif
+
+/**
+ * Keep the names resolved by the server across restarts.
+ */
+#ifndef ENABLE_RESOLVE_CACHE_PERSIST
+#define ENABLE_RESOLVE_CACHE_PERSIST 1
+#endif
+
+/**
+ * Keep the folder hierarchy across restarts, and only refetch it from the
+ * server when the hierarchy change number of the root moves.
+ */
+#ifndef ENABLE_FOLDER_TREE_CACHE
+#define ENABLE_FOLDER_TREE_CACHE 1
+#endif
+
+/**
+ * Refetch the whole hierarchy anyway once it is this old (in seconds). The
+ * hierarchy state only reflects the folders directly under the root, so
+ * this is how changes deeper down are picked up.
+ */
+#ifndef FOLDER_TREE_TTL
+#define FOLDER_TREE_TTL (60 * 60)
+#endif
+
+#define FOLDER_TREE_VERSION 2
+
+/**
+ * How long (in ms) an item may take to fetch before it is logged as slow, or
+ * 0 to log nothing.
+ */
+#ifndef SLOW_ITEM_THRESHOLD
+#define SLOW_ITEM_THRESHOLD 10000
+#endif
+
+/**
+ * How big the slow item log may grow before it is rotated.
+ */
+#ifndef SLOW_ITEM_LOG_SIZE
+#define SLOW_ITEM_LOG_SIZE (256 * 1024)
+#endif
+
+#define SEARCH_KEY "MapiSearchKey"
+
+/**
+ * Remote revisions which hold a PidTagChangeKey, rather than a counter.
+ */
+static const QString CHANGE_KEY_PREFIX = QString::fromAscii("ck:");
+
+/**
+ * An attribute used to remember a folder-independent key for an item, so
+ * that moves between collections can be recognised.
+ */
+class SearchKeyAttribute : public Akonadi::Attribute
+{
+public:
+    SearchKeyAttribute(const QByteArray &key = QByteArray()) :
+        m_key(key)
+    {
+    }
+
+    virtual QByteArray type() const
+    {
+        return SEARCH_KEY;
+    }
+
+    virtual Attribute *clone() const
+    {
+        return new SearchKeyAttribute(m_key);
+    }
+
+    virtual QByteArray serialized() const
+    {
+        return m_key;
+    }
+
+    virtual void deserialize(const QByteArray &data)
+    {
+        m_key = data;
+    }
+
+    QByteArray key() const
+    {
+        return m_key;
+    }
+
+private:
+    QByteArray m_key;
+};
+
+#define FOLDER_STATE "MapiFolderState"
+
+/**
+ * An attribute used to remember the state of a folder when its items were
+ * last fetched, so that the fetch can be skipped if nothing has changed.
+ */
+class FolderStateAttribute : public Akonadi::Attribute
+{
+public:
+    FolderStateAttribute(const QByteArray &state = QByteArray()) :
+        m_state(state)
+    {
+    }
+
+    virtual QByteArray type() const
+    {
+        return FOLDER_STATE;
+    }
+
+    virtual Attribute *clone() const
+    {
+        return new FolderStateAttribute(m_state);
+    }
+
+    virtual QByteArray serialized() const
+    {
+        return m_state;
+    }
+
+    virtual void deserialize(const QByteArray &data)
+    {
+        m_state = data;
+    }
+
+    QByteArray state() const
+    {
+        return m_state;
+    }
+
+private:
+    QByteArray m_state;
+};
+
+/**
+ * Mark the resource busy for the lifetime of this object.
+ */
+class BusyMarker
+{
+public:
+    BusyMarker(bool &busy) :
+        m_busy(busy)
+    {
+        m_busy = true;
+    }
+
+    ~BusyMarker()
+    {
+        m_busy = false;
+    }
+
+private:
+    bool &m_busy;
+};
+
+bool MapiPrefetchCandidate::operator<(const MapiPrefetchCandidate &other) const
+{
+    QDate day = delivered.date();
+    QDate otherDay = other.delivered.date();
+
+    if (day != otherDay) {
+        return day > otherDay;
+    }
+    if (unread != other.unread) {
+        return unread;
+    }
+    return size < other.size;
+}
 
 using namespace Akonadi;
 
@@ -42,23 +262,210 @@ MapiResource::MapiResource(const QString &id, const QString &desktopName, const
     m_mapiMessageType(QString::fromAscii(messageType)),
     m_itemMimeType(itemMimeType),
     m_connection(new MapiConnector2()),
-    m_connected(false)
+    m_connected(false),
+    m_envelopeSync(false),
+    m_statistics(new MapiStatistics(this)),
+    m_busy(false),
+    m_prefetchSorted(true),
+    m_prefetched(PREFETCH_CACHE_SIZE),
+    m_prefetchTokens(0),
+    m_prefetchHits(0),
+    m_prefetchMisses(0),
+    m_prefetchItems(0),
+    m_prefetchBytes(0),
+    m_movedItems(0),
+    m_movedBytes(0),
+    m_revisionSkips(0),
+    m_syncAdded(0),
+    m_syncChanged(0),
+    m_syncDeleted(0),
+    m_syncMoved(0),
+    m_scheduler(new MapiScheduler(this)),
+    m_folderTreeCheckPending(false),
+    m_folderTreeHits(0),
+    m_folderStateSkips(0),
+    m_folderStateSyncs(0),
+    m_dumper(new MapiDumper(m_connection, this))
 {
     if (name() == identifier()) {
         setName(desktopName);
     }
 
+    m_prefetchTimer.setSingleShot(true);
+    m_prefetchTimer.setInterval(PREFETCH_INTERVAL);
+    connect(&m_prefetchTimer, SIGNAL(timeout()), SLOT(prefetchNext()));
+    m_prefetchRefilled.start();
+    AttributeFactory::registerAttribute<SearchKeyAttribute>();
+    AttributeFactory::registerAttribute<FolderStateAttribute>();
+    QDBusConnection::sessionBus().registerObject(QLatin1String("/Scheduler"),
+                             m_scheduler,
+                             QDBusConnection::ExportScriptableSlots);
+    QDBusConnection::sessionBus().registerObject(QLatin1String("/Statistics"),
+                             m_statistics,
+                             QDBusConnection::ExportScriptableSlots);
+    QDBusConnection::sessionBus().registerObject(QLatin1String("/Trace"),
+                             new MapiTracer(this),
+                             QDBusConnection::ExportScriptableSlots);
+    QDBusConnection::sessionBus().registerObject(QLatin1String("/Dump"),
+                             m_dumper,
+                             QDBusConnection::ExportScriptableSlots);
+    QDBusConnection::sessionBus().registerObject(QLatin1String("/Logging"),
+                             new MapiLogging(this),
+                             QDBusConnection::ExportScriptableSlots);
+#if (ENABLE_RESOLVE_CACHE_PERSIST)
+    m_connection->resolvedNamesLoad(resolvedNamesFile());
+#endif
+#if (ENABLE_FOLDER_TREE_CACHE)
+    folderTreesLoad();
+#endif
+
     setHierarchicalRemoteIdentifiersEnabled(true);
     //setCollectionStreamingEnabled(true);
-    //setItemStreamingEnabled(true);
+    setItemStreamingEnabled(true);
 }
 
 MapiResource::~MapiResource()
 {
+    syncIndexFlush();
     logoff();
+#if (ENABLE_RESOLVE_CACHE_PERSIST)
+    m_connection->resolvedNamesSave(resolvedNamesFile());
+#endif
+    delete m_dumper;
     delete m_connection;
 }
 
+QString MapiResource::resolvedNamesFile() const
+{
+    return KStandardDirs::locateLocal("data", QString::fromAscii("akonadi_exchange/%1.names").arg(identifier()));
+}
+
+QString MapiResource::folderTreesFile() const
+{
+    return KStandardDirs::locateLocal("data", QString::fromAscii("akonadi_exchange/%1.folders").arg(identifier()));
+}
+
+QString MapiResource::slowItemsFile() const
+{
+    return KStandardDirs::locateLocal("data", QString::fromAscii("akonadi_exchange/%1.slow").arg(identifier()));
+}
+
+unsigned MapiResource::slowItemThreshold()
+{
+    return SLOW_ITEM_THRESHOLD;
+}
+
+void MapiResource::slowItemCheck(const Akonadi::Item &item, const MapiObject &message, const QElapsedTimer &timer, quint64 bytes)
+{
+    unsigned threshold = slowItemThreshold();
+    qint64 elapsed = timer.elapsed();
+
+    if (!threshold || (elapsed < threshold)) {
+        return;
+    }
+
+    // Keep the log to a sensible size, with one old generation.
+    QString fileName = slowItemsFile();
+    QFile file(fileName);
+    if (file.size() > SLOW_ITEM_LOG_SIZE) {
+        QFile::remove(fileName + QString::fromAscii(".1"));
+        QFile::rename(fileName, fileName + QString::fromAscii(".1"));
+    }
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        kError() << "cannot write slow item log:" << fileName << file.errorString();
+        return;
+    }
+
+    // The remote id is enough to find the item again with mapibrowser.
+    QString line = QString::fromAscii("%1 item=%2 collection=%3 remoteId=%4 total=%5ms streamed=%6 %7\n").
+        arg(QDateTime::currentDateTime().toString(Qt::ISODate)).arg(item.id()).arg(item.parentCollection().id()).
+        arg(message.id().toString()).arg(elapsed).arg(MapiTracer::bytes() - bytes).arg(message.phases().toString());
+    file.write(line.toUtf8());
+    kDebug() << "slow item:" << line;
+}
+
+bool MapiResource::folderTreesLoad()
+{
+    QFile file(folderTreesFile());
+    if (!file.open(QIODevice::ReadOnly)) {
+        // Nothing saved yet.
+        return false;
+    }
+
+    QDataStream stream(&file);
+    qint32 version;
+    stream >> version;
+    if (version != FOLDER_TREE_VERSION) {
+        kError() << "ignoring folder tree cache version" << version;
+        return false;
+    }
+    while (!stream.atEnd()) {
+        qint32 rootFolder;
+        MapiFolderTree tree;
+
+        stream >> rootFolder >> tree.state >> tree.fetched >> tree.folders;
+        if (stream.status() != QDataStream::Ok) {
+            kError() << "cannot read folder tree cache" << file.fileName();
+            m_folderTrees.clear();
+            return false;
+        }
+        m_folderTrees.insert(rootFolder, tree);
+    }
+    kDebug() << "loaded folder trees:" << m_folderTrees.size();
+    return true;
+}
+
+bool MapiResource::folderTreesSave()
+{
+    QFile file(folderTreesFile());
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        kError() << "cannot save folder tree cache" << file.fileName();
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream << (qint32)FOLDER_TREE_VERSION;
+    for (QHash<int, MapiFolderTree>::const_iterator i = m_folderTrees.constBegin(); i != m_folderTrees.constEnd(); ++i) {
+        stream << (qint32)i.key() << i.value().state << i.value().fetched << i.value().folders;
+    }
+    return true;
+}
+
+void MapiResource::folderTreeCollections(const MapiFolderTree &tree, Akonadi::Collection::List &collections)
+{
+    QStringList contentTypes;
+    contentTypes << m_itemMimeType << Akonadi::Collection::mimeType();
+
+    // Parents come before their children, so each parent is already known
+    // by the time we need it.
+    QHash<QString, Collection> parents;
+    foreach (const QStringList &folder, tree.folders) {
+        Collection collection;
+
+        collection.setRemoteId(folder.at(0));
+        collection.setName(folder.at(2));
+        if (folder.at(1).isEmpty()) {
+            collection.setParentCollection(Collection::root());
+        } else {
+            collection.setParentCollection(parents.value(folder.at(1)));
+        }
+        collection.setContentMimeTypes(contentTypes);
+        collections.append(collection);
+        parents.insert(collection.remoteId(), collection);
+    }
+}
+
+void MapiResource::folderTreeCheck()
+{
+    m_folderTreeCheckPending = false;
+    synchronizeCollectionTree();
+}
+
+MapiMessage::BodyFormat MapiResource::bodyFormat()
+{
+    return MapiMessage::BodyNative;
+}
+
 void MapiResource::doSetOnline(bool online)
 {
     if (online) {
@@ -68,6 +475,12 @@ void MapiResource::doSetOnline(bool online)
     }
 }
 
+void MapiResource::envelopePayload(const MapiItem &data, Akonadi::Item &item)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(item);
+}
+
 void MapiResource::error(const QString &message)
 {
     kError() << message;
@@ -102,6 +515,29 @@ void MapiResource::error(const MapiMessage &msg, const QString &body)
 void MapiResource::fetchCollections(MapiDefaultFolder rootFolder, Akonadi::Collection::List &collections)
 {
     kDebug() << "fetch all collections";
+    BusyMarker busy(m_busy);
+
+    // Anything held back by a full sync which never finished has had its
+    // chance to reappear.
+    vanishedExpire();
+
+#if (ENABLE_FOLDER_TREE_CACHE)
+    // At startup, serve the hierarchy we had last time without waiting for
+    // the server, and check it afterwards.
+    if (!m_folderTreesServed.contains(rootFolder)) {
+        m_folderTreesServed.insert(rootFolder);
+        if (m_folderTrees.contains(rootFolder)) {
+            folderTreeCollections(m_folderTrees.value(rootFolder), collections);
+            schedulerRoundStart(collections);
+            if (!m_folderTreeCheckPending) {
+                m_folderTreeCheckPending = true;
+                QTimer::singleShot(0, this, SLOT(folderTreeCheck()));
+            }
+            emit status(Running, i18n("Fetched collections: %1", collections.size()));
+            return;
+        }
+    }
+#endif
 
     if (!logon()) {
         // Come back later.
@@ -116,6 +552,37 @@ void MapiResource::fetchCollections(MapiDefaultFolder rootFolder, Akonadi::Colle
         error(i18n("Cannot find folder root: %1, %2", rootId.toString(), mapiError()));
         return;
     }
+    MapiFolder rootFolderObject(m_connection, __FUNCTION__, rootId);
+    if (!rootFolderObject.open()) {
+        error(rootFolderObject, i18n("Cannot open folder list: %1", mapiError()));
+        return;
+    }
+    if (!m_scheduler->hasWeights()) {
+        schedulerWeights();
+    }
+
+    // If the hierarchy has not changed (as far as the root can tell us, see
+    // FOLDER_TREE_TTL), there is no need to fetch it.
+    QByteArray state;
+    bool changeKnown = rootFolderObject.hierarchyStatePull(state);
+#if (ENABLE_FOLDER_TREE_CACHE)
+    if (changeKnown && m_folderTrees.contains(rootFolder)) {
+        const MapiFolderTree &tree = m_folderTrees[rootFolder];
+
+        if ((tree.state == state) &&
+            (tree.fetched.secsTo(QDateTime::currentDateTime()) < FOLDER_TREE_TTL)) {
+            folderTreeCollections(tree, collections);
+            schedulerRoundStart(collections);
+            m_folderTreeHits++;
+            m_statistics->cache("folderTree", true);
+            kDebug() << "folder hierarchy unchanged:" << state.toHex() << "hits:" << m_folderTreeHits;
+            emit status(Running, i18n("Fetched collections: %1", collections.size()));
+            return;
+        }
+    }
+#endif
+
+    m_statistics->cache("folderTree", false);
     Collection root;
     QStringList contentTypes;
     contentTypes << m_itemMimeType << Akonadi::Collection::mimeType();
@@ -124,153 +591,595 @@ void MapiResource::fetchCollections(MapiDefaultFolder rootFolder, Akonadi::Colle
     root.setParentCollection(Collection::root());
     root.setContentMimeTypes(contentTypes);
     collections.append(root);
-    fetchCollections(root.name(), rootId, root, collections);
-    emit status(Running, i18n("Fetched collections: %1", collections.size()));
-}
-
-void MapiResource::fetchCollections(const QString &path, const MapiId &parentId, const Collection &parent, Akonadi::Collection::List &collections)
-{
-    kDebug() << "fetch collections in:" << path << "under parent folder:" << parentId.toString();
-
-    MapiFolder parentFolder(m_connection, __FUNCTION__, parentId);
-    if (!parentFolder.open()) {
-        error(parentFolder, i18n("Cannot open folder list: %1", mapiError()));
-        return;
-    }
 
+    // Fetch the whole tree under the root in one go, and rebuild it here.
     QList<MapiFolder *> list;
-    emit status(Running, i18n("Fetching folder list: %1", path));
-    if (!parentFolder.childrenPull(list, m_mapiFolderFilter)) {
-        error(parentFolder, i18n("Cannot fetch folder list: %1", mapiError()));
+    emit status(Running, i18n("Fetching folder list: %1", root.name()));
+    if (!rootFolderObject.descendantsPull(list, m_mapiFolderFilter)) {
+        error(rootFolderObject, i18n("Cannot fetch folder list: %1", mapiError()));
         return;
     }
 
-    QChar separator = QChar::fromAscii('/');
-    QStringList contentTypes;
-
-    contentTypes << m_itemMimeType << Akonadi::Collection::mimeType();
+    // Parents come before their children, so each parent is already known
+    // by the time we need it.
+    MapiFolderTree tree;
+    QHash<mapi_id_t, Collection> parents;
+    tree.state = state;
+    tree.fetched = QDateTime::currentDateTime();
+    tree.folders << (QStringList() << root.remoteId() << QString() << root.name());
+    parents.insert(rootId.second, root);
     foreach (MapiFolder *data, list) {
         Collection child;
+        Collection parent = parents.value(data->id().first);
 
         child.setName(data->name);
         child.setRemoteId(data->id().toString());
         child.setParentCollection(parent);
         child.setContentMimeTypes(contentTypes);
         collections.append(child);
-
-        // Recurse down...
-        QString currentPath = path + separator + child.name();
-        fetchCollections(currentPath, data->id(), child, collections);
+        parents.insert(data->id().second, child);
+        tree.folders << (QStringList() << child.remoteId() << parent.remoteId() << child.name());
         delete data;
     }
-#if 0
-    parentFolder.subscribe();
+#if (ENABLE_FOLDER_TREE_CACHE)
+    if (changeKnown) {
+        m_folderTrees.insert(rootFolder, tree);
+    } else {
+        m_folderTrees.remove(rootFolder);
+    }
+    folderTreesSave();
 #endif
+    schedulerRoundStart(collections);
+    emit status(Running, i18n("Fetched collections: %1", collections.size()));
 }
 
-void MapiResource::fetchItems(const Akonadi::Collection &collection, Item::List &items, Item::List &deletedItems)
+bool MapiResource::fetchItems(const Akonadi::Collection &collection, Item::List &items, Item::List &deletedItems)
 {
-    kDebug() << "fetch items from collection:" << collection.name();
+    MAPI_LOG(Sync, kDebug()) << "fetch items from collection:" << collection.name();
+    BusyMarker busy(m_busy);
+    MapiLatency latency(m_statistics, MapiStatistics::RetrieveItems, collection);
 
     if (!logon()) {
         // Come back later.
         deferTask();
-        return;
+        return false;
     }
 
-    // Find all item that are already in this collection in Akonadi.
-    QSet<MapiId> knownRemoteIds;
-    QMap<MapiId, Item> knownItems;
-    {
-        emit status(Running, i18n("Fetching %1 from cache", collection.name()));
-        ItemFetchJob *fetch = new ItemFetchJob( collection );
-
-        Akonadi::ItemFetchScope scope;
-        // we are only interested in the items from the cache
-        scope.setCacheOnly(true);
-        // we don't need the payload (we are mainly interested in the remoteID and the modification time)
-        scope.fetchFullPayload(false);
-        fetch->setFetchScope(scope);
-        if (!fetch->exec()) {
-            error(collection, i18n("Unable to list collection: %1, %2", fetch->errorString(), mapiError()));
-            return;
-        }
-        Item::List existingItems = fetch->items();
-        foreach (Item item, existingItems) {
-            // store all the items that we already know
-            MapiId id(item.remoteId());
-            knownRemoteIds.insert(id);
-            knownItems.insert(id, item);
-        }
-    }
-    kError() << "knownRemoteIds:" << knownRemoteIds.size();
-
     MapiId parentId(collection.remoteId());
     MapiFolder parentFolder(m_connection, __FUNCTION__, parentId);
     if (!parentFolder.open()) {
         error(collection, i18n("Unable to open collection: %1", mapiError()));
-        return;
+        return false;
+    }
+
+    syncWindow(collection, parentFolder);
+    if (!m_scheduler->hasWeights()) {
+        schedulerWeights();
+    }
+
+    // If the folder has not changed since we last looked, we are done.
+    QByteArray state;
+    unsigned unread = 0;
+    m_folderStateSyncs++;
+    if (parentFolder.statePull(state, &unread)) {
+        FolderStateAttribute *attribute = collection.attribute<FolderStateAttribute>();
+        if (attribute && (attribute->state() == state)) {
+            m_folderStateSkips++;
+            m_statistics->cache("folderState", true);
+            m_statistics->unchanged(collection);
+            MAPI_LOG(Sync, kDebug()) << "collection unchanged:" << collection.name() << "skipped:" << m_folderStateSkips << 
+                "of:" << m_folderStateSyncs;
+            m_scheduler->finish(collection, 0, unread);
+            if (m_scheduler->roundDone()) {
+                vanishedExpire();
+            }
+            return true;
+        }
+    } else {
+        state.clear();
     }
 
-    // Get the folder content for the collection.
-    QList<MapiItem *> list;
+    m_statistics->cache("folderState", false);
+    m_scheduler->start(collection);
+
+    // Find what we already handed to Akonadi for this collection.
+    MapiSyncIndex index(MapiSyncIndex::fileName(identifier(), collection.id()));
+    if (!syncIndexOpen(collection, index)) {
+        return false;
+    }
+    QHash<mapi_id_t, Item::Id> retrieved = m_syncIndexRetrieved.take(collection.id());
+
+    // Get the folder content for the collection. If the server will sort
+    // it for us, we can diff it and hand it to Akonadi a batch at a time. 
+    // Otherwise, we have to read it all first.
+    MapiContents contents;
+    bool sorted = true;
+    unsigned total;
+    QTime timer;
+    timer.start();
     emit status(Running, i18n("Fetching collection: %1", collection.name()));
-    if (!parentFolder.childrenPull(list)) {
+    if (!parentFolder.contentsOpen(m_envelopeSync, false, sorted, total)) {
         error(collection, i18n("Unable to fetch collection: %1", mapiError()));
-        return;
+        return false;
+    }
+    setTotalItems(total);
+    m_syncAdded = 0;
+    m_syncChanged = 0;
+    m_syncDeleted = 0;
+    m_syncMoved = 0;
+    int k = 0;
+    if (sorted) {
+        mapi_id_t lastMid = 0;
+        bool first = true;
+
+        while (parentFolder.contentsNext(contents, CONTENTS_BATCH)) {
+            // The server may accept the sort and still not keep to it. Then
+            // read the rest as if unsorted, keeping this batch, and merge it
+            // all below. Any rows from before the last batch we merged come
+            // out as new, and those we already took for gone are found
+            // again among the vanished items.
+            if (!contents.isSorted() || (!first && (contents.mid(0) <= lastMid))) {
+                kError() << "contents not sorted:" << collection.name() << "after:" << k;
+                sorted = false;
+                break;
+            }
+            first = false;
+            lastMid = contents.mid(contents.size() - 1);
+            syncBatch(collection, contents, index, k, false, retrieved, items, deletedItems);
+            contents.clear();
+        }
+    }
+    if (!sorted) {
+        while (parentFolder.contentsNext(contents, CONTENTS_BATCH)) {
+        }
+    }
+    syncBatch(collection, contents, index, k, true, retrieved, items, deletedItems);
+    MAPI_LOG(Sync, kDebug()) << "fetched:" << total << "items from collection:" << collection.name() <<
+        "in:" << timer.elapsed() << "ms, sorted:" << sorted;
+    index.commit();
+    m_statistics->synced(collection, m_syncAdded, m_syncChanged, m_syncDeleted, m_syncMoved);
+    m_scheduler->finish(collection, m_syncAdded + m_syncChanged + m_syncDeleted + m_syncMoved, unread);
+    if (m_scheduler->roundDone()) {
+        vanishedExpire();
+    }
+    if (m_revisionSkips) {
+        MAPI_LOG(Sync, kDebug()) << "refetches avoided by change keys:" << m_revisionSkips;
+    }
+    contents.clear();
+    prefetchPrune();
+
+    // Kick off the prefetcher.
+    if (!m_prefetchQueue.isEmpty() && !m_prefetchTimer.isActive()) {
+        m_prefetchTimer.start();
+    }
+
+    // Remember the state the folder was in before we fetched it, so that 
+    // any changes since will be picked up next time.
+    if (!state.isEmpty()) {
+        Collection changed(collection);
+        changed.addAttribute(new FolderStateAttribute(state));
+        new CollectionModifyJob(changed);
+    }
+
+    if (MapiLogging::isEnabled(MapiLogging::Sync)) {
+        foreach(Item item, items) {
+            kDebug() << "[Item-Dump] ID:"<<item.id()<<"RemoteId:"<<item.remoteId()<<"Revision:"<<item.revision()<<"ModTime:"<<item.modificationTime();
+        }
+    }
+
+    // We fetched a load of stuff. This seems like a good place to force 
+    // any subsequent activity to re-attempt the login.
+    logoff();
+    return true;
+}
+
+void MapiResource::vanishedExpire()
+{
+    // A job takes items by Akonadi id or by remote id, but not both.
+    Item::List deletedItems[2];
+
+    foreach (const MapiVanishedItem &vanished, m_vanished) {
+        deletedItems[vanished.item.isValid()] << vanished.item;
+        m_statistics->expired(vanished.item.parentCollection());
     }
-    kError() << "fetched:" << list.size() << "items from collection:" << collection.name();
+    m_vanished.clear();
+    for (unsigned i = 0; i < 2; i++) {
+        if (deletedItems[i].isEmpty()) {
+            continue;
+        }
+        kDebug() << "deleting vanished items:" << deletedItems[i].size();
+        ItemDeleteJob *job = new ItemDeleteJob(deletedItems[i]);
+        if (!job->exec()) {
+            kError() << "cannot delete vanished items:" << job->errorString();
+        }
+    }
+}
 
-    QSet<MapiId> checkedRemoteIds;
-    // run though all the found data...
-    foreach (MapiItem *data, list) {
-        MapiId remoteId(data->id());
-        checkedRemoteIds << remoteId; // store for later use
+void MapiResource::syncBatch(const Akonadi::Collection &collection, const MapiContents &contents, MapiSyncIndex &index, int &k, bool last, const QHash<mapi_id_t, Akonadi::Item::Id> &retrieved, Akonadi::Item::List &items, Akonadi::Item::List &deletedItems)
+{
+    MapiId parentId(collection.remoteId());
+
+    // Walk both sides in message id order. An id which is only on the 
+    // server is new, one which is only in the index has gone, and one which
+    // is in both may have changed. The new index is built as we go.
+    MapiSyncMerge merge(contents, index, k, last);
+    MapiSyncMerge::Step step;
+    while ((step = merge.next()) != MapiSyncMerge::Done) {
+        // Hand over what we have so far, rather than holding everything.
+        if (items.size() + deletedItems.size() >= CONTENTS_BATCH) {
+            itemsRetrievedIncremental(items, deletedItems);
+            items.clear();
+            deletedItems.clear();
+        }
+
+        if (step == MapiSyncMerge::New) {
+            int row = merge.row();
+            MapiId remoteId(parentId, contents.mid(row));
+            MapiSyncIndexRecord record;
 
-        if (!knownRemoteIds.contains(remoteId)) {
-            // we do not know this remoteID -> create a new empty item for it
+            // Prefer the search key, but for mail the message id will do.
+            QByteArray searchKey = contents.searchKey(row);
+            if (searchKey.isEmpty()) {
+                searchKey = contents.messageId(row).toUtf8();
+            }
+            QByteArray changeKey = contents.changeKey(row);
+            record.mid = contents.mid(row);
+            record.itemId = -1;
+            record.modified = contents.modified(row).toTime_t();
+            record.changeKey = MapiSyncIndex::hash(changeKey);
+            record.revision = 1;
+            record.flags = 0;
+
+            // we do not know this remoteID -> see if it was moved here
+            if (!searchKey.isEmpty()) {
+                // It may never have left, but been taken for gone by a sync
+                // which could not rely on the order of the contents.
+                QHash<QByteArray, MapiVanishedItem>::iterator i = m_vanished.find(searchKey);
+                if ((i != m_vanished.end()) && (i.value().item.remoteId() == remoteId.toString())) {
+                    const MapiVanishedItem &vanished = i.value();
+
+                    record.itemId = vanished.item.id();
+                    if ((vanished.changeKey && (vanished.changeKey == record.changeKey)) ||
+                        (vanished.modified == record.modified)) {
+                        if (record.itemId != -1) {
+                            record.flags = MapiSyncIndexRecord::PayloadPresent;
+                        }
+                    } else {
+                        Item existingItem(vanished.item);
+                        existingItem.setRemoteRevision(revision(changeKey, ++record.revision));
+                        items << existingItem;
+                        m_syncChanged++;
+                    }
+                    m_prefetchGone.remove(remoteId.toString());
+                    m_vanished.erase(i);
+                    index.append(record, searchKey);
+                    continue;
+                }
+
+                record.itemId = vanishedMove(searchKey, collection, remoteId, record.modified, record.changeKey);
+                if (record.itemId != -1) {
+                    m_syncMoved++;
+                    record.flags = MapiSyncIndexRecord::PayloadPresent;
+                    index.append(record, searchKey);
+                    continue;
+                }
+            }
+
+            // ...otherwise, create a new empty item for it
             Item item(m_itemMimeType);
             item.setParentCollection(collection);
             item.setRemoteId(remoteId.toString());
-            item.setRemoteRevision(QString::number(1));
-            //item.setModificationTime(data->modified());
+            item.setRemoteRevision(revision(changeKey, record.revision));
+            if (!searchKey.isEmpty()) {
+                item.addAttribute(new SearchKeyAttribute(searchKey));
+            }
+            if (m_envelopeSync) {
+                MapiItem *data = contents.item(parentId, row);
+                envelopePayload(*data, item);
+                prefetchQueue(collection, *data);
+                delete data;
+            }
             items << item;
+            m_syncAdded++;
+            index.append(record, searchKey);
+        } else if (step == MapiSyncMerge::Gone) {
+            const MapiSyncIndexRecord &record = index.at(merge.record());
+            QByteArray searchKey = index.searchKey(merge.record());
+            Item item(record.itemId);
+            item.setParentCollection(collection);
+            item.setRemoteId(MapiId(parentId, record.mid).toString());
+            m_prefetchGone.insert(item.remoteId());
+
+            // Anything we might recognise again is held back in case it was
+            // moved.
+            if (!searchKey.isEmpty()) {
+                MapiVanishedItem vanished;
+
+                vanished.item = item;
+                vanished.modified = record.modified;
+                vanished.changeKey = record.changeKey;
+                m_vanished.insert(searchKey, vanished);
+                m_prefetched.remove(item.remoteId());
+                continue;
+            }
+            deletedItems << item;
+            m_syncDeleted++;
         } else {
-            // this item is already known, check if it was update in the meanwhile
-            Item& existingItem = knownItems.find(remoteId).value();
-// 				kDebug() << "Item("<<existingItem.id()<<":"<<data.id<<":"<<existingItem.revision()<<") is already known [Cache-ModTime:"<<existingItem.modificationTime()
-// 						<<" Server-ModTime:"<<data.modified<<"] Flags:"<<existingItem.flags()<<"Attrib:"<<existingItem.attributes();
-            if (existingItem.modificationTime() < data->modified()) {
-                kDebug() << existingItem.id()<<"=> this item has changed";
+            int row = merge.row();
+            MapiSyncIndexRecord record = index.at(merge.record());
+            QByteArray searchKey = index.searchKey(merge.record());
+            qint64 modified = contents.modified(row).toTime_t();
+            QByteArray changeKey = contents.changeKey(row);
+            quint64 changeKeyHash = MapiSyncIndex::hash(changeKey);
+
+            // Fill in anything we learnt while retrieving the item.
+            if (retrieved.contains(record.mid)) {
+                record.itemId = retrieved.value(record.mid);
+                record.flags |= MapiSyncIndexRecord::PayloadPresent;
+            }
+
+            // The change key moves exactly when the item changes. Without
+            // one, fall back to the modification time, bearing in mind that
+            // a rebuilt record only has Akonadi's idea of that.
+            bool changed;
+            bool timeChanged;
+            if (record.flags & MapiSyncIndexRecord::Rebuilt) {
+                timeChanged = record.modified < modified;
+            } else {
+                timeChanged = record.modified != modified;
+            }
+            if (record.changeKey && !changeKey.isEmpty()) {
+                changed = record.changeKey != changeKeyHash;
+                if (timeChanged && !changed) {
+                    m_revisionSkips++;
+                }
+            } else {
+                changed = timeChanged;
+            }
+            record.modified = modified;
+            record.changeKey = changeKeyHash;
+            record.flags &= ~MapiSyncIndexRecord::Rebuilt;
+            if (changed) {
+                Item existingItem(record.itemId);
+                existingItem.setParentCollection(collection);
+                existingItem.setRemoteId(MapiId(parentId, record.mid).toString());
+                MAPI_LOG(Sync, kDebug()) << existingItem.remoteId() << "=> this item has changed";
 
                 // force akonadi to call retrieveItem() for this item in order to get updated data
-                int revision = existingItem.remoteRevision().toInt();
-                existingItem.clearPayload();
-                existingItem.setRemoteRevision( QString::number(++revision) );
+                existingItem.setRemoteRevision(revision(changeKey, ++record.revision));
                 items << existingItem;
+                m_syncChanged++;
+                record.flags &= ~MapiSyncIndexRecord::PayloadPresent;
+                m_prefetched.remove(existingItem.remoteId());
+                if (m_envelopeSync) {
+                    MapiItem *data = contents.item(parentId, row);
+                    prefetchQueue(collection, *data);
+                    delete data;
+                }
             }
+            index.append(record, searchKey);
         }
-        delete data;
-        // TODO just for debugging...
-        if (items.size() > 3) {
-            //break;
+    }
+}
+
+Akonadi::Item::Id MapiResource::vanishedMove(const QByteArray &searchKey, const Akonadi::Collection &collection, const MapiId &remoteId, qint64 modified, quint64 changeKey)
+{
+    QHash<QByteArray, MapiVanishedItem>::iterator i = m_vanished.find(searchKey);
+    if (i == m_vanished.end()) {
+        return -1;
+    }
+
+    // A copy shares the search key (or Message-ID) of the original, so only
+    // something which has not changed since it vanished counts as a move.
+    const MapiVanishedItem &vanished = i.value();
+    if (!((vanished.changeKey && (vanished.changeKey == changeKey)) || (vanished.modified == modified))) {
+        MAPI_LOG(Sync, kDebug()) << "not a move:" << remoteId.toString() << "changed since:" << vanished.item.remoteId();
+        return -1;
+    }
+    Item item = vanished.item;
+
+    // An item which has not been retrieved since it was added is only known
+    // by its remote id, so look up its Akonadi id.
+    if (!item.isValid()) {
+        ItemFetchJob *fetch = new ItemFetchJob(item);
+        fetch->fetchScope().fetchFullPayload(false);
+        fetch->fetchScope().setCacheOnly(true);
+        if (!fetch->exec() || fetch->items().isEmpty()) {
+            kError() << "cannot find item:" << item.remoteId() << fetch->errorString();
+            return -1;
         }
+        item.setId(fetch->items().first().id());
     }
 
-    // now check if some of the items need to be removed
-    knownRemoteIds.subtract(checkedRemoteIds);
+    // Move the item, payload and all, then point it at its new home.
+    ItemMoveJob *move = new ItemMoveJob(item, collection);
+    if (!move->exec()) {
+        kError() << "cannot move item:" << item.remoteId() << move->errorString();
+        return -1;
+    }
+    m_vanished.erase(i);
+    item.setParentCollection(collection);
+    item.setRemoteId(remoteId.toString());
+    ItemModifyJob *modify = new ItemModifyJob(item);
+    modify->setIgnorePayload(true);
+    modify->disableRevisionCheck();
+    if (!modify->exec()) {
+        kError() << "cannot update moved item:" << remoteId.toString() << modify->errorString();
+    }
+    m_movedItems++;
+    m_movedBytes += item.size();
+    MAPI_LOG(Sync, kDebug()) << "moved item:" << remoteId.toString() << "to:" << collection.name() << 
+        "moves:" << m_movedItems << "bytes saved:" << m_movedBytes;
+    return item.id();
+}
+
+bool MapiResource::syncIndexOpen(const Akonadi::Collection &collection, MapiSyncIndex &index)
+{
+    // Items held back in case they were moved are still in the collection.
+    qint64 expected = index.open() ? index.size() : -1;
+    if (expected != -1) {
+        QHash<QByteArray, MapiVanishedItem>::const_iterator i;
+        for (i = m_vanished.constBegin(); i != m_vanished.constEnd(); ++i) {
+            if (i.value().item.parentCollection().id() == collection.id()) {
+                expected++;
+            }
+        }
 
-    foreach (const MapiId &remoteId, knownRemoteIds) {
-        deletedItems << knownItems.value(remoteId);
+        // Changes made by anybody else remove the index, see 
+        // syncIndexInvalidate(), so if Akonadi also agrees on the number of
+        // items, we can trust it.
+        CollectionStatisticsJob *statistics = new CollectionStatisticsJob(collection);
+        if (statistics->exec() && (statistics->statistics().count() == expected)) {
+            return true;
+        }
+        kError() << "sync index inconsistent:" << collection.name() << "expected:" << expected <<
+            "actual:" << statistics->statistics().count();
     }
 
-    foreach(Item item, items) {
-        kDebug() << "[Item-Dump] ID:"<<item.id()<<"RemoteId:"<<item.remoteId()<<"Revision:"<<item.revision()<<"ModTime:"<<item.modificationTime();
+    // Rebuild the index from Akonadi.
+    emit status(Running, i18n("Fetching %1 from cache", collection.name()));
+    ItemFetchJob *fetch = new ItemFetchJob( collection );
+
+    Akonadi::ItemFetchScope scope;
+    // we are only interested in the items from the cache
+    scope.setCacheOnly(true);
+    // we don't need the payload (we are mainly interested in the remoteID and the modification time)
+    scope.fetchFullPayload(false);
+    scope.fetchAttribute<SearchKeyAttribute>();
+    fetch->setFetchScope(scope);
+    if (!fetch->exec()) {
+        error(collection, i18n("Unable to list collection: %1, %2", fetch->errorString(), mapiError()));
+        return false;
     }
 
-    // We fetched a load of stuff. This seems like a good place to force 
-    // any subsequent activity to re-attempt the login.
-    logoff();
+    Item::List knownItems = fetch->items();
+    QVector<QPair<mapi_id_t, int> > known;
+    known.reserve(knownItems.size());
+    for (int i = 0; i < knownItems.size(); i++) {
+        known.append(qMakePair(MapiId(knownItems.at(i).remoteId()).second, i));
+    }
+    qSort(known);
+    for (int i = 0; i < known.size(); i++) {
+        const Item &item = knownItems.at(known.at(i).second);
+        SearchKeyAttribute *attribute = item.attribute<SearchKeyAttribute>();
+        MapiSyncIndexRecord record;
+
+        // Skip any duplicates, which will then be deleted.
+        if (i && (known.at(i - 1).first == known.at(i).first)) {
+            continue;
+        }
+        record.mid = known.at(i).first;
+        record.itemId = item.id();
+        record.modified = item.modificationTime().toTime_t();
+        record.changeKey = 0;
+        record.revision = 0;
+        if (item.remoteRevision().startsWith(CHANGE_KEY_PREFIX)) {
+            record.changeKey = MapiSyncIndex::hash(QByteArray::fromHex(item.remoteRevision().mid(CHANGE_KEY_PREFIX.size()).toAscii()));
+        } else {
+            record.revision = item.remoteRevision().toUInt();
+        }
+        record.flags = MapiSyncIndexRecord::Rebuilt;
+        if (item.hasPayload()) {
+            record.flags |= MapiSyncIndexRecord::PayloadPresent;
+        }
+        index.append(record, attribute ? attribute->key() : QByteArray());
+    }
+    kDebug() << "rebuilt sync index:" << collection.name() << "items:" << known.size();
+    if (!index.commit()) {
+        error(collection, i18n("Unable to index collection: %1", collection.name()));
+        return false;
+    }
+    return true;
+}
+
+QString MapiResource::revision(const QByteArray &changeKey, unsigned counter)
+{
+    if (changeKey.isEmpty()) {
+        return QString::number(counter);
+    }
+    return CHANGE_KEY_PREFIX + QString::fromAscii(changeKey.toHex());
+}
+
+void MapiResource::syncIndexInvalidate(const Akonadi::Collection &collection)
+{
+    if (collection.id() < 0) {
+        return;
+    }
+    m_syncIndexRetrieved.remove(collection.id());
+    QFile::remove(MapiSyncIndex::fileName(identifier(), collection.id()));
+}
+
+void MapiResource::syncIndexRetrieved(const Akonadi::Item &item)
+{
+    Collection::Id collection = item.parentCollection().id();
+
+    if ((collection < 0) || (item.id() < 0)) {
+        return;
+    }
+    m_syncIndexRetrieved[collection].insert(MapiId(item.remoteId()).second, item.id());
+}
+
+void MapiResource::syncIndexFlush()
+{
+    QHash<Collection::Id, QHash<mapi_id_t, Item::Id> >::const_iterator i;
+
+    for (i = m_syncIndexRetrieved.constBegin(); i != m_syncIndexRetrieved.constEnd(); ++i) {
+        MapiSyncIndex index(MapiSyncIndex::fileName(identifier(), i.key()));
+
+        if (!index.open()) {
+            continue;
+        }
+        for (int j = 0; j < index.size(); j++) {
+            MapiSyncIndexRecord record = index.at(j);
+
+            if (i.value().contains(record.mid)) {
+                record.itemId = i.value().value(record.mid);
+                record.flags |= MapiSyncIndexRecord::PayloadPresent;
+            }
+            index.append(record, index.searchKey(j));
+        }
+        index.commit();
+    }
+    m_syncIndexRetrieved.clear();
+}
+
+void MapiResource::schedulerWeights()
+{
+    static const struct
+    {
+        MapiDefaultFolder folder;
+        unsigned weight;
+    } weights[] = {
+        { Inbox, 4 },
+        { Calendar, 3 },
+        { Contacts, 3 },
+        { Tasks, 2 },
+        { Drafts, 1 },
+        { SentMail, 1 }
+    };
+
+    for (unsigned i = 0; i < sizeof(weights) / sizeof(weights[0]); i++) {
+        MapiId id(m_connection, weights[i].folder);
+
+        if (id.isValid()) {
+            m_scheduler->setWeight(id.second, weights[i].weight);
+        }
+    }
+}
+
+void MapiResource::schedulerRoundStart(const Akonadi::Collection::List &collections)
+{
+    // Queue the item syncs most important first. Akonadi drops the ones it
+    // would queue itself for the same collections later.
+    foreach (Collection::Id id, m_scheduler->roundStart(collections)) {
+        synchronizeCollection(id);
+    }
+}
+
+void MapiResource::syncWindow(const Akonadi::Collection &collection, MapiFolder &folder)
+{
+    Q_UNUSED(collection);
+    Q_UNUSED(folder);
 }
 
 bool MapiResource::logon(void)
@@ -288,6 +1197,225 @@ bool MapiResource::logon(void)
     return m_connected;
 }
 
+bool MapiResource::payloadFetch(Akonadi::Item &item)
+{
+    Q_UNUSED(item);
+    return false;
+}
+
+void MapiResource::payloadFetch(Akonadi::Item::List &items)
+{
+    Item::List fetched;
+
+    foreach (Item item, items) {
+        if (payloadFetch(item)) {
+            fetched << item;
+        }
+    }
+    items = fetched;
+}
+
+unsigned MapiResource::prefetchBudget()
+{
+    return 0;
+}
+
+void MapiResource::prefetchNext()
+{
+    unsigned budget = prefetchBudget();
+
+    if (!budget || m_prefetchQueue.isEmpty() || !m_prefetchStoring.isEmpty()) {
+        // Nothing to do. We'll be restarted when there is.
+        return;
+    }
+
+    // Stay out of the way while the user, or we, are busy.
+    if (m_busy || (m_userActive.isValid() && 
+                   (m_userActive.secsTo(QDateTime::currentDateTime()) < PREFETCH_IDLE))) {
+        m_prefetchTimer.start();
+        return;
+    }
+
+    // Top up the budget, which is allowed to accumulate up to a minute's
+    // worth.
+    m_prefetchTokens += (qint64)budget * m_prefetchRefilled.restart() / 60000;
+    if (m_prefetchTokens > budget) {
+        m_prefetchTokens = budget;
+    }
+    if (!m_prefetchSorted) {
+        qSort(m_prefetchQueue);
+        m_prefetchSorted = true;
+    }
+
+    // Take as many items as the budget allows. An item larger than the 
+    // whole budget can go once the budget is full.
+    QMap<QString, unsigned> sizes;
+    Item::List items;
+    qint64 tokens = m_prefetchTokens;
+    while (!m_prefetchQueue.isEmpty() && (items.size() < PREFETCH_BATCH)) {
+        const MapiPrefetchCandidate &next = m_prefetchQueue.first();
+        if ((tokens < next.size) && ((tokens < budget) || !items.isEmpty())) {
+            break;
+        }
+        MapiPrefetchCandidate candidate = m_prefetchQueue.takeFirst();
+        m_prefetchQueued.remove(candidate.remoteId);
+        if (m_prefetchSkip.remove(candidate.remoteId) || m_prefetched.contains(candidate.remoteId)) {
+            continue;
+        }
+
+        Item item(m_itemMimeType);
+        item.setRemoteId(candidate.remoteId);
+        item.setParentCollection(candidate.collection);
+        items << item;
+        sizes.insert(candidate.remoteId, candidate.size);
+        tokens -= candidate.size;
+    }
+    if (!items.isEmpty()) {
+        int oldStatus = status();
+        QString oldMessage = statusMessage();
+
+        payloadFetch(items);
+
+        // Hand the bodies to Akonadi to keep, by asking it for them. It
+        // comes back to retrieveItem(), which finds them here.
+        Item::List stored;
+        foreach (const Item &item, items) {
+            unsigned size = sizes.value(item.remoteId());
+            Item store;
+
+            m_prefetchTokens -= size;
+            m_prefetchItems++;
+            m_prefetchBytes += size;
+            m_prefetched.insert(item.remoteId(), new Item(item), size);
+            m_prefetchStoring.insert(item.remoteId());
+            store.setRemoteId(item.remoteId());
+            store.setParentCollection(item.parentCollection());
+            stored << store;
+        }
+        emit status(oldStatus, oldMessage);
+        if (!stored.isEmpty()) {
+            ItemFetchJob *fetch = new ItemFetchJob(stored, this);
+            fetch->fetchScope().fetchFullPayload(true);
+            connect(fetch, SIGNAL(result(KJob*)), SLOT(prefetchStored(KJob*)));
+            return;
+        }
+    }
+    if (!m_prefetchQueue.isEmpty()) {
+        m_prefetchTimer.start();
+    } else {
+        m_prefetchSkip.clear();
+        kDebug() << "prefetched items:" << m_prefetchItems << "bytes:" << m_prefetchBytes;
+    }
+}
+
+void MapiResource::prefetchStored(KJob *job)
+{
+    if (job->error()) {
+        // Most likely, an item was deleted before we got to it. It will
+        // be fetched on demand if needed.
+        kDebug() << "cannot store prefetched items:" << job->errorString();
+    }
+
+    // Anything Akonadi did not ask for is no longer needed.
+    foreach (const QString &remoteId, m_prefetchStoring) {
+        m_prefetched.remove(remoteId);
+    }
+    m_prefetchStoring.clear();
+    if (!m_prefetchQueue.isEmpty()) {
+        m_prefetchTimer.start();
+    } else {
+        m_prefetchSkip.clear();
+        kDebug() << "prefetched items:" << m_prefetchItems << "bytes:" << m_prefetchBytes;
+    }
+}
+
+void MapiResource::prefetchPrune()
+{
+    if (!m_prefetchGone.isEmpty()) {
+        // Rebuild the queue in one pass.
+        QList<MapiPrefetchCandidate> queue;
+        foreach (const MapiPrefetchCandidate &candidate, m_prefetchQueue) {
+            if (!m_prefetchGone.contains(candidate.remoteId)) {
+                queue.append(candidate);
+            } else {
+                m_prefetchQueued.remove(candidate.remoteId);
+            }
+        }
+        m_prefetchQueue = queue;
+        m_prefetchGone.clear();
+    }
+    prefetchTrim(PREFETCH_QUEUE_SIZE);
+}
+
+void MapiResource::prefetchTrim(int size)
+{
+    if (m_prefetchQueue.size() <= size) {
+        return;
+    }
+
+    // Keep the most important.
+    if (!m_prefetchSorted) {
+        qSort(m_prefetchQueue);
+        m_prefetchSorted = true;
+    }
+    while (m_prefetchQueue.size() > size) {
+        m_prefetchQueued.remove(m_prefetchQueue.takeLast().remoteId);
+    }
+}
+
+void MapiResource::prefetchQueue(const Akonadi::Collection &collection, const MapiItem &data)
+{
+    MapiPrefetchCandidate candidate;
+
+    candidate.remoteId = data.id().toString();
+    if (!prefetchBudget() || m_prefetchQueued.contains(candidate.remoteId)) {
+        return;
+    }
+    candidate.collection = collection;
+    candidate.delivered = data.delivered();
+    candidate.size = data.size();
+    candidate.unread = (data.flags() & MSGFLAG_READ) == 0;
+    m_prefetchQueue.append(candidate);
+    m_prefetchQueued.insert(candidate.remoteId);
+    m_prefetchSorted = false;
+
+    // A big sync can queue far more than we keep; trim now and then rather
+    // than for every item.
+    if (m_prefetchQueue.size() >= 2 * PREFETCH_QUEUE_SIZE) {
+        prefetchTrim(PREFETCH_QUEUE_SIZE);
+    }
+}
+
+bool MapiResource::prefetchTake(const Akonadi::Item &item, Akonadi::Item &prefetched)
+{
+    // Our own store-backs are neither user activity, nor hits or misses.
+    bool storing = m_prefetchStoring.remove(item.remoteId());
+    if (!storing) {
+        m_userActive = QDateTime::currentDateTime();
+    }
+
+    Item *cached = m_prefetched.take(item.remoteId());
+    if (!cached) {
+        if (!storing) {
+            m_prefetchMisses++;
+            m_statistics->cache("prefetch", false);
+            if (m_prefetchQueued.contains(item.remoteId())) {
+                m_prefetchSkip.insert(item.remoteId());
+            }
+            MAPI_LOG(Sync, kDebug()) << "prefetch miss:" << item.remoteId() << "hits:" << m_prefetchHits << "misses:" << m_prefetchMisses;
+        }
+        return false;
+    }
+    if (!storing) {
+        m_prefetchHits++;
+        m_statistics->cache("prefetch", true);
+        MAPI_LOG(Sync, kDebug()) << "prefetch hit:" << item.remoteId() << "hits:" << m_prefetchHits << "misses:" << m_prefetchMisses;
+    }
+    prefetched = *cached;
+    delete cached;
+    return true;
+}
+
 void MapiResource::logoff(void)
 {
     // There is no logoff operation. We just want to make sure we retry the
@@ -20,14 +20,81 @@
 #ifndef MAPIRESOURCE_H
 #define MAPIRESOURCE_H
 
+#include <QCache>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QPair>
+#include <QSet>
+#include <QTime>
+#include <QTimer>
+
 #include <KLocalizedString>
 #include <akonadi/resourcebase.h>
 
 #include "mapiobjects.h"
+#include "mapitracer.h"
 
 class MapiConnector2;
+class MapiDumper;
 class MapiFolder;
 class MapiMessage;
+class MapiScheduler;
+class MapiStatistics;
+class MapiSyncIndex;
+
+/**
+ * An item whose body is a candidate for prefetching.
+ */
+class MapiPrefetchCandidate
+{
+public:
+    QString remoteId;
+    Akonadi::Collection collection;
+    QDateTime delivered;
+    unsigned size;
+    bool unread;
+
+    /**
+     * Order by priority: recent first, then unread, then small.
+     */
+    bool operator<(const MapiPrefetchCandidate &other) const;
+};
+
+/**
+ * An item which has vanished from a collection, held back in case it turns up
+ * in another one.
+ */
+class MapiVanishedItem
+{
+public:
+    Akonadi::Item item;
+
+    /**
+     * The modification time and change key hash from the sync index, which
+     * a moved item keeps but a copy need not.
+     */
+    qint64 modified;
+    quint64 changeKey;
+};
+
+/**
+ * The folder hierarchy under one root, as last fetched from the server.
+ */
+class MapiFolderTree
+{
+public:
+    /**
+     * The MapiFolder::hierarchyStatePull() of the root when it was fetched.
+     */
+    QByteArray state;
+    QDateTime fetched;
+
+    /**
+     * Each folder's remote id, its parent's remote id and its name, with
+     * parents before their children.
+     */
+    QList<QStringList> folders;
+};
 
 /**
  * The purpose of this class is to actas a base for individual resources which
@@ -57,7 +124,61 @@ protected:
     virtual const QString profile() = 0;
 
     /**
-     * Recursively find all folders starting at the given root which match
+     * Establish which body formats to fetch for messages. The default is
+     * to fetch just the native format.
+     */
+    virtual MapiMessage::BodyFormat bodyFormat();
+
+    /**
+     * Fill in an envelope-only payload for a new item. Only called if
+     * @ref m_envelopeSync is set. Bodies are then prefetched in idle time.
+     */
+    virtual void envelopePayload(const MapiItem &data, Akonadi::Item &item);
+
+    /**
+     * Restrict the items synced from a collection to a window of time, 
+     * using @ref MapiFolder::setWindow(). Items outside the window are
+     * removed from the local cache. The default is no window.
+     */
+    virtual void syncWindow(const Akonadi::Collection &collection, MapiFolder &folder);
+
+    /**
+     * How many bytes of bodies to prefetch per minute, or 0 to disable
+     * prefetching. The default is 0.
+     */
+    virtual unsigned prefetchBudget();
+
+    /**
+     * Fetch the full payload of an item from Exchange. Used for prefetching;
+     * the default does nothing.
+     */
+    virtual bool payloadFetch(Akonadi::Item &item);
+
+    /**
+     * Fetch the full payloads of a number of items, removing any which
+     * cannot be fetched. The default fetches each item in turn.
+     */
+    virtual void payloadFetch(Akonadi::Item::List &items);
+
+    /**
+     * How long (in ms) an item may take to fetch before it is written to
+     * the slow item log, or 0 to log nothing. The default is
+     * SLOW_ITEM_THRESHOLD.
+     */
+    virtual unsigned slowItemThreshold();
+
+    /**
+     * Called from retrieveItem() to see if the item has been prefetched. 
+     * This also marks the user as active, which pauses the prefetcher.
+     *
+     * @param item          The item being retrieved.
+     * @param prefetched    Set to the prefetched item, if any.
+     * @return True on a hit.
+     */
+    bool prefetchTake(const Akonadi::Item &item, Akonadi::Item &prefetched);
+
+    /**
+     * Find all folders starting at the given root which match
      * the given filter.
      * 
      * @param rootFolder 	Identifies where to start the search.
@@ -66,19 +187,37 @@ protected:
     void fetchCollections(MapiDefaultFolder rootFolder, Akonadi::Collection::List &collections);
 
     /**
-     * Find all the items in the given collection.
+     * Find all the items in the given collection. Large collections are 
+     * handed to Akonadi in batches as they are fetched, leaving the last 
+     * batch to the caller, which should pass it to 
+     * itemsRetrievedIncremental() followed by itemsRetrievalDone().
      * 
      * @param collection	The collection to fetch.
      * @param items		Fetched items.
      * @param deletedItems	Items which have been deleted on the backend.
+     * @return False if the task has been cancelled or deferred.
      */
-    void fetchItems(const Akonadi::Collection &collection, Akonadi::Item::List &items, Akonadi::Item::List &deletedItems);
+    bool fetchItems(const Akonadi::Collection &collection, Akonadi::Item::List &items, Akonadi::Item::List &deletedItems);
 
     /**
      * Get the message corresponding to the item.
+     *
+     * @param collection    The collection the item is in. This may be called
+     *                      outside any task, e.g. by the prefetcher, when
+     *                      currentCollection() is not valid.
      */
     template <class Message>
-    Message *fetchItem(const Akonadi::Item &item);
+    Message *fetchItem(const Akonadi::Item &item, const Akonadi::Collection &collection);
+
+    /**
+     * Get the messages corresponding to a number of items, resolving their
+     * recipients together. The Message must implement 
+     * @ref MapiMessage::recipientsResolved().
+     *
+     * @return A message for each item, or 0 if it could not be fetched.
+     */
+    template <class Message>
+    QList<Message *> fetchItemBatch(const Akonadi::Item::List &items);
 
 protected:
     /*
@@ -89,12 +228,6 @@ protected:
 */
     virtual void doSetOnline(bool online);
 
-    /**
-     * Recurse through a hierarchy of Exchange folders which match the
-     * given filter.
-     */
-    void fetchCollections(const QString &path, const MapiId &parentId, const Akonadi::Collection &parent, Akonadi::Collection::List &collections);
-
     /**
      * Consistent error handling for task-based routines.
      */
@@ -103,12 +236,30 @@ protected:
     void error(const Akonadi::Collection &collection, const QString &body);
     void error(const MapiMessage &msg, const QString &body);
 
+    /**
+     * Note that a collection has been changed by somebody else, e.g. a client
+     * application, so that its sync index is rebuilt rather than trusted on
+     * the strength of its item count.
+     */
+    void syncIndexInvalidate(const Akonadi::Collection &collection);
+
     QString m_mapiFolderFilter;
     QString m_mapiMessageType;
     QString m_itemMimeType;
     MapiConnector2 *m_connection;
     bool m_connected;
 
+    /**
+     * If true, @ref fetchItems() fetches the envelope of each item along
+     * with its id, and new items get an envelope-only payload.
+     */
+    bool m_envelopeSync;
+
+    /**
+     * Running statistics, reported over D-Bus.
+     */
+    MapiStatistics *m_statistics;
+
 protected:
     /**
      * Logon to Exchange. A successful login is cached and subsequent calls
@@ -122,39 +273,335 @@ protected:
      * Logout from Exchange.
      */
     void logoff(void);
+
+    /**
+     * Where to keep the names resolved by the server between runs.
+     */
+    QString resolvedNamesFile() const;
+
+    /**
+     * Where to keep the folder hierarchy between runs.
+     */
+    QString folderTreesFile() const;
+
+    /**
+     * Where to log items which are slow to fetch, with a breakdown of
+     * where the time went.
+     */
+    QString slowItemsFile() const;
+
+    /**
+     * Log the item if it took too long to fetch.
+     *
+     * @param timer     Started when the fetch started.
+     * @param bytes     MapiTracer::bytes() when the fetch started.
+     */
+    void slowItemCheck(const Akonadi::Item &item, const MapiObject &message, const QElapsedTimer &timer, quint64 bytes);
+
+    /**
+     * Set while we are in the middle of a MAPI operation (which might spin
+     * a nested event loop) to keep the prefetcher out of the way.
+     */
+    bool m_busy;
+
+private:
+    /**
+     * Items which have an envelope-only payload, but whose body has yet to
+     * be fetched. The queue is sorted lazily.
+     */
+    QList<MapiPrefetchCandidate> m_prefetchQueue;
+    bool m_prefetchSorted;
+
+    /**
+     * The remote ids in @ref m_prefetchQueue, so that an item is queued
+     * only once.
+     */
+    QSet<QString> m_prefetchQueued;
+
+    /**
+     * Items retrieved in the foreground before we got to them.
+     */
+    QSet<QString> m_prefetchSkip;
+
+    /**
+     * Items deleted or moved away since they were queued. They are pruned
+     * from the queue at the end of each sync.
+     */
+    QSet<QString> m_prefetchGone;
+
+    /**
+     * Prefetched items which Akonadi has been asked to store. While any are
+     * outstanding, the prefetcher waits, and their retrieval counts neither
+     * as user activity nor as a prefetch hit.
+     */
+    QSet<QString> m_prefetchStoring;
+
+    /**
+     * Prefetched items, keyed by remote id, with a cost in bytes. They are
+     * held only until Akonadi retrieves them.
+     */
+    QCache<QString, Akonadi::Item> m_prefetched;
+    QTimer m_prefetchTimer;
+    QTime m_prefetchRefilled;
+    qint64 m_prefetchTokens;
+    QDateTime m_userActive;
+
+    /**
+     * Prefetch statistics.
+     */
+    unsigned m_prefetchHits;
+    unsigned m_prefetchMisses;
+    unsigned m_prefetchItems;
+    qulonglong m_prefetchBytes;
+
+    /**
+     * Queue an item for prefetching, unless prefetching is disabled or the
+     * item is already queued.
+     */
+    void prefetchQueue(const Akonadi::Collection &collection, const MapiItem &data);
+
+    /**
+     * Drop anything in @ref m_prefetchGone from the queue, and keep it
+     * within PREFETCH_QUEUE_SIZE.
+     */
+    void prefetchPrune();
+
+    /**
+     * Drop the least important items from the queue, leaving at most the
+     * given number.
+     */
+    void prefetchTrim(int size);
+
+    /**
+     * Items which have vanished from a collection, keyed by their search
+     * key. If one reappears in another collection during the same full
+     * sync, it is moved rather than being deleted and refetched.
+     */
+    QHash<QByteArray, MapiVanishedItem> m_vanished;
+
+    /**
+     * Move statistics.
+     */
+    unsigned m_movedItems;
+    qulonglong m_movedBytes;
+
+    /**
+     * Delete any vanished items which have not reappeared, once the full
+     * sync they vanished in is over.
+     */
+    void vanishedExpire();
+
+    /**
+     * Move a vanished item into the given collection, provided it has the
+     * same change key or modification time as the new arrival. Otherwise,
+     * the arrival is taken to be a copy.
+     *
+     * @return The id of the item, or -1 if it was not moved.
+     */
+    Akonadi::Item::Id vanishedMove(const QByteArray &searchKey, const Akonadi::Collection &collection, const MapiId &remoteId, qint64 modified, quint64 changeKey);
+
+    /**
+     * Items retrieved since each collection's sync index was last written,
+     * keyed by message id.
+     */
+    QHash<Akonadi::Collection::Id, QHash<mapi_id_t, Akonadi::Item::Id> > m_syncIndexRetrieved;
+
+    /**
+     * Open the sync index of a collection, checking it against Akonadi and
+     * rebuilding it if need be.
+     */
+    bool syncIndexOpen(const Akonadi::Collection &collection, MapiSyncIndex &index);
+
+    /**
+     * Note that an item has been retrieved, for the sync index.
+     */
+    void syncIndexRetrieved(const Akonadi::Item &item);
+
+    /**
+     * Write any retrieved items to their sync indexes.
+     */
+    void syncIndexFlush();
+
+    /**
+     * Diff a batch of the contents of a collection against its sync index.
+     *
+     * @param k             The next entry in the index.
+     * @param last          Set for the last batch, so that any entries left
+     *                      in the index are treated as gone.
+     * @param retrieved     Items retrieved since the index was written.
+     */
+    void syncBatch(const Akonadi::Collection &collection, const MapiContents &contents, MapiSyncIndex &index, int &k, bool last, const QHash<mapi_id_t, Akonadi::Item::Id> &retrieved, Akonadi::Item::List &items, Akonadi::Item::List &deletedItems);
+
+    /**
+     * Make a remote revision from a PidTagChangeKey, or from a counter if 
+     * the server did not give us a change key.
+     */
+    static QString revision(const QByteArray &changeKey, unsigned counter);
+
+    /**
+     * How many items looked changed by their modification time, but not
+     * by their change key.
+     */
+    unsigned m_revisionSkips;
+
+    /**
+     * How many items the sync in progress has added, changed, deleted and
+     * moved in from other collections. Items held back in case they were
+     * moved are only counted as deleted once they expire.
+     */
+    unsigned m_syncAdded;
+    unsigned m_syncChanged;
+    unsigned m_syncDeleted;
+    unsigned m_syncMoved;
+
+    /**
+     * Decides which collections to sync first.
+     */
+    MapiScheduler *m_scheduler;
+
+    /**
+     * Tell the scheduler which collections are the default folders.
+     */
+    void schedulerWeights();
+
+    /**
+     * Start a round of item syncs over the given collections.
+     */
+    void schedulerRoundStart(const Akonadi::Collection::List &collections);
+
+    /**
+     * The last folder hierarchy fetched under each root, and the roots
+     * which have been served from it without checking with the server.
+     */
+    QHash<int, MapiFolderTree> m_folderTrees;
+    QSet<int> m_folderTreesServed;
+    bool m_folderTreeCheckPending;
+    unsigned m_folderTreeHits;
+
+    /**
+     * Folder state statistics.
+     */
+    unsigned m_folderStateSkips;
+    unsigned m_folderStateSyncs;
+
+    /**
+     * Captures libmapi's wire dumps on request. It must go before the
+     * connection does.
+     */
+    MapiDumper *m_dumper;
+
+    bool folderTreesLoad();
+    bool folderTreesSave();
+
+    /**
+     * Append the collections of a cached folder hierarchy.
+     */
+    void folderTreeCollections(const MapiFolderTree &tree, Akonadi::Collection::List &collections);
+
+private Q_SLOTS:
+    /**
+     * Prefetch the highest priority item, budget permitting.
+     */
+    void prefetchNext();
+
+    /**
+     * Akonadi has stored a batch of prefetched items.
+     */
+    void prefetchStored(KJob *job);
+
+    /**
+     * Re-retrieve the collections which were served from the cache at 
+     * startup, so that they are checked against the server.
+     */
+    void folderTreeCheck();
 };
 
 /**
  * Grrr. Stupid C++ and template instantiation requirements - Ada rules!
  */
 template <class Message>
-Message *MapiResource::fetchItem(const Akonadi::Item &itemOrig)
+Message *MapiResource::fetchItem(const Akonadi::Item &itemOrig, const Akonadi::Collection &collection)
 {
-    kDebug() << "fetch item:" << currentCollection().name() << itemOrig.id() <<
+    MAPI_LOG(Sync, kDebug()) << "fetch item:" << collection.name() << itemOrig.id() <<
             ", " << itemOrig.remoteId();
 
     if (!logon()) {
         return 0;
     }
 
+    QElapsedTimer timer;
+    quint64 bytes = MapiTracer::bytes();
+    timer.start();
     MapiId remoteId(itemOrig.remoteId());
     Message *message = new Message(m_connection, __FUNCTION__, remoteId);
+    message->setBodyFormat(bodyFormat());
     if (!message->open()) {
-        emit status(Broken, i18n("Unable to open item: %1/%2, %3", currentCollection().name(),
+        emit status(Broken, i18n("Unable to open item: %1/%2, %3", collection.name(),
                                  itemOrig.id(), mapiError()));
+        slowItemCheck(itemOrig, *message, timer, bytes);
         return 0;
     }
 
     // find the remoteId of the item and the collection and try to fetch the needed data from the server
-    emit status(Running, i18n("Fetching item: %1/%2", currentCollection().name(), itemOrig.id()));
+    emit status(Running, i18n("Fetching item: %1/%2", collection.name(), itemOrig.id()));
     if (!message->propertiesPull()) {
-        emit status(Broken, i18n("Unable to fetch item: %1/%2, %3", currentCollection().name(),
+        emit status(Broken, i18n("Unable to fetch item: %1/%2, %3", collection.name(),
                                  itemOrig.id(), mapiError()));
+        slowItemCheck(itemOrig, *message, timer, bytes);
         delete message;
         return 0;
     }
-    kDebug() << "fetched item:" << itemOrig.remoteId();
+    slowItemCheck(itemOrig, *message, timer, bytes);
+    MAPI_LOG(Sync, kDebug()) << "fetched item:" << itemOrig.remoteId();
+    syncIndexRetrieved(itemOrig);
     return message;
 }
 
+template <class Message>
+QList<Message *> MapiResource::fetchItemBatch(const Akonadi::Item::List &items)
+{
+    QList<Message *> messages;
+
+    if (!logon()) {
+        for (int i = 0; i < items.size(); i++) {
+            messages << 0;
+        }
+        return messages;
+    }
+
+    MapiRecipientBatch batch(m_connection);
+    foreach (const Akonadi::Item &item, items) {
+        MapiId remoteId(item.remoteId());
+        Message *message = new Message(m_connection, __FUNCTION__, remoteId);
+
+        message->setBodyFormat(bodyFormat());
+        message->setRecipientBatch(&batch);
+        if (!message->open() || !message->propertiesPull()) {
+            kError() << "cannot fetch item:" << item.remoteId() << mapiError();
+            delete message;
+            message = 0;
+        }
+        messages << message;
+    }
+
+    // Now we have all the recipients, resolve them together.
+    bool resolved = batch.resolve();
+    for (int i = 0; i < messages.size(); i++) {
+        Message *message = messages.at(i);
+
+        if (!message) {
+            continue;
+        }
+        message->setRecipientBatch(0);
+        if (!resolved || !message->recipientsResolved()) {
+            kError() << "cannot complete item:" << items.at(i).remoteId() << mapiError();
+            delete message;
+            messages[i] = 0;
+            continue;
+        }
+        syncIndexRetrieved(items.at(i));
+    }
+    return messages;
+}
+
 #endif
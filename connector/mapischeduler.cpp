@@ -0,0 +1,190 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapischeduler.h"
+
+#include <QtAlgorithms>
+#include <KDebug>
+
+/**
+ * How long (in seconds) a collection counts as recently active after a sync
+ * finds changes in it.
+ */
+#ifndef SCHEDULER_RECENT
+#define SCHEDULER_RECENT (24 * 60 * 60)
+#endif
+
+/**
+ * The weight given to collections promoted over D-Bus.
+ */
+#define SCHEDULER_PRIORITY 100
+
+MapiSchedulerEntry::MapiSchedulerEntry() :
+    id(-1),
+    state(Idle),
+    weight(0),
+    unread(0)
+{
+}
+
+unsigned MapiSchedulerEntry::score() const
+{
+    unsigned result = weight * 1000;
+
+    if (changed.isValid() && (changed.secsTo(QDateTime::currentDateTime()) < SCHEDULER_RECENT)) {
+        result += 500;
+    }
+    result += qMin(unread, 499u);
+    return result;
+}
+
+QString MapiSchedulerEntry::stateName(State state)
+{
+    switch (state) {
+    case Idle:
+        return QString::fromAscii("idle");
+    case Pending:
+        return QString::fromAscii("pending");
+    case Running:
+        return QString::fromAscii("running");
+    }
+    return QString();
+}
+
+MapiScheduler::MapiScheduler(QObject *parent) :
+    QObject(parent),
+    m_hasWeights(false)
+{
+}
+
+void MapiScheduler::setWeight(mapi_id_t fid, unsigned weight)
+{
+    m_entries[fid].weight = weight;
+    m_hasWeights = true;
+}
+
+bool MapiScheduler::hasWeights() const
+{
+    return m_hasWeights;
+}
+
+/**
+ * Order entries by decreasing score.
+ */
+static bool scoreGreaterThan(const MapiSchedulerEntry &left, const MapiSchedulerEntry &right)
+{
+    return left.score() > right.score();
+}
+
+MapiSchedulerEntry &MapiScheduler::entry(const Akonadi::Collection &collection)
+{
+    MapiSchedulerEntry &result = m_entries[MapiId(collection.remoteId()).second];
+
+    if (!collection.name().isEmpty()) {
+        result.name = collection.name();
+    }
+    if (collection.isValid()) {
+        result.id = collection.id();
+    }
+    return result;
+}
+
+QList<Akonadi::Collection::Id> MapiScheduler::roundStart(const Akonadi::Collection::List &collections)
+{
+    QList<MapiSchedulerEntry> entries;
+    QList<Akonadi::Collection::Id> result;
+
+    // Whatever a previous round left unsynced is not waited for any more.
+    QHash<mapi_id_t, MapiSchedulerEntry>::iterator i;
+    for (i = m_entries.begin(); i != m_entries.end(); ++i) {
+        i.value().state = MapiSchedulerEntry::Idle;
+    }
+
+    // Only a collection the resource can queue by id is part of the round,
+    // else the round might never be done.
+    foreach (const Akonadi::Collection &collection, collections) {
+        MapiSchedulerEntry &current = entry(collection);
+
+        if (current.id != -1) {
+            current.state = MapiSchedulerEntry::Pending;
+            entries << current;
+        }
+    }
+    qStableSort(entries.begin(), entries.end(), scoreGreaterThan);
+    foreach (const MapiSchedulerEntry &current, entries) {
+        result << current.id;
+    }
+    return result;
+}
+
+void MapiScheduler::start(const Akonadi::Collection &collection)
+{
+    entry(collection).state = MapiSchedulerEntry::Running;
+}
+
+void MapiScheduler::finish(const Akonadi::Collection &collection, unsigned changes, unsigned unread)
+{
+    MapiSchedulerEntry &current = entry(collection);
+
+    current.state = MapiSchedulerEntry::Idle;
+    current.unread = unread;
+    if (changes) {
+        current.changed = QDateTime::currentDateTime();
+    }
+}
+
+bool MapiScheduler::roundDone() const
+{
+    foreach (const MapiSchedulerEntry &current, m_entries) {
+        if (current.state != MapiSchedulerEntry::Idle) {
+            return false;
+        }
+    }
+    return true;
+}
+
+QStringList MapiScheduler::queue() const
+{
+    QList<MapiSchedulerEntry> entries = m_entries.values();
+    QStringList result;
+
+    qStableSort(entries.begin(), entries.end(), scoreGreaterThan);
+    foreach (const MapiSchedulerEntry &current, entries) {
+        if (current.name.isEmpty()) {
+            continue;
+        }
+        result << QString::fromAscii("%1 %2 %3 score=%4 unread=%5").arg(current.id).
+            arg(current.name).arg(MapiSchedulerEntry::stateName(current.state)).arg(current.score()).
+            arg(current.unread);
+    }
+    return result;
+}
+
+void MapiScheduler::prioritise(qlonglong id)
+{
+    QHash<mapi_id_t, MapiSchedulerEntry>::iterator i;
+
+    for (i = m_entries.begin(); i != m_entries.end(); ++i) {
+        if (i.value().id == id) {
+            i.value().weight = SCHEDULER_PRIORITY;
+        }
+    }
+}
+
+#include "mapischeduler.moc"
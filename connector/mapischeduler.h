@@ -0,0 +1,147 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPISCHEDULER_H
+#define MAPISCHEDULER_H
+
+#include <QDateTime>
+#include <QHash>
+#include <QObject>
+#include <QStringList>
+
+#include <akonadi/collection.h>
+
+#include "mapiconnector2.h"
+
+/**
+ * What the scheduler knows about one collection.
+ */
+class MapiSchedulerEntry
+{
+public:
+    MapiSchedulerEntry();
+
+    enum State
+    {
+        /**
+         * Not part of a full sync.
+         */
+        Idle,
+
+        /**
+         * Part of a full sync, and not yet synced.
+         */
+        Pending,
+
+        /**
+         * Being synced.
+         */
+        Running
+    };
+
+    QString name;
+    Akonadi::Collection::Id id;
+    State state;
+
+    /**
+     * How important the collection is in its own right, e.g. the Inbox.
+     */
+    unsigned weight;
+    unsigned unread;
+    QDateTime changed;
+
+    /**
+     * The overall importance of the collection.
+     */
+    unsigned score() const;
+
+    static QString stateName(State state);
+};
+
+/**
+ * Orders the syncing of collections within a resource. When Akonadi asks for
+ * a full sync, it would sync the collections in whatever order it likes, so
+ * as soon as the collections are known the scheduler hands back the ones to
+ * sync, most important (such as the Inbox) first, for the resource to queue
+ * ahead of Akonadi's own. Collections which turn out to be unchanged (after
+ * a cheap check) complete straight away.
+ *
+ * The queue can be inspected, and collections promoted, over D-Bus.
+ */
+class MapiScheduler : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.Akonadi.Exchange.Scheduler")
+
+public:
+    MapiScheduler(QObject *parent = 0);
+
+    /**
+     * Set the weight of a collection, identified by its folder id.
+     */
+    void setWeight(mapi_id_t fid, unsigned weight);
+    bool hasWeights() const;
+
+    /**
+     * A full sync of the given collections is starting.
+     *
+     * @return The ids of the collections to sync, most important first. Only
+     * these are part of the round; collections Akonadi has not yet given an
+     * id are left out.
+     */
+    QList<Akonadi::Collection::Id> roundStart(const Akonadi::Collection::List &collections);
+
+    /**
+     * A collection is being synced.
+     */
+    void start(const Akonadi::Collection &collection);
+
+    /**
+     * A sync is over.
+     *
+     * @param changes   How many items were added, changed or deleted.
+     * @param unread    How many unread items the collection has.
+     */
+    void finish(const Akonadi::Collection &collection, unsigned changes, unsigned unread);
+
+    /**
+     * Has every collection in the full sync been synced?
+     */
+    bool roundDone() const;
+
+public Q_SLOTS:
+    /**
+     * The collections known to the scheduler, most important first, with
+     * their state and score.
+     */
+    Q_SCRIPTABLE QStringList queue() const;
+
+    /**
+     * Make a collection as important as the Inbox.
+     */
+    Q_SCRIPTABLE void prioritise(qlonglong id);
+
+private:
+    QHash<mapi_id_t, MapiSchedulerEntry> m_entries;
+    bool m_hasWeights;
+
+    MapiSchedulerEntry &entry(const Akonadi::Collection &collection);
+};
+
+#endif // MAPISCHEDULER_H
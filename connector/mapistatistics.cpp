@@ -0,0 +1,243 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapistatistics.h"
+
+#include "mapitracer.h"
+
+/**
+ * Each power of two is split into 2^HISTOGRAM_SUB_BITS buckets.
+ */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+MapiHistogram::MapiHistogram() :
+    m_buckets(HISTOGRAM_BUCKETS),
+    m_count(0)
+{
+}
+
+int MapiHistogram::bucket(quint64 value)
+{
+    if (value < HISTOGRAM_SUB) {
+        return value;
+    }
+
+    // Find the top bit, and use the bits below it to pick the bucket.
+    int top = HISTOGRAM_SUB_BITS;
+    while (value >> (top + 1)) {
+        top++;
+    }
+    return (top - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB + ((value >> (top - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+}
+
+quint64 MapiHistogram::value(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB) {
+        return bucket;
+    }
+    int top = bucket / HISTOGRAM_SUB + HISTOGRAM_SUB_BITS - 1;
+    return (quint64)(HISTOGRAM_SUB + bucket % HISTOGRAM_SUB) << (top - HISTOGRAM_SUB_BITS);
+}
+
+void MapiHistogram::record(quint64 value)
+{
+    m_buckets[bucket(value)]++;
+    m_count++;
+}
+
+quint64 MapiHistogram::count() const
+{
+    return m_count;
+}
+
+quint64 MapiHistogram::percentile(unsigned percent) const
+{
+    if (!m_count) {
+        return 0;
+    }
+
+    // Report the top of the bucket holding the value.
+    quint64 target = (m_count * percent + 99) / 100;
+    quint64 seen = 0;
+    for (int i = 0; i < m_buckets.size(); i++) {
+        seen += m_buckets.at(i);
+        if (seen >= target) {
+            return (i + 1 < m_buckets.size()) ? value(i + 1) - 1 : value(i);
+        }
+    }
+    return value(m_buckets.size() - 1);
+}
+
+QString MapiHistogram::toString() const
+{
+    return QString::fromAscii("count=%1 p50=%2ms p95=%3ms p99=%4ms").arg(m_count).
+        arg(percentile(50) / 1000.0, 0, 'f', 1).arg(percentile(95) / 1000.0, 0, 'f', 1).
+        arg(percentile(99) / 1000.0, 0, 'f', 1);
+}
+
+MapiCollectionStatistics::MapiCollectionStatistics() :
+    syncs(0),
+    unchanged(0),
+    added(0),
+    changed(0),
+    deleted(0),
+    moved(0),
+    calls(0),
+    bytes(0)
+{
+}
+
+MapiStatistics::MapiStatistics(QObject *parent) :
+    QObject(parent)
+{
+}
+
+MapiCollectionStatistics &MapiStatistics::collection(const Akonadi::Collection &collection)
+{
+    MapiCollectionStatistics &result = m_collections[collection.id()];
+
+    if (!collection.name().isEmpty()) {
+        result.name = collection.name();
+    }
+    return result;
+}
+
+void MapiStatistics::cache(const char *name, bool hit)
+{
+    QPair<quint64, quint64> &counts = m_caches[QString::fromAscii(name)];
+
+    if (hit) {
+        counts.first++;
+    } else {
+        counts.second++;
+    }
+}
+
+void MapiStatistics::synced(const Akonadi::Collection &collection, unsigned added, unsigned changed, unsigned deleted, unsigned moved)
+{
+    MapiCollectionStatistics &current = this->collection(collection);
+
+    current.syncs++;
+    current.added += added;
+    current.changed += changed;
+    current.deleted += deleted;
+    current.moved += moved;
+}
+
+void MapiStatistics::expired(const Akonadi::Collection &collection)
+{
+    this->collection(collection).deleted++;
+}
+
+void MapiStatistics::unchanged(const Akonadi::Collection &collection)
+{
+    MapiCollectionStatistics &current = this->collection(collection);
+
+    current.syncs++;
+    current.unchanged++;
+}
+
+void MapiStatistics::operation(Operation operation, const Akonadi::Collection &collection, quint64 latency, quint64 calls, quint64 bytes)
+{
+    MapiCollectionStatistics &current = this->collection(collection);
+
+    current.calls += calls;
+    current.bytes += bytes;
+    switch (operation) {
+    case RetrieveItem:
+        current.retrieveItem.record(latency);
+        m_retrieveItem.record(latency);
+        break;
+    case RetrieveItems:
+        current.retrieveItems.record(latency);
+        m_retrieveItems.record(latency);
+        break;
+    }
+}
+
+QStringList MapiStatistics::report() const
+{
+    QStringList result;
+
+    result << QString::fromAscii("retrieveItem %1").arg(m_retrieveItem.toString());
+    result << QString::fromAscii("retrieveItems %1").arg(m_retrieveItems.toString());
+
+    QMap<Akonadi::Collection::Id, MapiCollectionStatistics>::const_iterator i;
+    for (i = m_collections.constBegin(); i != m_collections.constEnd(); ++i) {
+        const MapiCollectionStatistics &current = i.value();
+
+        result << QString::fromAscii("collection %1 %2 syncs=%3 unchanged=%4 added=%5 changed=%6 deleted=%7 moved=%8 calls=%9 bytes=%10").
+            arg(i.key()).arg(current.name).arg(current.syncs).arg(current.unchanged).arg(current.added).
+            arg(current.changed).arg(current.deleted).arg(current.moved).arg(current.calls).arg(current.bytes);
+        if (current.retrieveItem.count()) {
+            result << QString::fromAscii("collection %1 retrieveItem %2").arg(i.key()).arg(current.retrieveItem.toString());
+        }
+        if (current.retrieveItems.count()) {
+            result << QString::fromAscii("collection %1 retrieveItems %2").arg(i.key()).arg(current.retrieveItems.toString());
+        }
+    }
+
+    QMap<QString, QPair<quint64, quint64> >::const_iterator j;
+    for (j = m_caches.constBegin(); j != m_caches.constEnd(); ++j) {
+        quint64 lookups = j.value().first + j.value().second;
+
+        result << QString::fromAscii("cache %1 hits=%2 misses=%3 ratio=%4").arg(j.key()).
+            arg(j.value().first).arg(j.value().second).
+            arg(lookups ? (double)j.value().first / lookups : 0.0, 0, 'f', 3);
+    }
+
+    result << QString::fromAscii("calls total=%1 bytes=%2").arg(MapiTracer::calls()).arg(MapiTracer::bytes());
+    for (int k = 0; k < MapiTracer::Operations; k++) {
+        MapiTracer::Operation operation = (MapiTracer::Operation)k;
+
+        if (MapiTracer::calls(operation)) {
+            result << QString::fromAscii("call %1 %2").arg(QString::fromAscii(MapiTracer::name(operation))).
+                arg(MapiTracer::calls(operation));
+        }
+    }
+    return result;
+}
+
+void MapiStatistics::reset()
+{
+    m_collections.clear();
+    m_caches.clear();
+    m_retrieveItem = MapiHistogram();
+    m_retrieveItems = MapiHistogram();
+}
+
+MapiLatency::MapiLatency(MapiStatistics *statistics, MapiStatistics::Operation operation, const Akonadi::Collection &collection) :
+    m_statistics(statistics),
+    m_operation(operation),
+    m_collection(collection),
+    m_calls(MapiTracer::calls()),
+    m_bytes(MapiTracer::bytes())
+{
+    m_timer.start();
+}
+
+MapiLatency::~MapiLatency()
+{
+    m_statistics->operation(m_operation, m_collection, m_timer.nsecsElapsed() / 1000,
+                            MapiTracer::calls() - m_calls, MapiTracer::bytes() - m_bytes);
+}
+
+#include "mapistatistics.moc"
@@ -0,0 +1,178 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPISTATISTICS_H
+#define MAPISTATISTICS_H
+
+#include <QElapsedTimer>
+#include <QMap>
+#include <QObject>
+#include <QPair>
+#include <QStringList>
+#include <QVector>
+
+#include <akonadi/collection.h>
+
+/**
+ * A histogram of latencies, in the style of HDR histograms: each power of
+ * two is split into a few linear buckets, so that any value is recorded to
+ * within 12.5% in constant space.
+ */
+class MapiHistogram
+{
+public:
+    MapiHistogram();
+
+    void record(quint64 value);
+    quint64 count() const;
+
+    /**
+     * The value below which the given percentage of recorded values lie.
+     */
+    quint64 percentile(unsigned percent) const;
+
+    /**
+     * The count and 50th, 95th and 99th percentiles, formatted.
+     */
+    QString toString() const;
+
+private:
+    QVector<quint32> m_buckets;
+    quint64 m_count;
+
+    static int bucket(quint64 value);
+    static quint64 value(int bucket);
+};
+
+/**
+ * What has been done with one collection.
+ */
+class MapiCollectionStatistics
+{
+public:
+    MapiCollectionStatistics();
+
+    QString name;
+    quint64 syncs;
+    quint64 unchanged;
+    quint64 added;
+    quint64 changed;
+    quint64 deleted;
+    quint64 moved;
+
+    /**
+     * libmapi calls made, and the bytes they streamed.
+     */
+    quint64 calls;
+    quint64 bytes;
+
+    MapiHistogram retrieveItem;
+    MapiHistogram retrieveItems;
+};
+
+/**
+ * Running statistics for a resource, for monitoring without reading debug
+ * logs. They are reported over D-Bus.
+ */
+class MapiStatistics : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.Akonadi.Exchange.Statistics")
+
+public:
+    enum Operation
+    {
+        RetrieveItem,
+        RetrieveItems
+    };
+
+    MapiStatistics(QObject *parent = 0);
+
+    /**
+     * Count a cache lookup. Caches are reported with their hit ratio.
+     */
+    void cache(const char *name, bool hit);
+
+    /**
+     * Count the outcome of a sync.
+     *
+     * @param moved     How many items were moved in from other collections.
+     */
+    void synced(const Akonadi::Collection &collection, unsigned added, unsigned changed, unsigned deleted, unsigned moved);
+
+    /**
+     * Count an item deleted from a collection once it was clear that it had
+     * not been moved.
+     */
+    void expired(const Akonadi::Collection &collection);
+
+    /**
+     * Count a sync which found the collection unchanged.
+     */
+    void unchanged(const Akonadi::Collection &collection);
+
+    /**
+     * Count an operation on a collection.
+     *
+     * @param latency   How long the operation took, in microseconds.
+     * @param calls     How many libmapi calls it made.
+     * @param bytes     How many bytes those calls streamed.
+     */
+    void operation(Operation operation, const Akonadi::Collection &collection, quint64 latency, quint64 calls, quint64 bytes);
+
+public Q_SLOTS:
+    /**
+     * The statistics, one line per operation, collection, cache and
+     * libmapi call.
+     */
+    Q_SCRIPTABLE QStringList report() const;
+
+    Q_SCRIPTABLE void reset();
+
+private:
+    QMap<Akonadi::Collection::Id, MapiCollectionStatistics> m_collections;
+    QMap<QString, QPair<quint64, quint64> > m_caches;
+    MapiHistogram m_retrieveItem;
+    MapiHistogram m_retrieveItems;
+
+    MapiCollectionStatistics &collection(const Akonadi::Collection &collection);
+};
+
+/**
+ * Times an operation from construction to destruction, and counts the
+ * libmapi calls it makes:
+ *
+ *      MapiLatency latency(m_statistics, MapiStatistics::RetrieveItem, item.parentCollection());
+ */
+class MapiLatency
+{
+public:
+    MapiLatency(MapiStatistics *statistics, MapiStatistics::Operation operation, const Akonadi::Collection &collection);
+    ~MapiLatency();
+
+private:
+    MapiStatistics *m_statistics;
+    MapiStatistics::Operation m_operation;
+    Akonadi::Collection m_collection;
+    QElapsedTimer m_timer;
+    quint64 m_calls;
+    quint64 m_bytes;
+};
+
+#endif // MAPISTATISTICS_H
@@ -0,0 +1,245 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapisyncindex.h"
+
+#include <string.h>
+#include <QtAlgorithms>
+#include <KDebug>
+#include <KSaveFile>
+#include <KStandardDirs>
+
+#include "mapiobjects.h"
+
+#define SYNC_INDEX_MAGIC 0x4d534931 // "MSI1"
+
+struct MapiSyncIndexHeader
+{
+    quint32 magic;
+    quint32 count;
+    quint32 pool;
+    quint32 reserved;
+};
+
+MapiSyncIndex::MapiSyncIndex(const QString &fileName) :
+    m_file(fileName),
+    m_data(0),
+    m_size(0)
+{
+    // All empty search keys share the first pool entry.
+    quint32 length = 0;
+    m_pool.append((const char *)&length, sizeof(length));
+}
+
+MapiSyncIndex::~MapiSyncIndex()
+{
+    close();
+}
+
+QString MapiSyncIndex::fileName(const QString &resource, qint64 collection)
+{
+    return KStandardDirs::locateLocal("data", QString::fromAscii("akonadi_exchange/%1/%2.sync").arg(resource).arg(collection));
+}
+
+void MapiSyncIndex::close()
+{
+    if (m_data) {
+        m_file.unmap(m_data);
+        m_data = 0;
+        m_size = 0;
+    }
+    m_file.close();
+}
+
+bool MapiSyncIndex::open()
+{
+    close();
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        // Nothing saved yet.
+        return false;
+    }
+    m_size = m_file.size();
+    m_data = m_file.map(0, m_size);
+    if (!m_data) {
+        kError() << "cannot map sync index:" << m_file.fileName();
+        close();
+        return false;
+    }
+    const MapiSyncIndexHeader *header = (const MapiSyncIndexHeader *)m_data;
+    if ((m_size < (qint64)sizeof(*header)) ||
+        (header->magic != SYNC_INDEX_MAGIC) ||
+        (header->pool != sizeof(*header) + header->count * sizeof(MapiSyncIndexRecord)) ||
+        (header->pool + sizeof(quint32) > m_size)) {
+        kError() << "ignoring bad sync index:" << m_file.fileName();
+        close();
+        return false;
+    }
+
+    // Check the records are in order, and their search keys are in bounds.
+    const MapiSyncIndexRecord *records = (const MapiSyncIndexRecord *)(m_data + sizeof(*header));
+    qint64 poolSize = m_size - header->pool;
+    for (quint32 i = 0; i < header->count; i++) {
+        if ((i && (records[i - 1].mid >= records[i].mid)) ||
+            (records[i].searchKey + sizeof(quint32) > poolSize)) {
+            kError() << "ignoring inconsistent sync index:" << m_file.fileName();
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+int MapiSyncIndex::size() const
+{
+    if (!m_data) {
+        return 0;
+    }
+    return ((const MapiSyncIndexHeader *)m_data)->count;
+}
+
+const MapiSyncIndexRecord &MapiSyncIndex::at(int i) const
+{
+    const MapiSyncIndexRecord *records = (const MapiSyncIndexRecord *)(m_data + sizeof(MapiSyncIndexHeader));
+    return records[i];
+}
+
+QByteArray MapiSyncIndex::searchKey(int i) const
+{
+    const MapiSyncIndexHeader *header = (const MapiSyncIndexHeader *)m_data;
+    const uchar *entry = m_data + header->pool + at(i).searchKey;
+    quint32 length;
+
+    memcpy(&length, entry, sizeof(length));
+    if (entry + sizeof(length) + length > m_data + m_size) {
+        return QByteArray();
+    }
+    return QByteArray((const char *)entry + sizeof(length), length);
+}
+
+void MapiSyncIndex::append(const MapiSyncIndexRecord &record, const QByteArray &searchKey)
+{
+    MapiSyncIndexRecord copy = record;
+    quint32 length = searchKey.size();
+
+    if (length) {
+        copy.searchKey = m_pool.size();
+        m_pool.append((const char *)&length, sizeof(length));
+        m_pool.append(searchKey);
+    } else {
+        copy.searchKey = 0;
+    }
+    copy.reserved = 0;
+    m_records.append(copy);
+}
+
+/**
+ * Order records by message id.
+ */
+static bool midLessThan(const MapiSyncIndexRecord &left, const MapiSyncIndexRecord &right)
+{
+    return left.mid < right.mid;
+}
+
+bool MapiSyncIndex::commit()
+{
+    MapiSyncIndexHeader header;
+
+    // A sync which fell back to reading the contents unsorted can add a few
+    // records late.
+    for (int i = 1; i < m_records.size(); i++) {
+        if (m_records.at(i - 1).mid > m_records.at(i).mid) {
+            qStableSort(m_records.begin(), m_records.end(), midLessThan);
+            break;
+        }
+    }
+
+    header.magic = SYNC_INDEX_MAGIC;
+    header.count = m_records.size();
+    header.pool = sizeof(header) + m_records.size() * sizeof(MapiSyncIndexRecord);
+    header.reserved = 0;
+
+    // Write a new file and then rename it, so that we never see a partial
+    // index.
+    KSaveFile file(m_file.fileName());
+    if (!file.open()) {
+        kError() << "cannot write sync index:" << m_file.fileName() << file.errorString();
+        return false;
+    }
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)m_records.constData(), m_records.size() * sizeof(MapiSyncIndexRecord));
+    file.write(m_pool);
+    if (!file.finalize()) {
+        kError() << "cannot write sync index:" << m_file.fileName() << file.errorString();
+        return false;
+    }
+    m_records.clear();
+    m_pool.resize(sizeof(quint32));
+    return open();
+}
+
+/**
+ * 64-bit FNV-1a, which unlike qHash() is guaranteed not to change under us.
+ */
+quint64 MapiSyncIndex::hash(const QByteArray &data)
+{
+    if (data.isEmpty()) {
+        return 0;
+    }
+
+    quint64 result = Q_UINT64_C(14695981039346656037);
+
+    for (int i = 0; i < data.size(); i++) {
+        result ^= (uchar)data.at(i);
+        result *= Q_UINT64_C(1099511628211);
+    }
+    return result;
+}
+
+MapiSyncMerge::MapiSyncMerge(const MapiContents &contents, const MapiSyncIndex &index, int &k, bool last) :
+    m_contents(contents),
+    m_index(index),
+    m_order(contents.order()),
+    m_s(0),
+    m_k(k),
+    m_last(last),
+    m_row(-1),
+    m_record(-1)
+{
+}
+
+MapiSyncMerge::Step MapiSyncMerge::next()
+{
+    bool rows = m_s < m_order.size();
+    bool records = m_k < m_index.size();
+
+    if (!rows && !(m_last && records)) {
+        return Done;
+    }
+    if (rows && (!records || (m_contents.mid(m_order.at(m_s)) < m_index.at(m_k).mid))) {
+        m_row = m_order.at(m_s++);
+        return New;
+    }
+    if (!rows || (m_index.at(m_k).mid < m_contents.mid(m_order.at(m_s)))) {
+        m_record = m_k++;
+        return Gone;
+    }
+    m_row = m_order.at(m_s++);
+    m_record = m_k++;
+    return Both;
+}
@@ -0,0 +1,198 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPISYNCINDEX_H
+#define MAPISYNCINDEX_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <QVector>
+
+class MapiContents;
+
+/**
+ * What we know about one item in a collection, as of the last sync.
+ */
+struct MapiSyncIndexRecord
+{
+    enum Flags
+    {
+        /**
+         * The full payload has been retrieved, not just the envelope.
+         */
+        PayloadPresent = 1,
+
+        /**
+         * The record was rebuilt from Akonadi, so @ref modified is the
+         * local modification time rather than the server's.
+         */
+        Rebuilt = 2
+    };
+
+    quint64 mid;
+    qint64 itemId;
+    qint64 modified;
+    quint64 changeKey;
+    quint32 searchKey;
+    quint32 revision;
+    quint32 flags;
+    quint32 reserved;
+};
+
+/**
+ * A per-collection index of the items the resource has handed to Akonadi, so
+ * that a sync can be diffed without listing the collection from Akonadi. The
+ * index is a memory-mapped file holding a header, an array of records sorted
+ * by message id, and a pool of length-prefixed search keys. It is written in
+ * the native byte order, since it never leaves the machine.
+ *
+ * A new index is built up with @ref append() and replaces the old one
+ * atomically on @ref commit(), so a crash leaves the last complete index.
+ */
+class MapiSyncIndex
+{
+public:
+    MapiSyncIndex(const QString &fileName);
+    ~MapiSyncIndex();
+
+    /**
+     * The index file for a given resource and collection.
+     */
+    static QString fileName(const QString &resource, qint64 collection);
+
+    /**
+     * Map the existing index.
+     *
+     * @return False if there is no usable index, in which case it should be
+     * rebuilt.
+     */
+    bool open();
+
+    /**
+     * How many records are in the existing index?
+     */
+    int size() const;
+
+    /**
+     * Fetch a record from the existing index. The records are in ascending
+     * order of message id.
+     */
+    const MapiSyncIndexRecord &at(int i) const;
+
+    /**
+     * The search key of a record in the existing index.
+     */
+    QByteArray searchKey(int i) const;
+
+    /**
+     * Add a record to the new index. Records should be added in ascending
+     * order of message id; any which are not are put in order on
+     * @ref commit().
+     */
+    void append(const MapiSyncIndexRecord &record, const QByteArray &searchKey);
+
+    /**
+     * Replace the existing index with the new one.
+     */
+    bool commit();
+
+    /**
+     * A hash of a change key, as kept in the index, or 0 if there is no
+     * change key, so that two items without one never look the same.
+     */
+    static quint64 hash(const QByteArray &data);
+
+private:
+    QFile m_file;
+    uchar *m_data;
+    qint64 m_size;
+    QVector<MapiSyncIndexRecord> m_records;
+    QByteArray m_pool;
+
+    void close();
+};
+
+/**
+ * How many rows of a contents table to fetch at a time, and how many items
+ * to hand to Akonadi at a time.
+ */
+#ifndef CONTENTS_BATCH
+#define CONTENTS_BATCH 500
+#endif
+
+/**
+ * Walks a batch of folder contents and a sync index together in message id
+ * order, as a merge join: a row which is only on the server is new, a record
+ * which is only in the index has gone, and a row and record with the same
+ * message id are the same item. Unless this is the last batch, records
+ * beyond the batch are left for the next one.
+ */
+class MapiSyncMerge
+{
+public:
+    enum Step
+    {
+        Done,
+        New,
+        Gone,
+        Both
+    };
+
+    /**
+     * @param k     The next record in the index, which is advanced as
+     *              records are used.
+     * @param last  Set for the last batch, so that any records left in the
+     *              index are treated as gone.
+     */
+    MapiSyncMerge(const MapiContents &contents, const MapiSyncIndex &index, int &k, bool last);
+
+    /**
+     * Take the next step.
+     */
+    Step next();
+
+    /**
+     * The contents row of a New or Both step.
+     */
+    int row() const
+    {
+        return m_row;
+    }
+
+    /**
+     * The index record of a Gone or Both step.
+     */
+    int record() const
+    {
+        return m_record;
+    }
+
+private:
+    const MapiContents &m_contents;
+    const MapiSyncIndex &m_index;
+    QVector<int> m_order;
+    int m_s;
+    int &m_k;
+    bool m_last;
+    int m_row;
+    int m_record;
+};
+
+#endif // MAPISYNCINDEX_H
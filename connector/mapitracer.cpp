@@ -0,0 +1,174 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapitracer.h"
+
+#include <QCoreApplication>
+#include <QTextStream>
+#include <KDebug>
+#include <KSaveFile>
+#include <KStandardDirs>
+
+#include "mapidumper.h"
+
+volatile unsigned MapiTracer::s_watchers = 0;
+QElapsedTimer MapiTracer::s_clock;
+QAtomicInt MapiTracer::s_next(0);
+MapiTraceEvent MapiTracer::s_events[TRACE_EVENTS];
+quint64 MapiTracer::s_calls = 0;
+quint64 MapiTracer::s_bytes = 0;
+quint64 MapiTracer::s_counts[MapiTracer::Operations];
+
+MapiTracer::MapiTracer(QObject *parent) :
+    QObject(parent)
+{
+}
+
+const char *MapiTracer::name(Operation operation)
+{
+    static const char *names[Operations] = {
+        "GetAttachmentTable",
+        "GetContentsTable",
+        "GetDefaultFolder",
+        "GetDefaultPublicFolder",
+        "GetGALTable",
+        "GetGALTableCount",
+        "GetHierarchyTable",
+        "GetIDsFromNames",
+        "GetNamesFromIDs",
+        "GetProps",
+        "GetPropsAll",
+        "GetRecipientTable",
+        "GetStreamSize",
+        "MapiLogonEx",
+        "OpenAttach",
+        "OpenEmbeddedMessage",
+        "OpenFolder",
+        "OpenMessage",
+        "OpenMsgStore",
+        "OpenPublicFolder",
+        "OpenStream",
+        "QueryPosition",
+        "QueryRows",
+        "ReadStream",
+        "ResolveNames",
+        "Restrict",
+        "nspi_SeekEntries",
+        "SetColumns",
+        "SetProps",
+        "SortTable",
+        "Subscribe"
+    };
+
+    return names[operation];
+}
+
+void MapiTracer::record(Operation operation, mapi_id_t id, qint64 start, quint32 bytes, quint32 status)
+{
+    unsigned slot = (unsigned)s_next.fetchAndAddRelaxed(1) & (TRACE_EVENTS - 1);
+    MapiTraceEvent &event = s_events[slot];
+
+    event.operation = name(operation);
+    event.id = id;
+    event.start = start;
+    event.duration = now() - start;
+    event.bytes = bytes;
+    event.status = status;
+}
+
+void MapiTracer::setWatched(Watcher watcher, bool watched)
+{
+    if (watched && !s_clock.isValid()) {
+        s_clock.start();
+    }
+    if (watched) {
+        s_watchers |= watcher;
+    } else {
+        s_watchers &= ~watcher;
+    }
+}
+
+void MapiTracer::watched(Operation operation, mapi_id_t id, qint64 start, quint32 bytes, quint32 status)
+{
+    if (s_watchers & Tracing) {
+        record(operation, id, start, bytes, status);
+    }
+    if (s_watchers & Dumping) {
+        MapiDumper::capture(name(operation));
+    }
+}
+
+void MapiTracer::setEnabled(bool enabled)
+{
+    setWatched(Tracing, enabled);
+    kDebug() << "tracing:" << enabled;
+}
+
+bool MapiTracer::enabled() const
+{
+    return s_watchers & Tracing;
+}
+
+void MapiTracer::clear()
+{
+    s_next = 0;
+}
+
+QString MapiTracer::dump(const QString &fileName)
+{
+    QString name = fileName;
+
+    if (name.isEmpty()) {
+        name = KStandardDirs::locateLocal("data", QString::fromAscii("akonadi_exchange/trace-%1.json").
+                                          arg(QCoreApplication::applicationPid()));
+    }
+    KSaveFile file(name);
+    if (!file.open()) {
+        kError() << "cannot write trace:" << name << file.errorString();
+        return QString();
+    }
+
+    // Calls still being recorded may be torn, which is fine for a trace.
+    unsigned next = (unsigned)(int)s_next;
+    unsigned count = qMin(next, (unsigned)TRACE_EVENTS);
+    QTextStream stream(&file);
+    stream << "{\"traceEvents\":[";
+    for (unsigned i = next - count; i != next; i++) {
+        const MapiTraceEvent &event = s_events[i & (TRACE_EVENTS - 1)];
+
+        if (i != next - count) {
+            stream << ",";
+        }
+        stream << "\n{\"name\":\"" << event.operation << "\",\"cat\":\"mapi\",\"ph\":\"X\"" <<
+            ",\"ts\":" << event.start << ",\"dur\":" << event.duration <<
+            ",\"pid\":" << QCoreApplication::applicationPid() << ",\"tid\":1" <<
+            ",\"args\":{\"id\":\"" << QString::number(event.id, 16) << "\",\"bytes\":" << event.bytes <<
+            ",\"status\":\"0x" << QString::number(event.status, 16) << "\"}}";
+    }
+    stream << "\n]}\n";
+    stream.flush();
+    if (!file.finalize()) {
+        kError() << "cannot write trace:" << name << file.errorString();
+        return QString();
+    }
+    kDebug() << "wrote trace:" << name << "calls:" << count;
+    return name;
+}
+
+#include "mapitracer.moc"
@@ -0,0 +1,258 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPITRACER_H
+#define MAPITRACER_H
+
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QString>
+
+extern "C" {
+// libmapi is a C library and must therefore be included that way
+// otherwise we'll get linker errors due to C++ name mangling
+#include <libmapi/libmapi.h>
+}
+
+/**
+ * The number of calls remembered by the tracer. Must be a power of 2.
+ */
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 8192
+#endif
+
+/**
+ * One traced libmapi call.
+ */
+struct MapiTraceEvent
+{
+    const char *operation;
+    mapi_id_t id;
+    qint64 start;
+    qint32 duration;
+    quint32 bytes;
+    quint32 status;
+};
+
+/**
+ * A tracer for libmapi calls. When enabled, each call is recorded into a
+ * fixed-size ring buffer, which can be written out as a Chrome trace (for
+ * about:tracing or Perfetto). When disabled, a traced call only bumps the
+ * counters kept for @ref MapiStatistics: a slot per operation, and one test
+ * of a flag.
+ *
+ * The tracer is controlled over D-Bus. Its state is static, so that any
+ * object can trace without being handed a tracer.
+ */
+class MapiTracer : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.Akonadi.Exchange.Trace")
+
+public:
+    /**
+     * The libmapi calls which are traced. Each has its own counter.
+     */
+    enum Operation
+    {
+        GetAttachmentTable,
+        GetContentsTable,
+        GetDefaultFolder,
+        GetDefaultPublicFolder,
+        GetGALTable,
+        GetGALTableCount,
+        GetHierarchyTable,
+        GetIDsFromNames,
+        GetNamesFromIDs,
+        GetProps,
+        GetPropsAll,
+        GetRecipientTable,
+        GetStreamSize,
+        MapiLogonEx,
+        OpenAttach,
+        OpenEmbeddedMessage,
+        OpenFolder,
+        OpenMessage,
+        OpenMsgStore,
+        OpenPublicFolder,
+        OpenStream,
+        QueryPosition,
+        QueryRows,
+        ReadStream,
+        ResolveNames,
+        Restrict,
+        SeekEntries,
+        SetColumns,
+        SetProps,
+        SortTable,
+        Subscribe,
+        Operations
+    };
+
+    MapiTracer(QObject *parent = 0);
+
+    static const char *name(Operation operation);
+
+    /**
+     * Whatever watches the calls: the tracer itself, or @ref MapiDumper.
+     */
+    enum Watcher
+    {
+        Tracing = 1,
+        Dumping = 2
+    };
+
+    static bool isWatched()
+    {
+        return s_watchers;
+    }
+
+    static void setWatched(Watcher watcher, bool watched);
+
+    /**
+     * Hand a watched call to whatever is watching.
+     */
+    static void watched(Operation operation, mapi_id_t id, qint64 start, quint32 bytes, quint32 status);
+
+    /**
+     * Microseconds since the tracer was first enabled.
+     */
+    static qint64 now()
+    {
+        return s_clock.nsecsElapsed() / 1000;
+    }
+
+    /**
+     * Record a call. Slots are claimed with an atomic increment, so this
+     * needs no lock.
+     */
+    static void record(Operation operation, mapi_id_t id, qint64 start, quint32 bytes, quint32 status);
+
+    /**
+     * Count a call, whether or not tracing is enabled.
+     */
+    static void count(Operation operation, quint32 bytes)
+    {
+        s_counts[operation]++;
+        s_calls++;
+        s_bytes += bytes;
+    }
+
+    /**
+     * How many calls have been made, and how many bytes they moved.
+     */
+    static quint64 calls()
+    {
+        return s_calls;
+    }
+
+    static quint64 bytes()
+    {
+        return s_bytes;
+    }
+
+    /**
+     * How many calls have been made of the given operation.
+     */
+    static quint64 calls(Operation operation)
+    {
+        return s_counts[operation];
+    }
+
+public Q_SLOTS:
+    Q_SCRIPTABLE void setEnabled(bool enabled);
+    Q_SCRIPTABLE bool enabled() const;
+
+    /**
+     * Write the calls recorded so far as a Chrome trace.
+     *
+     * @param fileName  Where to write the trace, or empty for a file in the
+     *                  local data directory.
+     * @return The name of the file written, or empty on error.
+     */
+    Q_SCRIPTABLE QString dump(const QString &fileName);
+
+    /**
+     * Forget the calls recorded so far.
+     */
+    Q_SCRIPTABLE void clear();
+
+private:
+    static volatile unsigned s_watchers;
+    static QElapsedTimer s_clock;
+    static QAtomicInt s_next;
+    static MapiTraceEvent s_events[TRACE_EVENTS];
+    static quint64 s_calls;
+    static quint64 s_bytes;
+    static quint64 s_counts[Operations];
+};
+
+/**
+ * Traces a libmapi call, from when the MapiTrace is constructed to when the
+ * status is passed to it:
+ *
+ *      MapiTrace trace(MapiTracer::GetProps, m_id.second);
+ *      if (MAPI_E_SUCCESS != trace(GetProps(...))) {
+ *
+ * A function making several calls can reuse one MapiTrace, using
+ * @ref restart() before each subsequent call.
+ */
+class MapiTrace
+{
+public:
+    MapiTrace(MapiTracer::Operation operation, mapi_id_t id = 0) :
+        m_id(id),
+        m_start(0)
+    {
+        restart(operation);
+    }
+
+    void restart(MapiTracer::Operation operation)
+    {
+        m_operation = operation;
+        m_traced = MapiTracer::isWatched();
+        if (m_traced) {
+            m_start = MapiTracer::now();
+        }
+    }
+
+    /**
+     * Record the call.
+     *
+     * @param bytes     How much data the call moved, if known.
+     * @return @p status, for convenience.
+     */
+    MAPISTATUS operator()(MAPISTATUS status, unsigned bytes = 0)
+    {
+        MapiTracer::count(m_operation, bytes);
+        if (m_traced) {
+            MapiTracer::watched(m_operation, m_id, m_start, bytes, status);
+        }
+        return status;
+    }
+
+private:
+    MapiTracer::Operation m_operation;
+    bool m_traced;
+    mapi_id_t m_id;
+    qint64 m_start;
+};
+
+#endif // MAPITRACER_H
@@ -0,0 +1,282 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <qtest_kde.h>
+
+#include <QDir>
+#include <QFile>
+#include <string.h>
+
+#include "mapiobjects.h"
+#include "mapisyncindex.h"
+
+/**
+ * Fill a contents snapshot with synthetic rows, as the contents table of a
+ * mail folder would give them: a message id, modification time, change key
+ * and search key each.
+ */
+static void contentsFill(MapiContents &contents, const QVector<mapi_id_t> &mids)
+{
+    uchar changeKey[22];
+    uchar searchKey[16];
+    SPropValue values[4];
+    SRow row;
+
+    memset(changeKey, 0x11, sizeof(changeKey));
+    memset(searchKey, 0x22, sizeof(searchKey));
+    values[0].ulPropTag = PidTagMid;
+    values[1].ulPropTag = PidTagLastModificationTime;
+    values[1].value.ft.dwLowDateTime = 0xd53e8000;
+    values[1].value.ft.dwHighDateTime = 0x01d00000;
+    values[2].ulPropTag = PidTagChangeKey;
+    values[2].value.bin.cb = sizeof(changeKey);
+    values[2].value.bin.lpb = changeKey;
+    values[3].ulPropTag = PidTagSearchKey;
+    values[3].value.bin.cb = sizeof(searchKey);
+    values[3].value.bin.lpb = searchKey;
+    row.ulAdrEntryPad = 0;
+    row.cValues = 4;
+    row.lpProps = values;
+    foreach (mapi_id_t mid, mids) {
+        values[0].value.d = mid;
+        memcpy(changeKey + 16, &mid, 6);
+        memcpy(searchKey, &mid, sizeof(mid));
+        contents.append(row);
+    }
+}
+
+/**
+ * Message ids for a folder, in ascending order, or shuffled as a server
+ * which cannot sort would return them.
+ */
+static QVector<mapi_id_t> contentsMids(int rows, bool sorted)
+{
+    QVector<mapi_id_t> mids(rows);
+
+    for (int i = 0; i < rows; i++) {
+        mids[i] = Q_UINT64_C(0x0001000000000000) + (mapi_id_t)i * 3;
+    }
+    if (!sorted) {
+        qsrand(rows);
+        for (int i = rows - 1; i > 0; i--) {
+            qSwap(mids[i], mids[qrand() % (i + 1)]);
+        }
+    }
+    return mids;
+}
+
+/**
+ * Times the contents snapshot, and its merge against a sync index, on large
+ * folders, and checks what the snapshot costs in memory and that the merge
+ * gives the same answer however it is batched.
+ */
+class MapiContentsTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void fill_data();
+    void fill();
+    void order_data();
+    void order();
+    void merge_data();
+    void merge();
+    void commit();
+};
+
+void MapiContentsTest::fill_data()
+{
+    QTest::addColumn<int>("rows");
+
+    QTest::newRow("10k") << 10000;
+    QTest::newRow("100k") << 100000;
+    QTest::newRow("500k") << 500000;
+}
+
+void MapiContentsTest::fill()
+{
+    QFETCH(int, rows);
+    QVector<mapi_id_t> mids = contentsMids(rows, true);
+    qint64 memory = 0;
+
+    QBENCHMARK {
+        MapiContents contents;
+
+        contentsFill(contents, mids);
+        memory = contents.memoryUsage();
+    }
+
+    // Three words of index and two keys a row, with room for the arrays to
+    // have grown by up to double.
+    QVERIFY(memory > 0);
+    QVERIFY(memory < (qint64)rows * 192);
+}
+
+void MapiContentsTest::order_data()
+{
+    QTest::addColumn<int>("rows");
+    QTest::addColumn<bool>("sorted");
+
+    QTest::newRow("10k sorted") << 10000 << true;
+    QTest::newRow("10k unsorted") << 10000 << false;
+    QTest::newRow("100k sorted") << 100000 << true;
+    QTest::newRow("100k unsorted") << 100000 << false;
+    QTest::newRow("500k sorted") << 500000 << true;
+    QTest::newRow("500k unsorted") << 500000 << false;
+}
+
+void MapiContentsTest::order()
+{
+    QFETCH(int, rows);
+    QFETCH(bool, sorted);
+    MapiContents contents;
+    QVector<int> result;
+
+    contentsFill(contents, contentsMids(rows, sorted));
+    QCOMPARE(contents.size(), rows);
+    QCOMPARE(contents.isSorted(), sorted);
+    QBENCHMARK {
+        result = contents.order();
+    }
+    QCOMPARE(result.size(), rows);
+    for (int i = 1; i < result.size(); i++) {
+        QVERIFY(contents.mid(result.at(i - 1)) < contents.mid(result.at(i)));
+    }
+}
+
+void MapiContentsTest::merge_data()
+{
+    QTest::addColumn<int>("rows");
+    QTest::addColumn<int>("batch");
+
+    QTest::newRow("10k") << 10000 << 0;
+    QTest::newRow("10k batched") << 10000 << CONTENTS_BATCH;
+    QTest::newRow("100k") << 100000 << 0;
+    QTest::newRow("100k batched") << 100000 << CONTENTS_BATCH;
+    QTest::newRow("500k") << 500000 << 0;
+    QTest::newRow("500k batched") << 500000 << CONTENTS_BATCH;
+    QTest::newRow("1M") << 1000000 << 0;
+}
+
+/**
+ * Merge contents against an index, as a sync does, either all at once or a
+ * batch at a time, and count the steps of each kind.
+ */
+static void mergeCount(const QList<MapiContents *> &batches, const MapiSyncIndex &index, int &added, int &gone, int &both)
+{
+    int k = 0;
+
+    added = gone = both = 0;
+    for (int i = 0; i < batches.size(); i++) {
+        MapiSyncMerge merge(*batches.at(i), index, k, i == batches.size() - 1);
+        MapiSyncMerge::Step step;
+
+        while ((step = merge.next()) != MapiSyncMerge::Done) {
+            switch (step) {
+            case MapiSyncMerge::New:
+                added++;
+                break;
+            case MapiSyncMerge::Gone:
+                gone++;
+                break;
+            default:
+                both++;
+                break;
+            }
+        }
+    }
+}
+
+void MapiContentsTest::merge()
+{
+    QFETCH(int, rows);
+    QFETCH(int, batch);
+
+    // The index knows every third id. Since then, one item in ten has gone
+    // from the server, and another has arrived next to it.
+    QVector<mapi_id_t> mids;
+    QString fileName = QDir::temp().filePath(QString::fromAscii("mapicontentstest-%1.sync").arg(rows));
+    MapiSyncIndex index(fileName);
+    mids.reserve(rows);
+    for (int i = 0; i < rows; i++) {
+        MapiSyncIndexRecord record;
+
+        memset(&record, 0, sizeof(record));
+        record.mid = (mapi_id_t)i * 3;
+        record.itemId = i;
+        record.revision = 1;
+        index.append(record, QByteArray());
+        mids.append((i % 10) ? record.mid : record.mid + 1);
+    }
+    QVERIFY(index.commit());
+
+    // Records beyond each batch must be carried forward to the next one,
+    // not taken for gone.
+    QList<MapiContents *> batches;
+    if (!batch) {
+        batch = rows;
+    }
+    for (int i = 0; i < rows; i += batch) {
+        batches << new MapiContents();
+        contentsFill(*batches.last(), mids.mid(i, batch));
+    }
+
+    int added = 0;
+    int gone = 0;
+    int both = 0;
+    QBENCHMARK {
+        mergeCount(batches, index, added, gone, both);
+    }
+    qDeleteAll(batches);
+    QFile::remove(fileName);
+    QCOMPARE(added, rows / 10);
+    QCOMPARE(gone, rows / 10);
+    QCOMPARE(both, rows - rows / 10);
+}
+
+void MapiContentsTest::commit()
+{
+    // A sync which falls back to unsorted contents can append records out
+    // of order, and the index must still come out sorted.
+    QString fileName = QDir::temp().filePath(QString::fromAscii("mapicontentstest-commit.sync"));
+    MapiSyncIndex index(fileName);
+    mapi_id_t mids[] = { 30, 60, 90, 15, 45 };
+    for (unsigned i = 0; i < sizeof(mids) / sizeof(mids[0]); i++) {
+        MapiSyncIndexRecord record;
+
+        memset(&record, 0, sizeof(record));
+        record.mid = mids[i];
+        record.itemId = i;
+        index.append(record, QByteArray::number((qulonglong)mids[i]));
+    }
+    QVERIFY(index.commit());
+    QCOMPARE(index.size(), 5);
+    for (int i = 0; i < index.size(); i++) {
+        QCOMPARE(index.searchKey(i), QByteArray::number((qulonglong)index.at(i).mid));
+        if (i) {
+            QVERIFY(index.at(i - 1).mid < index.at(i).mid);
+        }
+    }
+    QFile::remove(fileName);
+}
+
+QTEST_KDEMAIN_CORE(MapiContentsTest)
+
+#include "mapicontentstest.moc"
@@ -0,0 +1,180 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <qtest_kde.h>
+
+#include <QRegExp>
+#include <kpimutils/email.h>
+
+#include "mapiobjects.h"
+
+/**
+ * The QRegExp-based mapiExtractEmail() which the hand-written scanners
+ * replaced, kept as the reference for a differential test.
+ */
+static QString referenceExtractEmail(const QString &source, const QByteArray &type, bool emptyDefault)
+{
+    QString email;
+
+    if (!emptyDefault) {
+        email = source;
+    }
+    if (type == "SMTP") {
+        QString name;
+
+        if (!KPIMUtils::extractEmailAddressAndName(source, email, name)) {
+            static QRegExp firstRE(QString::fromAscii("[(<]"));
+            static QRegExp lastRE(QString::fromAscii("[)>]"));
+
+            int first = source.lastIndexOf(firstRE);
+            int last = source.indexOf(lastRE, first);
+
+            if ((first > -1) && (last > first + 1)) {
+                email = source.mid(first + 1, last - first - 1);
+            }
+        }
+    } else if (type == "EX") {
+        int lastCn = source.lastIndexOf(QString::fromAscii("/CN="), -1, Qt::CaseInsensitive);
+
+        if (lastCn > -1) {
+            email = source.mid(lastCn + 4);
+        }
+    }
+    return email;
+}
+
+/**
+ * Addresses as found in PidTagSenderEmailAddress, recipient tables and the
+ * like, including malformed ones.
+ */
+static const char *corpus[] = {
+    // SMTP.
+    "user@example.com",
+    "first.last+tag@sub.example.co.uk",
+    "User Name <user@example.com>",
+    "\"Last, First\" <first.last@example.com>",
+    "<user@example.com>",
+    "user@example.com (Comment)",
+    "  user@example.com  ",
+    "user@[10.0.0.1]",
+    "Name <user@example.com>, Other <other@example.com>",
+    "blah (blah) <blah> <result>",
+    // EX.
+    "/O=ORG/OU=FIRST ADMINISTRATIVE GROUP/CN=RECIPIENTS/CN=jdoe",
+    "/o=org/ou=exchange administrative group (fydibohf23spdlt)/cn=recipients/cn=jdoe",
+    "/O=ORG/OU=EXCHANGE/CN=RECIPIENTS/cN=Mixed.Case",
+    "/O=ORG/OU=EXCHANGE/CN=RECIPIENTS/CN=",
+    "/CN=",
+    "/CN",
+    // Malformed.
+    "",
+    "no address here",
+    "<>",
+    "()",
+    "(only a comment)",
+    "broken <user@example.com",
+    "broken user@example.com>",
+    "a@b@c",
+    "<a@b> trailing",
+    "\"unterminated <user@example.com>",
+    "back\\slash <user@example.com>",
+    "semi;colon <user@example.com>",
+    0
+};
+
+class MapiExtractTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void extractEmail_data();
+    void extractEmail();
+    void extractEmailBenchmark_data();
+    void extractEmailBenchmark();
+};
+
+void MapiExtractTest::extractEmail_data()
+{
+    static const char *types[] = { "SMTP", "EX", "X500", "" };
+
+    QTest::addColumn<QString>("source");
+    QTest::addColumn<QByteArray>("type");
+    QTest::addColumn<bool>("emptyDefault");
+
+    for (int i = 0; corpus[i]; i++) {
+        for (unsigned j = 0; j < sizeof(types) / sizeof(types[0]); j++) {
+            for (int emptyDefault = 0; emptyDefault < 2; emptyDefault++) {
+                QByteArray name = QByteArray::number(i) + ' ' + types[j] + (emptyDefault ? " empty" : "");
+
+                QTest::newRow(name.constData()) << QString::fromUtf8(corpus[i]) << QByteArray(types[j]) << (bool)emptyDefault;
+            }
+        }
+    }
+    QTest::newRow("non-ASCII SMTP") << QString::fromUtf8("N\xc3\xa4me <n\xc3\xa4me@example.com>") << QByteArray("SMTP") << false;
+    QTest::newRow("non-ASCII EX") << QString::fromUtf8("/O=ORG/CN=RECIPIENTS/CN=n\xc3\xa4me") << QByteArray("EX") << false;
+}
+
+void MapiExtractTest::extractEmail()
+{
+    QFETCH(QString, source);
+    QFETCH(QByteArray, type);
+    QFETCH(bool, emptyDefault);
+
+    QCOMPARE(mapiExtractEmail(source, type, emptyDefault), referenceExtractEmail(source, type, emptyDefault));
+}
+
+void MapiExtractTest::extractEmailBenchmark_data()
+{
+    QTest::addColumn<bool>("reference");
+
+    QTest::newRow("scanner") << false;
+    QTest::newRow("QRegExp") << true;
+}
+
+void MapiExtractTest::extractEmailBenchmark()
+{
+    QFETCH(bool, reference);
+
+    // The well-formed addresses dominate in practice.
+    QList<QPair<QString, QByteArray> > inputs;
+    for (int i = 0; corpus[i]; i++) {
+        QByteArray type = (corpus[i][0] == '/') ? "EX" : "SMTP";
+
+        inputs << qMakePair(QString::fromUtf8(corpus[i]), type);
+    }
+
+    int length = 0;
+    QBENCHMARK {
+        for (int i = 0; i < inputs.size(); i++) {
+            const QPair<QString, QByteArray> &input = inputs.at(i);
+
+            if (reference) {
+                length += referenceExtractEmail(input.first, input.second, true).length();
+            } else {
+                length += mapiExtractEmail(input.first, input.second, true).length();
+            }
+        }
+    }
+    QVERIFY(length > 0);
+}
+
+QTEST_KDEMAIN_CORE(MapiExtractTest)
+
+#include "mapiextracttest.moc"
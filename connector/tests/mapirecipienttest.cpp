@@ -0,0 +1,110 @@
+/*
+ * This file is part of the Akonadi Exchange Resource.
+ * Copyright 2013 Shaheed Haque <srhaque@theiet.org>.
+ *
+ * Akonadi Exchange Resource is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Akonadi Exchange Resource is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Akonadi Exchange Resource.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <qtest_kde.h>
+
+#include "mapiobjects.h"
+
+/**
+ * Checks and times the merging of duplicate recipients, as found on messages
+ * to large distribution lists.
+ */
+class MapiRecipientTest : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void addUniqueRecipient();
+    void addUniqueRecipientBenchmark_data();
+    void addUniqueRecipientBenchmark();
+};
+
+void MapiRecipientTest::addUniqueRecipient()
+{
+    MapiMessage message(0, "MapiRecipientTest", MapiId(QString::fromAscii("1/1")));
+    MapiRecipient nameOnly(MapiRecipient::CC);
+    MapiRecipient full(MapiRecipient::To);
+    MapiRecipient emailOnly(MapiRecipient::BCC);
+
+    // A name seen first without an email picks it up later, along with the
+    // more specific type.
+    nameOnly.name = QString::fromAscii("Some One");
+    message.addUniqueRecipient("test", nameOnly);
+    full.name = QString::fromAscii("some one");
+    full.email = QString::fromAscii("some.one@example.com");
+    message.addUniqueRecipient("test", full);
+    emailOnly.email = QString::fromAscii("SOME.ONE@EXAMPLE.COM");
+    message.addUniqueRecipient("test", emailOnly);
+    QCOMPARE(message.recipients().size(), 1);
+    QCOMPARE(message.recipients().at(0).email, QString::fromAscii("some.one@example.com"));
+    QCOMPARE(message.recipients().at(0).type(), MapiRecipient::To);
+
+    // Someone else is added.
+    MapiRecipient other(MapiRecipient::To);
+    other.name = QString::fromAscii("Some Other");
+    other.email = QString::fromAscii("some.other@example.com");
+    message.addUniqueRecipient("test", other);
+    QCOMPARE(message.recipients().size(), 2);
+}
+
+void MapiRecipientTest::addUniqueRecipientBenchmark_data()
+{
+    QTest::addColumn<int>("recipients");
+
+    QTest::newRow("100") << 100;
+    QTest::newRow("2000") << 2000;
+    QTest::newRow("20000") << 20000;
+}
+
+void MapiRecipientTest::addUniqueRecipientBenchmark()
+{
+    QFETCH(int, recipients);
+
+    // Each recipient turns up three times, as from the recipient table and 
+    // the display strings: with name and email, by name alone, and by email
+    // alone in another case.
+    QList<MapiRecipient> candidates;
+    for (int i = 0; i < recipients; i++) {
+        MapiRecipient full(MapiRecipient::To);
+        MapiRecipient nameOnly(MapiRecipient::To);
+        MapiRecipient emailOnly(MapiRecipient::To);
+
+        full.name = QString::fromAscii("User %1").arg(i);
+        full.email = QString::fromAscii("user%1@example.com").arg(i);
+        nameOnly.name = full.name;
+        emailOnly.email = full.email.toUpper();
+        candidates << full << nameOnly << emailOnly;
+    }
+
+    QBENCHMARK {
+        MapiMessage message(0, "MapiRecipientTest", MapiId(QString::fromAscii("1/1")));
+
+        for (int i = 0; i < candidates.size(); i++) {
+            MapiRecipient candidate = candidates.at(i);
+
+            message.addUniqueRecipient("test", candidate);
+        }
+        QCOMPARE(message.recipients().size(), recipients);
+    }
+}
+
+QTEST_KDEMAIN_CORE(MapiRecipientTest)
+
+#include "mapirecipienttest.moc"
@@ -40,6 +40,7 @@
 #include <QtDBus/QDBusConnection>
 
 #include "mapiconnector2.h"
+#include "mapistatistics.h"
 #include "profiledialog.h"
 
 /**
@@ -60,6 +61,14 @@
 
 #define MEASURE_PERFORMANCE 1
 
+/**
+ * How often (in seconds) to save the local copy of the GAL while it is
+ * being fetched. It is always saved at the end.
+ */
+#ifndef GAL_INDEX_SAVE_INTERVAL
+#define GAL_INDEX_SAVE_INTERVAL 300
+#endif
+
 using namespace Akonadi;
 
 /**
@@ -620,7 +629,7 @@ public:
      * Fetch upto the requested number of entries from the GAL. The start
      * point is where we previously left off.
      */
-    bool read(unsigned entries, Item::List &contacts, unsigned *percentagePosition = 0)
+    bool read(unsigned entries, Item::List &contacts, unsigned *percentagePosition = 0, MapiGalIndexWriter *index = 0)
     {
         struct SRowSet *results = NULL;
 
@@ -642,6 +651,10 @@ public:
                 continue;
             }
 
+            if (index) {
+                indexInsert(contact, addressee, *index);
+            }
+
             Item item(contentMimeTypes()[0]);
             item.setParentCollection(*this);
             item.setRemoteId(addressee.name());
@@ -698,6 +711,43 @@ public:
     }
 
 private:
+    /**
+     * Make the entry findable in the index by display name, X500 DN and
+     * alias.
+     */
+    void indexInsert(SRow &contact, const KABC::Addressee &addressee, MapiGalIndexWriter &index)
+    {
+        QString smtp = addressee.preferredEmail();
+        QString email;
+        QString addressType;
+
+        if (!smtp.contains(QLatin1Char('@'))) {
+            return;
+        }
+        for (unsigned i = 0; i < contact.cValues; i++) {
+            MapiProperty property(contact.lpProps[i]);
+
+            switch (property.tag()) {
+            case PidTagDisplayName:
+                index.insert(property.value().toString(), smtp);
+                break;
+            case PidTagEmailAddress:
+                email = property.value().toString();
+                break;
+            case PidTagAddressType:
+                addressType = property.value().toString();
+                break;
+            case PidTagAccount:
+                index.insert(property.value().toString(), smtp);
+                break;
+            }
+        }
+        if (addressType == QLatin1String("EX")) {
+            index.insert(email, smtp);
+            index.insert(mapiExtractEmail(email, "EX"), smtp);
+        }
+    }
+
     /**
      * A reserved id is used to represent the GAL.
      */
@@ -711,7 +761,9 @@ ExGalResource::ExGalResource(const QString &id) :
     m_gal(new MapiGAL(m_connection, QStringList(m_itemMimeType))),
     m_msExchangeFetch(0),
     m_msAkonadiWrite(0),
-    m_msAkonadiWriteStatus(0)
+    m_msAkonadiWriteStatus(0),
+    m_galIndex(0),
+    m_galIndexDirty(false)
 {
     new SettingsAdaptor(Settings::self());
     QDBusConnection::sessionBus().registerObject(QLatin1String("/Settings"),
@@ -722,6 +774,10 @@ ExGalResource::ExGalResource(const QString &id) :
 
 ExGalResource::~ExGalResource()
 {
+    if (m_galIndexDirty) {
+        m_galIndex->save();
+    }
+    delete m_galIndex;
     delete m_gal;
 }
 
@@ -794,7 +850,7 @@ void ExGalResource::retrieveItems(const Akonadi::Collection &collection)
     Item::List items;
     Item::List deletedItems;
 
-    kError() << __FUNCTION__ << collection.name();
+    MAPI_LOG(Sync, kDebug()) << __FUNCTION__ << collection.name();
     MapiId id(collection.remoteId());
     if (!id.isValid()) {
         // This is the case for the 0/gal/galRoot See above.
@@ -834,11 +890,12 @@ void ExGalResource::retrieveItems(const Akonadi::Collection &collection)
 #endif
         cancelTask();
     } else {
-        // This request is NOT for the GAL. We don't bother with 
-        // streaming mode.
+        // This request is NOT for the GAL.
         setAutomaticProgressReporting(true);
-        fetchItems(collection, items, deletedItems);
-        kError() <<"calling retrieved"<<items.size() << deletedItems.size();
+        if (!fetchItems(collection, items, deletedItems)) {
+            return;
+        }
+        MAPI_LOG(Sync, kDebug()) <<"calling retrieved"<<items.size() << deletedItems.size();
         itemsRetrievedIncremental(items, deletedItems);
         itemsRetrievalDone();
         kDebug() << "new/changed items:" << items.size() << "deleted items:" << deletedItems.size();
@@ -863,6 +920,12 @@ void ExGalResource::fetchExchangeBatch()
         return;
     }
 
+    // Pick up the local copy of the GAL where we left off.
+    if (!m_galIndex) {
+        m_galIndex = new MapiGalIndexWriter(m_connection->galIndex().fileName());
+        m_galIndex->load();
+    }
+
     // Actually do the fetching.
     m_galItems.clear();
     const FetchStatusAttribute *fetchStatus = m_gal->offset();
@@ -876,6 +939,7 @@ void ExGalResource::fetchExchangeBatch()
                 return;
             }
             fetchStatus = m_gal->offset();
+            m_galIndex->clear();
         } else {
             kDebug() << "Finished fetching GAL" << savedDateTime;
             emit status(Running, i18n("Finished fetching GAL: %1", savedDateTime.toString()));
@@ -890,10 +954,19 @@ void ExGalResource::fetchExchangeBatch()
     m_msAkonadiWriteStatus = 0;
     m_msExchangeFetch -= QDateTime::currentMSecsSinceEpoch();
 #endif
-    if (!m_gal->read(requestedCount, m_galItems, &percentagePosition)) {
+    if (!m_gal->read(requestedCount, m_galItems, &percentagePosition, m_galIndex)) {
         error(i18n("Cannot fetch GAL: %1", mapiError()));
         return;
     }
+    if (m_galItems.size()) {
+        m_galIndexDirty = true;
+    }
+    if (m_galIndexDirty && (!m_galItems.size() || !m_galIndexSaved.isValid() ||
+                            (m_galIndexSaved.elapsed() > GAL_INDEX_SAVE_INTERVAL * 1000))) {
+        m_galIndex->save();
+        m_galIndexDirty = false;
+        m_galIndexSaved.start();
+    }
     emit percent(percentagePosition);
 #if MEASURE_PERFORMANCE
     m_msExchangeFetch += QDateTime::currentMSecsSinceEpoch();
@@ -1020,9 +1093,10 @@ void ExGalResource::updateAkonadiBatchStatusDone(KJob *job)
 bool ExGalResource::retrieveItem(const Akonadi::Item &itemOrig, const QSet<QByteArray> &parts)
 {
     Q_UNUSED(parts);
+    MapiLatency latency(m_statistics, MapiStatistics::RetrieveItem, itemOrig.parentCollection());
 
-    kError() << "GAL retrieveItem";
-    MapiContact *message = fetchItem<MapiContact>(itemOrig);
+    MAPI_LOG(Sync, kDebug()) << "GAL retrieveItem";
+    MapiContact *message = fetchItem<MapiContact>(itemOrig, itemOrig.parentCollection());
     if (!message) {
         return false;
     }
@@ -29,6 +29,7 @@ namespace Akonadi
 }
 class KJob;
 class MapiConnector2;
+class MapiGalIndexWriter;
 
 /**
  * This class gives acces both to the Global Address List (aka the GAL or the
@@ -68,6 +69,17 @@ private:
     qint64 m_msExchangeFetch;
     qint64 m_msAkonadiWrite;
     qint64 m_msAkonadiWriteStatus;
+
+    /**
+     * The local copy of the GAL, for use by the other resources.
+     */
+    MapiGalIndexWriter *m_galIndex;
+
+    /**
+     * Rewriting the index is costly, so it is only saved now and again.
+     */
+    bool m_galIndexDirty;
+    QTime m_galIndexSaved;
     void updateAkonadiBatchStatus(QString lastAddressee = QString());
 
 private Q_SLOTS:
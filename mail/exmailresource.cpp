@@ -39,6 +39,8 @@
 #include <kpimutils/email.h>
 
 #include "mapiconnector2.h"
+#include "mapistatistics.h"
+#include "mapitracer.h"
 #include "profiledialog.h"
 
 /**
@@ -78,6 +80,11 @@ public:
      */
     virtual bool propertiesPush();
 
+    /**
+     * Prepare the payload once batched recipients are resolved.
+     */
+    virtual bool recipientsResolved();
+
 protected:
     virtual QDebug debug() const;
     virtual QDebug error() const;
@@ -135,6 +142,10 @@ ExMailResource::ExMailResource(const QString &id) :
     QDBusConnection::sessionBus().registerObject(QLatin1String("/Settings"),
                              Settings::self(),
                              QDBusConnection::ExportAdaptors);
+
+    // Make new folders visible as soon as their envelopes are in, and fetch
+    // the bodies later.
+    m_envelopeSync = true;
 }
 
 ExMailResource::~ExMailResource()
@@ -147,6 +158,59 @@ const QString ExMailResource::profile()
     return Settings::self()->profileName();
 }
 
+MapiMessage::BodyFormat ExMailResource::bodyFormat()
+{
+    switch (Settings::self()->bodyFormat()) {
+    case Settings::TextBody:
+        return MapiMessage::BodyText;
+    case Settings::TextAndHtmlBody:
+        return MapiMessage::BodyTextAndHtml;
+    default:
+        return MapiMessage::BodyNative;
+    }
+}
+
+void ExMailResource::syncWindow(const Akonadi::Collection &collection, MapiFolder &folder)
+{
+    unsigned days = Settings::self()->syncWindowDays();
+
+    if (!days || Settings::self()->syncWindowFullCollections().contains((int)collection.id())) {
+        return;
+    }
+    folder.setWindow(PidTagMessageDeliveryTime, PidTagMessageDeliveryTime,
+                     QDateTime::currentDateTime().addDays(-(int)days), QDateTime());
+}
+
+void ExMailResource::envelopePayload(const MapiItem &data, Akonadi::Item &item)
+{
+    KMime::Message::Ptr message(new KMime::Message);
+
+    message->subject()->fromUnicodeString(data.subject(), "utf-8");
+    if (!data.sender().isEmpty() || !data.senderEmail().isEmpty()) {
+        message->from()->addAddress(data.senderEmail().toUtf8(), data.sender());
+    }
+    if (data.delivered().isValid()) {
+        message->date()->setDateTime(KDateTime(data.delivered()));
+    }
+    if (!data.messageId().isEmpty()) {
+        message->messageID()->from7BitString(data.messageId().toAscii());
+    }
+    if (!data.conversationIndex().isEmpty()) {
+        // Outlook carries the conversation index in this header.
+        message->setHeader(new KMime::Headers::Generic("Thread-Index", message.get(),
+                                                       QString::fromAscii(data.conversationIndex().toBase64()), "utf-8"));
+    }
+    message->assemble();
+    item.setPayload<KMime::Message::Ptr>(message);
+    item.setSize(data.size());
+    if (data.flags() & MSGFLAG_READ) {
+        item.setFlag(Akonadi::MessageFlags::Seen);
+    }
+    if (data.flags() & MSGFLAG_HASATTACH) {
+        item.setFlag(Akonadi::MessageFlags::HasAttachment);
+    }
+}
+
 void ExMailResource::retrieveCollections()
 {
     Collection::List collections;
@@ -163,28 +227,71 @@ void ExMailResource::retrieveItems(const Akonadi::Collection &collection)
     Item::List items;
     Item::List deletedItems;
 
-    fetchItems(collection, items, deletedItems);
-    kError() << "new/changed items:" << items.size() << "deleted items:" << deletedItems.size();
+    if (!fetchItems(collection, items, deletedItems)) {
+        return;
+    }
+    MAPI_LOG(Sync, kDebug()) << "new/changed items:" << items.size() << "deleted items:" << deletedItems.size();
 #if (DEBUG_NOTE_PROPERTIES)
     while (items.size() > 3) {
         items.removeLast();
     }
 #endif
     itemsRetrievedIncremental(items, deletedItems);
+    itemsRetrievalDone();
 }
 
 bool ExMailResource::retrieveItem(const Akonadi::Item &itemOrig, const QSet<QByteArray> &parts)
 {
     Q_UNUSED(parts);
+    MapiLatency latency(m_statistics, MapiStatistics::RetrieveItem, itemOrig.parentCollection());
+
+    // Create a clone of the passed in const Item and fill it with the payload.
+    Akonadi::Item item(itemOrig);
+    Akonadi::Item prefetched;
+    if (prefetchTake(itemOrig, prefetched)) {
+        item.setPayload<KMime::Message::Ptr>(prefetched.payload<KMime::Message::Ptr>());
+    } else if (!payloadFetch(item)) {
+        return false;
+    }
+
+    // Notify Akonadi about the new data.
+    itemRetrieved(item);
+    return true;
+}
 
-    MapiNote *message = fetchItem<MapiNote>(itemOrig);
+unsigned ExMailResource::prefetchBudget()
+{
+    return Settings::self()->prefetchBytesPerMinute();
+}
+
+unsigned ExMailResource::slowItemThreshold()
+{
+    return Settings::self()->slowItemMilliseconds();
+}
+
+void ExMailResource::payloadFetch(Akonadi::Item::List &items)
+{
+    QList<MapiNote *> messages = fetchItemBatch<MapiNote>(items);
+    Akonadi::Item::List fetched;
+
+    for (int i = 0; i < items.size(); i++) {
+        if (messages.at(i)) {
+            KMime::Message::Ptr ptr(messages.at(i));
+
+            items[i].setPayload<KMime::Message::Ptr>(ptr);
+            fetched << items.at(i);
+        }
+    }
+    items = fetched;
+}
+
+bool ExMailResource::payloadFetch(Akonadi::Item &item)
+{
+    MapiNote *message = fetchItem<MapiNote>(item, item.parentCollection());
     if (!message) {
         return false;
     }
     KMime::Message::Ptr ptr(message);
-
-    // Create a clone of the passed in const Item and fill it with the payload.
-    Akonadi::Item item(itemOrig);
 /*
     item.setMimeType(KMime::Message::mimeType());
     item.setPayload(KMime::Message::Ptr(message));
@@ -206,9 +313,6 @@ bool ExMailResource::retrieveItem(const Akonadi::Item &itemOrig, const QSet<QByt
     //item.setModificationTime(message->modified);
 */
     item.setPayload<KMime::Message::Ptr>(ptr);
-
-    // Notify Akonadi about the new data.
-    itemRetrieved(item);
     return true;
 }
 
@@ -239,7 +343,9 @@ void ExMailResource::configure(WId windowId)
 void ExMailResource::itemAdded( const Akonadi::Item &item, const Akonadi::Collection &collection )
 {
     Q_UNUSED( item );
-    Q_UNUSED( collection );
+
+    // Akonadi now has an item which the sync index does not know about.
+    syncIndexInvalidate(collection);
 
     // TODO: this method is called when somebody else, e.g. a client application,
     // has created an item in a collection managed by your resource.
@@ -257,7 +363,7 @@ void ExMailResource::itemChanged(const Akonadi::Item &item, const QSet<QByteArra
     Q_UNUSED(parts);
 
     // Get the payload for the item.
-    kWarning() << "fetch cached item: {" <<
+    MAPI_LOG(Sync, kDebug()) << "fetch cached item: {" <<
         item.parentCollection().name() << "," << item.id() << "} = {" <<
         item.parentCollection().remoteId() << "," << item.remoteId() << "}";
     Akonadi::ItemFetchJob *job = new Akonadi::ItemFetchJob(item);
@@ -277,7 +383,7 @@ void ExMailResource::itemChangedContinue(KJob* job)
     Akonadi::ItemFetchJob *fetchJob = qobject_cast<Akonadi::ItemFetchJob*>(job);
     const Akonadi::Item item = fetchJob->items().first();
 
-    MapiNote *message = fetchItem<MapiNote>(item);
+    MapiNote *message = fetchItem<MapiNote>(item, item.parentCollection());
     if (!message) {
         return;
     }
@@ -336,7 +442,7 @@ void ExMailResource::itemChangedContinue(KJob* job)
     // TODO add further data
 
     // Update exchange with the new message.
-    kWarning() << "updating item: {" << 
+    MAPI_LOG(Sync, kDebug()) << "updating item: {" << 
         currentCollection().name() << "," << item.id() << "} = {" << 
         folderId << "," << messageId << "}";
     emit status(Running, i18n("Updating item: { %1, %2 }", currentCollection().name(), messageId));
@@ -351,7 +457,8 @@ void ExMailResource::itemChangedContinue(KJob* job)
 
 void ExMailResource::itemRemoved( const Akonadi::Item &item )
 {
-  Q_UNUSED( item );
+  // Akonadi no longer has an item which the sync index knows about.
+  syncIndexInvalidate(item.parentCollection());
 
   // TODO: this method is called when somebody else, e.g. a client application,
   // has deleted an item managed by your resource.
@@ -368,7 +475,8 @@ MapiEmbeddedNote::MapiEmbeddedNote(MapiConnector2 *connector, const char *talloc
 
 bool MapiEmbeddedNote::open()
 {
-    if (MAPI_E_SUCCESS != OpenEmbeddedMessage(m_parentAttachment, &m_object, MAPI_READONLY)) {
+    MapiTrace trace(MapiTracer::OpenEmbeddedMessage, m_id.second);
+    if (MAPI_E_SUCCESS != trace(OpenEmbeddedMessage(m_parentAttachment, &m_object, MAPI_READONLY))) {
         error() << "cannot open embedded message, error:" << mapiError();
         return false;
     }
@@ -551,8 +659,6 @@ DONE:
 
     // Walk through the properties and extract the values of interest. The
     // properties here should be aligned with the list pulled above.
-    bool textStream = false;
-    bool htmlStream = false;
     for (unsigned i = 0; i < m_propertyCount; i++) {
         MapiProperty property(m_properties[i]);
 
@@ -578,11 +684,9 @@ DONE:
             subject()->fromUnicodeString(property.value().toString(), "utf-8");
             break;
 #endif
-        case PidTagBody:
-            textBody = property.value().toString();
-            break;
-        case PidTagHtml:
-            htmlBody = property.value().toString();
+        case PidTagNativeBody:
+        case PidTagRtfInSync:
+            // Handled by bodyPull().
             break;
         case PidTagTransportMessageHeaders:
             break;
@@ -592,26 +696,7 @@ DONE:
             break;
 #endif
         default:
-            // Handle oversize objects.
-            if (MAPI_E_NOT_ENOUGH_MEMORY == property.value().toInt()) {
-                switch (property.tag()) {
-                case PidTagBody_Error:
-                    textStream = true;
-                    break;
-                case PidTagHtml_Error:
-                    htmlStream = true;
-                    break;
-                default:
-                    error() << "missing oversize support:" << tagName(property.tag());
-                    break;
-                }
-
-                // Carry on with next property...
-                break;
-            }
-#if (DEBUG_NOTE_PROPERTIES)
-            debug() << "ignoring note property:" << tagName(property.tag()) << property.toString();
-#endif
+            MAPI_LOG(Payloads, debug()) << "ignoring note property:" << tagName(property.tag()) << property.toString();
             break;
         }
     }
@@ -636,15 +721,12 @@ DONE:
         }
     }
 
-    // We get the PidTagBody as Unicode in any event, but we also now know
-    // the codepage for PidTagHtml.
-    if (textStream && !streamRead(&m_object, PidTagBody, CODEPAGE_UTF16, textBody)) {
-        return false;
-    }
-    if (htmlStream && !streamRead(&m_object, PidTagHtml, codepage, htmlBody)) {
+    // Now that we know the codepage for PidTagHtml, fetch whichever body
+    // formats we need.
+    if (!bodyPull(codepage, textBody, htmlBody)) {
         return false;
     }
-    error() << "text size:" << textBody.size() << "html size:" << htmlBody.size() << "attachments:" << hasAttachments << "mimeType:" << contentType()->mimeType() << "isEmbedded:" << dynamic_cast<MapiEmbeddedNote*>(this);
+    MAPI_LOG(Payloads, debug()) << "text size:" << textBody.size() << "html size:" << htmlBody.size() << "attachments:" << hasAttachments << "mimeType:" << contentType()->mimeType() << "isEmbedded:" << dynamic_cast<MapiEmbeddedNote*>(this);
 
     // If we don't have a Content-Type, then one will be automatically added.
     // Unfortunately, when that happens, we seem to get some bogus, empty
@@ -718,10 +800,13 @@ DONE:
 
     // Short circuit exit if there are no attachments.
     if (!hasAttachments) {
+        MapiPhase mime(m_phases, "mime");
         assemble();
         return true;
     }
-    if (MAPI_E_SUCCESS != GetAttachmentTable(&m_object, &m_attachments)) {
+    MapiPhase tablePhase(m_phases, "attachments");
+    MapiTrace trace(MapiTracer::GetAttachmentTable, m_id.second);
+    if (MAPI_E_SUCCESS != trace(GetAttachmentTable(&m_object, &m_attachments))) {
         error() << "cannot get attachment table:" << mapiError();
         return false;
     }
@@ -753,21 +838,28 @@ DONE:
         (sizeof(attachmentTagList) / sizeof(attachmentTagList[0])) - 1,
         (MAPITAGS *)attachmentTagList };
 
-    if (MAPI_E_SUCCESS != SetColumns(&m_attachments, &attachmentTags)) {
+    trace.restart(MapiTracer::SetColumns);
+    if (MAPI_E_SUCCESS != trace(SetColumns(&m_attachments, &attachmentTags))) {
         error() << "cannot set attachment table columns:" << mapiError();
         return false;
     }
 
     // Get current cursor position.
     uint32_t cursor;
-    if (MAPI_E_SUCCESS != QueryPosition(&m_attachments, NULL, &cursor)) {
+    trace.restart(MapiTracer::QueryPosition);
+    if (MAPI_E_SUCCESS != trace(QueryPosition(&m_attachments, NULL, &cursor))) {
         error() << "cannot query attachments position:" << mapiError();
         return false;
     }
+    tablePhase.finish();
 
     // Iterate through sets of rows.
     SRowSet rowset;
-    while ((QueryRows(&m_attachments, cursor, TBL_ADVANCE, &rowset) == MAPI_E_SUCCESS) && rowset.cRows) {
+    while (true) {
+        trace.restart(MapiTracer::QueryRows);
+        if ((trace(QueryRows(&m_attachments, cursor, TBL_ADVANCE, &rowset)) != MAPI_E_SUCCESS) || !rowset.cRows) {
+            break;
+        }
         for (unsigned i = 0; i < rowset.cRows; i++) {
             SRow &row = rowset.aRow[i];
             unsigned number = 0;
@@ -822,13 +914,12 @@ DONE:
                     contentBase = property.value().toString();
                     break;
                 default:
-#if (DEBUG_NOTE_PROPERTIES)
-                    debug() << "ignoring attachment property:" << tagName(property.tag()) << property.toString();
-#endif
+                    MAPI_LOG(Payloads, debug()) << "ignoring attachment property:" << tagName(property.tag()) << property.toString();
                     break;
                 }
             }
 
+            MapiPhase attachmentPhase(m_phases, "attachment", number);
             QByteArray bytes;
             KMime::Content *attachment;
             MapiEmbeddedNote *embeddedMsg;
@@ -838,7 +929,8 @@ DONE:
                 if (UINT_MAX > (index = propertyFind(PidTagAttachDataBinary))) {
                     bytes = propertyAt(index).toByteArray();
                 } else {
-                    if (MAPI_E_SUCCESS != OpenAttach(&m_object, number, &m_attachment)) {
+                    trace.restart(MapiTracer::OpenAttach);
+                    if (MAPI_E_SUCCESS != trace(OpenAttach(&m_object, number, &m_attachment))) {
                         error() << "cannot open attachment" << mapiError();
                         return false;
                     }
@@ -869,15 +961,18 @@ DONE:
                 }
                 attachment->setBody(bytes);
                 addContent(attachment);
+                attachmentPhase.setSize(bytes.size());
                 break;
             case ATTACH_EMBEDDED_MSG:
-                if (MAPI_E_SUCCESS != OpenAttach(&m_object, number, &m_attachment)) {
+                trace.restart(MapiTracer::OpenAttach);
+                if (MAPI_E_SUCCESS != trace(OpenAttach(&m_object, number, &m_attachment))) {
                     error() << "cannot open embedded attachment" << mapiError();
                     return false;
                 }
                 {
                 MapiId attachmentId(m_id, (mapi_id_t)number);
                 embeddedMsg = new MapiEmbeddedNote(m_connection, "MapiEmbeddedNote", attachmentId, &m_attachment);
+                embeddedMsg->setBodyFormat(m_bodyFormat);
                 }
                 if (!embeddedMsg->open()) {
                     return false;
@@ -913,6 +1008,7 @@ DONE:
             mapi_object_init(&m_attachment);
         }
     }
+    MapiPhase mime(m_phases, "mime");
     assemble();
     return true;
 }
@@ -1015,24 +1111,24 @@ bool MapiNote::propertiesPull(QVector<int> &tags, const bool tagsAppended, bool
         //PidTagSubject,
         // 2.2.1.47
         //PidTagMessageRecipients,
-        // 2.2.1.48.1
-        PidTagBody,
+        // 2.2.1.48.1 (fetched by bodyPull())
+        //PidTagBody,
         // 2.2.1.48.2
-        //PidTagNativeBody,
+        PidTagNativeBody,
         // 2.2.1.48.3
         //PidTagBodyHtml,
         // 2.2.1.48.4
         //PidTagRtfCompressed,
         // 2.2.1.48.5
-        //PidTagRtfInSync,
+        PidTagRtfInSync,
         // 2.2.1.48.6
         //PidTagInternetCodepage,
         // 2.2.1.48.7
         //PidTagBodyContentId,
         // 2.2.1.48.8
         //PidTagBodyContentLocation,
-        // 2.2.1.48.9
-        PidTagHtml,
+        // 2.2.1.48.9 (fetched by bodyPull())
+        //PidTagHtml,
         // 2.2.2.3
         //PidTagCreationTime,
         // ???
@@ -1054,12 +1150,21 @@ bool MapiNote::propertiesPull(QVector<int> &tags, const bool tagsAppended, bool
     if (!MapiMessage::propertiesPull(tags, tagsAppended, pullAll)) {
         return false;
     }
+    if (m_recipientBatch) {
+        // Wait for recipientsResolved().
+        return true;
+    }
     if (!preparePayload()) {
         return false;
     }
     return true;
 }
 
+bool MapiNote::recipientsResolved()
+{
+    return preparePayload();
+}
+
 bool MapiNote::propertiesPull()
 {
     static bool tagsAppended = false;
@@ -1089,25 +1194,25 @@ bool MapiNote::propertiesPush()
     if (!MapiMessage::propertiesPush()) {
         return false;
     }
-    debug() << "************  OpenFolder";
+    MAPI_LOG(Messages, debug()) << "************  OpenFolder";
     if (!OpenFolder(&m_store, folder.id(), folder.d())) {
         error() << "cannot open folder" << folderID
             << ", error:" << mapiError();
         return false;
         }
-    debug() << "************  SaveChangesMessage";
+    MAPI_LOG(Messages, debug()) << "************  SaveChangesMessage";
     if (!SaveChangesMessage(folder.d(), message.d(), KeepOpenReadWrite)) {
         error() << "cannot save message" << messageID << "in folder" << folderID
             << ", error:" << mapiError();
         return false;
     }
-    debug() << "************  SubmitMessage";
+    MAPI_LOG(Messages, debug()) << "************  SubmitMessage";
     if (MAPI_E_SUCCESS != SubmitMessage(&m_object)) {
         error() << "cannot submit message, error:" << mapiError();
         return false;
     }
     struct mapi_SPropValue_array replyProperties;
-    debug() << "************  TransportSend";
+    MAPI_LOG(Messages, debug()) << "************  TransportSend";
     if (MAPI_E_SUCCESS != TransportSend(&m_object, &replyProperties)) {
         error() << "cannot send message, error:" << mapiError();
         return false;
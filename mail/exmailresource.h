@@ -33,6 +33,19 @@ public:
 
     virtual const QString profile();
 
+    virtual MapiMessage::BodyFormat bodyFormat();
+
+    virtual void syncWindow(const Akonadi::Collection &collection, MapiFolder &folder);
+
+    virtual void envelopePayload(const MapiItem &data, Akonadi::Item &item);
+
+    virtual unsigned prefetchBudget();
+
+    virtual unsigned slowItemThreshold();
+
+    virtual bool payloadFetch(Akonadi::Item &item);
+    virtual void payloadFetch(Akonadi::Item::List &items);
+
 public Q_SLOTS:
     virtual void configure(WId windowId);
 